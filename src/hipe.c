@@ -20,6 +20,10 @@
 */
 
 #include "hipe.h"
+#include "hipe_replay.h"
+#include "hipe_trace.h"
+#include "hipe_uring.h"
+#include "hipe_shm.h"
 #include "common.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,35 +37,145 @@
 #include <string.h>
 #include <sys/un.h> /*for struct sockaddr_un*/
 #include <pthread.h>
+#include <time.h>
 
-#define READ_BUFFER_SIZE 128 /*this choice is arbitrary.*/
+#define READ_BUFFER_SIZE 4096
 /* Defines the size (in bytes) of the read buffer into which instruction data is
  * read in from the display server. Data read in a single read operation may
  * correspond to one or more instructions, or even a fragment of a single
  * large instruction. A larger value of READ_BUFFER_SIZE will allow more data to
  * be read in a single read operation, but there is no guarantee that the
  * hiped display server process will often send large chunks of data at once.
- * A smaller value of READ_BUFFER_SIZE will require more consecutive read
- * operations to read in the same data, but will process incoming data with
- * greater regularity when there is a large stream of data incoming. */
+ * How long read_to_queue() keeps reading is limited by time and by its read budget
+ * (see below), rather than by a number of reads, so a large stream of incoming data
+ * is still processed with regularity. */
+
+#define BATCH_FLUSH_SIZE 65536
+/*while a session is corked, outgoing instructions are collected in its batch buffer and sent
+ *together once this many bytes are waiting, or when the session is uncorked.*/
+
+#define FRAME_TABLE_MIN 64
+/*initial number of slots in the table of mutations held for the next frame (always a power of two).*/
+
+#define RECONNECT_ATTEMPTS 8
+#define RECONNECT_DELAY 5
+/*after the connection is lost, a session with reconnection turned on tries to connect again this many times,
+ *waiting RECONNECT_DELAY milliseconds after the first attempt and twice as long after each one after that
+ *(about 0.6 seconds in all), to give a restarting server time to start listening.*/
+
+#define TRACE_REQUESTS_MAX 1024
+/*the most requests awaiting replies that are kept, while tracing, to link each to its reply. If the server
+ *falls further behind than this, the oldest are given up on.*/
+
+#define READ_LATENCY_DEFAULT 1000
+/*microseconds that read_to_queue() may spend reading and decoding what has arrived before it returns, unless
+ *changed with hipe_set_read_latency(). Once that long has passed, anything more is left to the next call, so the
+ *instructions already decoded can be handled without waiting for a long stream of data to be read.*/
+
+#define READ_BUDGET_INITIAL 65536
+#define READ_BUDGET_MIN READ_BUFFER_SIZE
+#define READ_BUDGET_MAX (4 * 1024 * 1024)
+/*read_to_queue() also stops after reading its read budget of bytes. The budget is the amount expected to take
+ *the read latency to decode, at the rate measured in earlier calls (starting from READ_BUDGET_INITIAL), so the
+ *time limit is seldom reached, and data beyond the budget is left with the server to hold back.*/
+
+struct queued_instruction { /*instructions are queued in this wrapper to record their arrival order.*/
+    hipe_instruction instruction; /*must be first: a hipe_instruction* in a lane is also a queued_instruction* */
+    uint64_t sequence;
+};
 
-#define MAX_READS 50
-/*the maximum number of consecutive read operations that can be completed
- *without a return.*/
+struct instruction_lane {
+    hipe_instruction* oldestInstruction;
+    hipe_instruction* newestInstruction;
+    short priority;
+    unsigned burst;  /*maximum consecutive instructions served while lower priority lanes wait (0: no limit)*/
+    unsigned served; /*consecutive instructions served from this lane*/
+};
 
 struct _hipe_session { /*all session-specific state variables go here!*/
     int connection_fd; /*File descriptor for the connection, or -1 when disconnected.*/
+    int retiredFd; /*a lost connection's descriptor, shut down but kept open until release_connection(), or -1*/
+    struct hipe_uring* uring; /*the connection's io_uring, or null if it is read and written directly*/
+    struct hipe_shm* shm; /*the rings shared with the server, or null if instructions go over the connection*/
 
     pthread_mutex_t send_lock; //this mutex is used to make sending outgoing
     //instructions threadsafe.
 
     char readBuffer[READ_BUFFER_SIZE];
+    unsigned readLatency; /*microseconds that a call to read_to_queue() may spend once it has read something*/
+    size_t readBudget; /*bytes that a call to read_to_queue() may read*/
+    double readRate; /*bytes read and decoded per microsecond: a moving average over calls that read enough to tell*/
     instruction_encoder outgoingInstruction;
     instruction_decoder incomingInstruction;
 
-    /*linked list queue of incoming instructions:*/
-    hipe_instruction* oldestInstruction;
-    hipe_instruction* newestInstruction;
+    /*incoming instruction queue: one linked list per lane.*/
+    struct instruction_lane lanes[HIPE_LANES];
+    char laneOf[256]; /*lane for each opcode value*/
+    size_t queuedInstructions; /*total over all lanes*/
+    uint64_t arrivals; /*sequence number given to the most recently queued instruction*/
+    uint64_t lastSequence; /*sequence number of the most recently dequeued instruction*/
+    short queueOrder;
+    short lastLane; /*lane that the most recent hipe_next_instruction call was served from*/
+
+    /*event coalescing rules set by hipe_set_coalescing():*/
+    struct coalesce_rule* coalesceRules;
+    size_t coalesceRuleCount;
+
+    /*outgoing batch, while corked by hipe_cork(). Protected by send_lock.*/
+    unsigned corked; /*number of hipe_cork() calls not yet matched by hipe_uncork()*/
+    char* batch;
+    size_t batchLength;
+    size_t batchCapacity;
+
+    /*mutations held for the next frame, while frame pacing is on. Protected by send_lock.*/
+    unsigned frameInterval; /*milliseconds between frames, or 0 when frame pacing is off*/
+    struct timespec frameStart; /*when the oldest held mutation was sent*/
+    struct frame_mutation* frame; /*in the order they were sent*/
+    size_t frameLength; /*including mutations that have been replaced*/
+    size_t frameCapacity;
+    size_t* frameTable; /*open-addressed: 1 + index into frame of the live mutation for each location and property*/
+    hipe_loc* frameLocations; /*open-addressed set of the locations with mutations held*/
+    size_t frameTableSize;
+
+    /*what is needed to connect again, and rebuild the frame, if the connection is lost (see hipe_set_reconnect()).*/
+    char socketPath[200];
+    char keyPath[200];
+    char hostKey[200]; /*the key that the container was granted with*/
+    char* clientName;
+    struct hipe_replay* replay; /*log of the instructions that built the frame, or null if reconnection is off*/
+    short reconnecting; /*set (under send_lock) while connecting again: other threads can't send meanwhile*/
+    pthread_t reconnector; /*the thread that is connecting again, which sends the instructions rebuilding the frame*/
+    short replaying; /*set while the frame is being rebuilt: instructions are sent and received untranslated*/
+    short denied; /*set once the server has denied access, after which there is no point connecting again*/
+    hipe_instruction* replayReplies; /*replies to the instructions sent while rebuilding the frame, oldest first*/
+    hipe_instruction* newestReplayReply;
+
+    /*requests awaiting replies, oldest first, while tracing (see hipe_trace_start()). Protected by send_lock.*/
+    struct trace_request* traceRequests;
+    size_t traceRequestCount;
+    size_t traceRequestCapacity;
+};
+
+struct trace_request { /*a request that the server will reply to, and the flow that links it to the reply.*/
+    char replyOpcode;
+    uint64_t flow;
+};
+
+struct frame_mutation { /*a HIPE_OP_SET_TEXT or HIPE_OP_SET_STYLE held back until the next frame.*/
+    hipe_loc location;
+    char opcode;
+    char* property; /*arg[0] of a HIPE_OP_SET_STYLE (null for HIPE_OP_SET_TEXT)*/
+    size_t propertyLength;
+    char* encoded; /*the encoded instruction, sent as is when the frame is flushed*/
+    size_t encodedLength;
+    short live; /*0 once replaced by a later write to the same location and property*/
+};
+
+struct coalesce_rule {
+    uint64_t requestor; /*the event subscription the rule applies to*/
+    short policy;
+    hipe_instruction* pending; /*the subscription's most recently queued event, while still in the queue*/
+    uint64_t folded; /*number of events that pending represents*/
 };
 
 int read_to_queue(hipe_session session, int blocking);
@@ -74,8 +188,64 @@ void hipe_session_init(struct _hipe_session* obj) {
     instruction_encoder_init(&obj->outgoingInstruction);
     instruction_decoder_init(&obj->incomingInstruction);
     pthread_mutex_init(&obj->send_lock, NULL);
-    obj->oldestInstruction = 0;
-    obj->newestInstruction = 0;
+    obj->uring = 0;
+    obj->shm = 0;
+    obj->retiredFd = -1;
+    obj->readLatency = READ_LATENCY_DEFAULT;
+    obj->readBudget = READ_BUDGET_INITIAL;
+    obj->readRate = 0;
+    short lane;
+    for(lane=0; lane<HIPE_LANES; lane++) {
+        obj->lanes[lane].oldestInstruction = 0;
+        obj->lanes[lane].newestInstruction = 0;
+        obj->lanes[lane].priority = lane;
+        obj->lanes[lane].burst = 0;
+        obj->lanes[lane].served = 0;
+    }
+    memset(obj->laneOf, HIPE_LANE_EVENT, sizeof(obj->laneOf));
+    obj->laneOf[(unsigned char) HIPE_OP_CONTAINER_GRANT] = HIPE_LANE_REPLY;
+    obj->laneOf[(unsigned char) HIPE_OP_LOCATION_RETURN] = HIPE_LANE_REPLY;
+    obj->laneOf[(unsigned char) HIPE_OP_CONTENT_RETURN] = HIPE_LANE_REPLY;
+    obj->laneOf[(unsigned char) HIPE_OP_DIALOG_RETURN] = HIPE_LANE_REPLY;
+    obj->laneOf[(unsigned char) HIPE_OP_FRAME_CLOSE] = HIPE_LANE_FRAME;
+    obj->queuedInstructions = 0;
+    obj->arrivals = 0;
+    obj->lastSequence = 0;
+    obj->queueOrder = HIPE_ORDER_ARRIVAL;
+    obj->lastLane = -1;
+    obj->coalesceRules = 0;
+    obj->coalesceRuleCount = 0;
+    obj->corked = 0;
+    obj->batch = 0;
+    obj->batchLength = 0;
+    obj->batchCapacity = 0;
+    obj->frameInterval = 0;
+    obj->frame = 0;
+    obj->frameLength = 0;
+    obj->frameCapacity = 0;
+    obj->frameTable = 0;
+    obj->frameLocations = 0;
+    obj->frameTableSize = 0;
+    obj->clientName = 0;
+    obj->replay = 0;
+    obj->reconnecting = 0;
+    obj->replaying = 0;
+    obj->denied = 0;
+    obj->replayReplies = 0;
+    obj->newestReplayReply = 0;
+    obj->traceRequests = 0;
+    obj->traceRequestCount = 0;
+    obj->traceRequestCapacity = 0;
+}
+
+static void drop_replay_replies(struct _hipe_session* obj) {
+    while(obj->replayReplies) {
+        hipe_instruction* next = obj->replayReplies->next;
+        hipe_instruction_clear(obj->replayReplies);
+        free(obj->replayReplies);
+        obj->replayReplies = next;
+    }
+    obj->newestReplayReply = 0;
 }
 
 void hipe_session_clear(struct _hipe_session* obj) {
@@ -83,6 +253,15 @@ void hipe_session_clear(struct _hipe_session* obj) {
     instruction_encoder_clear(&obj->outgoingInstruction);
     instruction_decoder_clear(&obj->incomingInstruction);
     pthread_mutex_destroy(&obj->send_lock);
+    free(obj->coalesceRules);
+    free(obj->batch);
+    free(obj->frame);
+    free(obj->frameTable);
+    free(obj->frameLocations);
+    free(obj->clientName);
+    replay_destroy(obj->replay);
+    free(obj->traceRequests);
+    drop_replay_replies(obj);
 }
 
 void hipe_disconnect(hipe_session session) {
@@ -92,10 +271,128 @@ void hipe_disconnect(hipe_session session) {
  * Postcondition: the session's file descriptor is set to -1. Other functions should check for this
  * before attempting to transmit or receive data. */
 
-    if(session->connection_fd == -1) return; //already disconnected.
-    shutdown(session->connection_fd, SHUT_RDWR);
-    close(session->connection_fd);
-    session->connection_fd = -1;
+    /*a sending thread and the receiving thread may both find the connection broken at once.*/
+    int fd = __atomic_exchange_n(&session->connection_fd, -1, __ATOMIC_SEQ_CST);
+    if(fd == -1) return; //already disconnected.
+    shutdown(fd, SHUT_RDWR); /*so that a receive in progress, on this thread or another, ends straight away*/
+    /*the other thread may still be using the descriptor, the io_uring or the shared memory rings, so they are
+      only marked as lost here, and freed by release_connection().*/
+    session->retiredFd = fd;
+}
+
+static void release_connection(hipe_session session)
+/*frees what is left of a lost connection. Called by the thread receiving instructions (or when the session
+ *is closed), with send_lock held, so that neither a send nor a receive can be using it.*/
+{
+    uring_destroy(session->uring);
+    session->uring = 0;
+    shm_destroy(session->shm);
+    session->shm = 0;
+    if(session->retiredFd != -1) close(session->retiredFd);
+    session->retiredFd = -1;
+}
+
+static int read_keyfile(const char* keyPath, char* key)
+/*reads a host key from a keyfile into key (200 bytes). Returns 0, or -1 (having printed why) on failure.*/
+{
+    FILE* keyfile;
+    keyfile = fopen(keyPath, "r");
+    if(!keyfile) { /*could not open keyfile*/
+        fprintf(stderr, "Hipe: Could not open keyfile: %s\n", keyPath);
+        perror("Hipe");
+        return -1;
+    }
+    if(!fgets(key, 200, keyfile)) {
+        fprintf(stderr, "Hipe: Could not read key from keyfile: %s\n", keyPath);
+        perror("Hipe");
+        fclose(keyfile);
+        return -1;
+    }
+    fclose(keyfile);
+    return 0;
+}
+
+static int connect_socket(const char* sockPath)
+/*connects to the host socket. Returns the file descriptor, or -1 on failure.*/
+{
+    int fd;
+    /*Allocate a socket endpoint file descriptor.*/
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("Hipe: socket");
+        return -1;
+    }
+
+    struct sockaddr_un remote;
+    remote.sun_family = AF_UNIX;
+    strcpy(remote.sun_path, sockPath);
+    int len = strlen(remote.sun_path) + sizeof(remote.sun_family);
+    if (connect(fd, (struct sockaddr *)&remote, len) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int request_container(hipe_session session, const char* key, const char* clientName,
+                             short (*await)(hipe_session, hipe_instruction*, short))
+/*requests a container using a given host key, and awaits the response with the given function.
+  Returns 0 if the container request is granted, otherwise -1.*/
+{
+    hipe_instruction rq;
+    hipe_instruction_init(&rq);
+    rq.opcode = HIPE_OP_REQUEST_CONTAINER;
+    rq.location = 0;
+    rq.requestor = getpid();
+    rq.arg[0] = (char*) key;
+    rq.arg_length[0] = strlen(key);
+    rq.arg[1] = (char*) clientName;
+    rq.arg_length[1] = strlen(clientName);
+    struct hipe_shm* shm = shm_create(session->connection_fd); /*null unless built with HIPE_USE_SHM*/
+    if(shm) {
+        /*offer the server rings in shared memory, passing their descriptors along with the request.*/
+        rq.arg[2] = (char*) SHM_OFFER;
+        rq.arg_length[2] = strlen(SHM_OFFER);
+        instruction_encoder encoder;
+        instruction_encoder_init(&encoder);
+        instruction_encoder_encodeinstruction(&encoder, rq);
+        pthread_mutex_lock(&session->send_lock);
+        if(shm_offer(shm, encoder.encoded_output, encoder.encoded_length)) hipe_disconnect(session);
+        pthread_mutex_unlock(&session->send_lock);
+        instruction_encoder_clear(&encoder);
+    } else {
+        hipe_send_instruction(session, rq);
+    }
+
+    hipe_instruction incoming;
+    hipe_instruction_init(&incoming);
+    int result;
+    result = await(session, &incoming, HIPE_OP_CONTAINER_GRANT);
+    if(result<0) {
+        fprintf(stderr, "Hipe: Bad connection.\n");
+        shm_destroy(shm);
+        return -1;
+    }
+    if(incoming.arg[0][0] != '1') {
+        fprintf(stderr, "Hipe: Container request denied.\n");
+        hipe_instruction_clear(&incoming);
+        shm_destroy(shm);
+        return -1;
+    } else {
+        //fprintf(stderr, "Hipe: Container request granted!\n"); /*uncomment for extra verbosity*/
+    }
+    if(shm && incoming.arg_length[1] == strlen(SHM_OFFER) && !memcmp(incoming.arg[1], SHM_OFFER, strlen(SHM_OFFER))) {
+        /*the server has taken up the offer: from now on, instructions go through the rings, and the
+          connection only carries wakeups.*/
+        pthread_mutex_lock(&session->send_lock);
+        uring_destroy(session->uring);
+        session->uring = 0;
+        session->shm = shm;
+        pthread_mutex_unlock(&session->send_lock);
+    } else {
+        shm_destroy(shm);
+    }
+    hipe_instruction_clear(&incoming);
+    return 0;
 }
 
 hipe_session hipe_open_session(const char* host_key, const char* socket_path, const char* key_path, const char* clientName) {
@@ -132,98 +429,715 @@ hipe_session hipe_open_session(const char* host_key, const char* socket_path, co
     } else if(getenv("HIPE_HOSTKEY")) { /*key specified by environment [NB: each key can only be used once.]*/
         strncpy(key, getenv("HIPE_HOSTKEY"), 200);
     } else { /*need to load a key from the given key_path.*/
-        FILE* keyfile;
-        keyfile = fopen(keyPath, "r");
-        if(!keyfile) { /*could not open keyfile*/
-            fprintf(stderr, "Hipe: Could not open keyfile: %s\n", keyPath);
-            perror("Hipe");
-            return 0;
-        }
-        if(!fgets(key, 200, keyfile)) {
-            fprintf(stderr, "Hipe: Could not read key from keyfile: %s\n", keyPath);
-            perror("Hipe");
-            return 0;
-        }
+        if(read_keyfile(keyPath, key)) return 0;
     }
 
-    /*Allocate a socket endpoint file descriptor.*/
-    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        perror("Hipe: socket");
-        return 0; /*null pointer*/
-    }
-
-    struct sockaddr_un remote;
-    remote.sun_family = AF_UNIX;
-    strcpy(remote.sun_path, sockPath);
-    int len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-    if (connect(fd, (struct sockaddr *)&remote, len) == -1) {
-        close(fd);
+    if((fd = connect_socket(sockPath)) == -1) {
         fprintf(stderr, "Hipe: Could not connect to socket: %s\n", sockPath);
         perror("Hipe");
         return 0; /*null pointer*/
     }
 
-    /*Now request a container using a given host key:*/
+    /*Now request a container using a given host key. If the container request is rejected then close the
+    session immediately and don't return it.*/
     hipe_session session = (hipe_session) malloc(sizeof(struct _hipe_session));
     hipe_session_init(session);
     session->connection_fd = fd;
-    hipe_instruction rq;
-    hipe_instruction_init(&rq);
-    rq.opcode = HIPE_OP_REQUEST_CONTAINER;
-    rq.location = 0;
-    rq.requestor = getpid();
-    rq.arg[0] = key;
-    rq.arg_length[0] = strlen(key);
-    rq.arg[1] = (char*) clientName;
-    rq.arg_length[1] = strlen(clientName);
-    hipe_send_instruction(session, rq);
-
-    /*Await response from server. If the container request is rejected then close the
-    session immediately and don't return it.*/
-    hipe_instruction incoming;
-    hipe_instruction_init(&incoming);
-    int result;
-    result = hipe_await_instruction(session, &incoming, HIPE_OP_CONTAINER_GRANT);
-    if(result<0) {
-        fprintf(stderr, "Hipe: Bad connection.\n");
-        hipe_close_session(session);
-        return 0;
-    }
-    if(incoming.arg[0][0] != '1') {
-        fprintf(stderr, "Hipe: Container request denied.\n");
+    session->uring = uring_create(fd); /*null unless built with HIPE_USE_IO_URING, and the kernel supports it*/
+    if(request_container(session, key, clientName, hipe_await_instruction)) {
         hipe_close_session(session);
         return 0; /*null pointer*/
-    } else {
-        //fprintf(stderr, "Hipe: Container request granted!\n"); /*uncomment for extra verbosity*/
     }
-    hipe_instruction_clear(&incoming);
+
+    /*remember how to connect again.*/
+    strncpy(session->socketPath, sockPath, 200);
+    strncpy(session->keyPath, keyPath, 200);
+    strncpy(session->hostKey, key, 200);
+    session->clientName = strdup(clientName);
 
     return session; /*success*/
 }
 
 
+static int send_pieces(hipe_session session, const struct iovec* pieces, size_t count)
+/*send pieces of data through the session's io_uring or shared memory rings. Returns 0, or -1.*/
+{
+    if(session->shm) return shm_send(session->shm, pieces, count);
+    return uring_send(session->uring, pieces, count);
+}
+
+static int send_all(hipe_session session, const char* data, size_t length)
+/*send data over the connection, continuing after partial sends. The caller must hold send_lock.
+ *Returns 0 on success, or -1 (and disconnects) on failure.*/
+{
+    if(session->connection_fd == -1) return -1; /*lost, perhaps while another thread was receiving.*/
+    uint64_t traceBegin = TRACING() ? trace_now() : 0;
+    size_t total = length;
+    if(session->uring || session->shm) {
+        struct iovec piece = { (void*) data, length };
+        if(send_pieces(session, &piece, 1)) {
+            hipe_disconnect(session);
+            return -1;
+        }
+        length = 0;
+    }
+    while(length) {
+        ssize_t sent = send(session->connection_fd, data, length, MSG_NOSIGNAL);
+        if(sent == -1 && errno == EINTR) continue;
+        if(sent <= 0) {
+            hipe_disconnect(session);
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    if(traceBegin) trace_span("send", traceBegin, -1, total);
+    return 0;
+}
+
+static int flush_batch(hipe_session session)
+/*send the instructions collected while corked. The caller must hold send_lock.*/
+{
+    int result = 0;
+    if(session->batchLength && session->connection_fd != -1)
+        result = send_all(session, session->batch, session->batchLength);
+    session->batchLength = 0;
+    return result;
+}
+
+static void emit(hipe_session session, const char* encoded, size_t length)
+/*send an encoded instruction, or add it to the batch while corked. The caller must hold send_lock.*/
+{
+    if(session->corked) {
+        /*add the instruction to the batch instead of sending it now.*/
+        if(session->batchLength + length > session->batchCapacity) {
+            size_t capacity = session->batchCapacity ? session->batchCapacity : 4096;
+            while(capacity < session->batchLength + length) capacity *= 2;
+            char* batch = (char*) realloc(session->batch, capacity);
+            if(!batch) { /*send what has been collected so far, then this instruction on its own.*/
+                flush_batch(session);
+                send_all(session, encoded, length);
+                return;
+            }
+            session->batch = batch;
+            session->batchCapacity = capacity;
+        }
+        memcpy(session->batch + session->batchLength, encoded, length);
+        session->batchLength += length;
+        if(session->batchLength >= BATCH_FLUSH_SIZE) flush_batch(session);
+    } else {
+        /*send the instruction over the connection.*/
+        send_all(session, encoded, length);
+    }
+}
+
+static size_t frame_slot(hipe_session session, hipe_loc location, char opcode, const char* property, size_t propertyLength)
+/*home slot in frameTable of a location and property (FNV-1a hash).*/
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t i;
+    for(i=0; i<sizeof(location); i++) hash = (hash ^ ((location >> (8*i)) & 0xff)) * 1099511628211ull;
+    hash = (hash ^ (unsigned char) opcode) * 1099511628211ull;
+    for(i=0; i<propertyLength; i++) hash = (hash ^ (unsigned char) property[i]) * 1099511628211ull;
+    return (size_t) hash & (session->frameTableSize - 1);
+}
+
+static size_t location_slot(hipe_session session, hipe_loc location)
+/*home slot in frameLocations of a location.*/
+{
+    return (size_t) (((uint64_t) location * 11400714819323198485ull) >> 32) & (session->frameTableSize - 1);
+}
+
+static short frame_has_location(hipe_session session, hipe_loc location)
+/*returns 1 if any mutations of an element are held for the next frame.*/
+{
+    if(!session->frameLength || !location) return 0;
+    size_t slot;
+    for(slot = location_slot(session, location); session->frameLocations[slot]; slot = (slot+1) & (session->frameTableSize-1))
+        if(session->frameLocations[slot] == location) return 1;
+    return 0;
+}
+
+static void frame_index(hipe_session session, size_t index)
+/*adds a held mutation to the frame's lookup tables, replacing the mutation it supersedes, if any.*/
+{
+    struct frame_mutation* m = &session->frame[index];
+    size_t mask = session->frameTableSize - 1;
+    size_t slot = frame_slot(session, m->location, m->opcode, m->property, m->propertyLength);
+    for(; session->frameTable[slot]; slot = (slot+1) & mask) {
+        struct frame_mutation* other = &session->frame[session->frameTable[slot]-1];
+        if(other->location == m->location && other->opcode == m->opcode && other->propertyLength == m->propertyLength
+           && (!m->propertyLength || !memcmp(other->property, m->property, m->propertyLength))) {
+            other->live = 0; /*last write wins*/
+            break;
+        }
+    }
+    session->frameTable[slot] = index + 1;
+
+    for(slot = location_slot(session, m->location); session->frameLocations[slot]; slot = (slot+1) & mask)
+        if(session->frameLocations[slot] == m->location) return;
+    session->frameLocations[slot] = m->location;
+}
+
+static void free_mutation(struct frame_mutation* m)
+{
+    free(m->property);
+    free(m->encoded);
+}
+
+static int hold_mutation(hipe_session session, const hipe_instruction* instruction, const char* encoded, size_t length)
+/*holds a mutation back until the next frame. The caller must hold send_lock.
+ *Returns 0, or -1 if memory could not be allocated (the mutation must then be sent straight away).*/
+{
+    if(session->frameLength + 1 > session->frameTableSize / 2) {
+        /*drop replaced mutations, then rebuild the tables for the mutations still live, at least twice as big.*/
+        size_t i, live = 0;
+        for(i=0; i<session->frameLength; i++) {
+            if(session->frame[i].live) session->frame[live++] = session->frame[i];
+            else free_mutation(&session->frame[i]);
+        }
+        session->frameLength = live;
+        size_t size = session->frameTableSize ? session->frameTableSize : FRAME_TABLE_MIN;
+        while(size < (live + 1) * 4) size *= 2;
+        size_t* table = (size_t*) calloc(size, sizeof(size_t));
+        hipe_loc* locations = (hipe_loc*) calloc(size, sizeof(hipe_loc));
+        if(!table || !locations) {
+            free(table);
+            free(locations);
+            memset(session->frameTable, 0, session->frameTableSize * sizeof(size_t));
+            memset(session->frameLocations, 0, session->frameTableSize * sizeof(hipe_loc));
+            for(i=0; i<session->frameLength; i++) frame_index(session, i);
+            return -1;
+        }
+        free(session->frameTable);
+        free(session->frameLocations);
+        session->frameTable = table;
+        session->frameLocations = locations;
+        session->frameTableSize = size;
+        for(i=0; i<session->frameLength; i++) frame_index(session, i);
+    }
+    if(session->frameLength == session->frameCapacity) {
+        size_t capacity = session->frameCapacity ? session->frameCapacity * 2 : 32;
+        struct frame_mutation* frame = (struct frame_mutation*) realloc(session->frame, capacity * sizeof(struct frame_mutation));
+        if(!frame) return -1;
+        session->frame = frame;
+        session->frameCapacity = capacity;
+    }
+
+    struct frame_mutation* m = &session->frame[session->frameLength];
+    m->location = instruction->location;
+    m->opcode = instruction->opcode;
+    m->propertyLength = instruction->opcode == HIPE_OP_SET_STYLE ? instruction->arg_length[0] : 0;
+    m->property = m->propertyLength ? (char*) malloc(m->propertyLength) : 0;
+    m->encoded = (char*) malloc(length);
+    if((m->propertyLength && !m->property) || !m->encoded) {
+        free_mutation(m);
+        return -1;
+    }
+    if(m->propertyLength) memcpy(m->property, instruction->arg[0], m->propertyLength);
+    memcpy(m->encoded, encoded, length);
+    m->encodedLength = length;
+    m->live = 1;
+
+    if(!session->frameLength) clock_gettime(CLOCK_MONOTONIC, &session->frameStart);
+    frame_index(session, session->frameLength++);
+    return 0;
+}
+
+static int flush_frame(hipe_session session)
+/*sends the mutations held for the next frame, in the order they were made. The caller must hold send_lock.*/
+{
+    if(!session->frameLength) return 0;
+    size_t i;
+    struct iovec* pieces = 0;
+    if((session->uring || session->shm) && !session->corked && session->connection_fd != -1)
+        pieces = (struct iovec*) malloc(session->frameLength * sizeof(struct iovec));
+    if(pieces) {
+        /*send the mutations from where they are, rather than copying them into the batch first.*/
+        size_t count = 0;
+        for(i=0; i<session->frameLength; i++) {
+            if(!session->frame[i].live) continue;
+            pieces[count].iov_base = session->frame[i].encoded;
+            pieces[count].iov_len = session->frame[i].encodedLength;
+            count++;
+        }
+        uint64_t traceBegin = TRACING() ? trace_now() : 0;
+        if(send_pieces(session, pieces, count)) hipe_disconnect(session);
+        if(traceBegin) trace_span("send frame", traceBegin, -1, count);
+        free(pieces);
+    }
+    session->corked++; /*send the whole frame together.*/
+    for(i=0; i<session->frameLength; i++) {
+        if(session->frame[i].live && !pieces) emit(session, session->frame[i].encoded, session->frame[i].encodedLength);
+        free_mutation(&session->frame[i]);
+    }
+    session->frameLength = 0;
+    memset(session->frameTable, 0, session->frameTableSize * sizeof(size_t));
+    memset(session->frameLocations, 0, session->frameTableSize * sizeof(hipe_loc));
+    if(--session->corked == 0 && flush_batch(session)) return -1;
+    return session->connection_fd == -1 ? -1 : 0;
+}
+
+static short frame_due(hipe_session session)
+/*returns 1 if mutations are held and the frame interval has passed since the oldest of them was made.*/
+{
+    if(!session->frameLength) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - session->frameStart.tv_sec) * 1000 + (now.tv_nsec - session->frameStart.tv_nsec) / 1000000;
+    return elapsed >= (long) session->frameInterval;
+}
+
+static char reply_opcode(const hipe_instruction* instruction)
+/*the opcode of the reply that the server sends to a request, or 0 if it doesn't reply to the instruction.*/
+{
+    switch(instruction->opcode) {
+    case HIPE_OP_GET_BY_ID:
+    case HIPE_OP_GET_FIRST_CHILD:
+    case HIPE_OP_GET_LAST_CHILD:
+    case HIPE_OP_GET_NEXT_SIBLING:
+    case HIPE_OP_GET_PREV_SIBLING:
+        return HIPE_OP_LOCATION_RETURN;
+    case HIPE_OP_APPEND_TAG: /*replies with the new element's location if the third argument is "1"*/
+        return instruction->arg_length[2] && instruction->arg[2][0] == '1' ? HIPE_OP_LOCATION_RETURN : 0;
+    case HIPE_OP_GET_CONTENT:
+        return HIPE_OP_CONTENT_RETURN;
+    case HIPE_OP_DIALOG:
+    case HIPE_OP_DIALOG_INPUT:
+        return HIPE_OP_DIALOG_RETURN;
+    case HIPE_OP_REQUEST_CONTAINER:
+        return HIPE_OP_CONTAINER_GRANT;
+    }
+    return 0;
+}
+
+static void trace_request(hipe_session session, const hipe_instruction* instruction)
+/*starts a flow from a request to the reply that the server will send to it. The caller must hold send_lock.*/
+{
+    char replyOpcode = reply_opcode(instruction);
+    if(!replyOpcode) return;
+    if(session->traceRequestCount == session->traceRequestCapacity) {
+        if(session->traceRequestCount == TRACE_REQUESTS_MAX) { /*give up on the oldest.*/
+            session->traceRequestCount--;
+            memmove(session->traceRequests, session->traceRequests + 1, session->traceRequestCount * sizeof(struct trace_request));
+        } else {
+            size_t capacity = session->traceRequestCapacity ? session->traceRequestCapacity * 2 : 16;
+            struct trace_request* requests = (struct trace_request*) realloc(session->traceRequests,
+                                                                             capacity * sizeof(struct trace_request));
+            if(!requests) return;
+            session->traceRequests = requests;
+            session->traceRequestCapacity = capacity;
+        }
+    }
+    struct trace_request* request = &session->traceRequests[session->traceRequestCount++];
+    request->replyOpcode = replyOpcode;
+    request->flow = trace_flow_start();
+}
+
+static void trace_reply(hipe_session session, const hipe_instruction* reply)
+/*finishes the flow to an incoming reply from the oldest request of the kind it replies to. The server replies
+ *to each kind of request in the order the requests were sent.*/
+{
+    size_t i;
+    pthread_mutex_lock(&session->send_lock);
+    for(i=0; i<session->traceRequestCount; i++) {
+        if(session->traceRequests[i].replyOpcode != reply->opcode) continue;
+        trace_flow_finish(session->traceRequests[i].flow);
+        session->traceRequestCount--;
+        memmove(session->traceRequests + i, session->traceRequests + i + 1,
+                (session->traceRequestCount - i) * sizeof(struct trace_request));
+        break;
+    }
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+static void end_reconnect(hipe_session session)
+{
+    pthread_mutex_lock(&session->send_lock);
+    session->reconnecting = 0;
+    pthread_mutex_unlock(&session->send_lock);
+    drop_replay_replies(session); /*left over if the frame couldn't be rebuilt.*/
+}
+
+static int reconnect(hipe_session session)
+/*connects to the server again after the connection has been lost, and rebuilds the frame from the replay log.
+ *Only called by the thread receiving instructions, and not with send_lock held. Other threads' instructions
+ *fail until it is done. Returns 0 on success, or -1 if the session is still disconnected.*/
+{
+    if(!session->replay || session->reconnecting || session->denied) return -1;
+    uint64_t traceBegin = TRACING() ? trace_now() : 0;
+
+    /*whatever was held back was meant for the old server, with its locations, so it is dropped rather than
+      sent to the new one. The changes it made to the frame are in the log.*/
+    pthread_mutex_lock(&session->send_lock);
+    session->reconnecting = 1;
+    session->reconnector = pthread_self();
+    release_connection(session);
+    session->batchLength = 0;
+    session->traceRequestCount = 0; /*the old server won't reply to these.*/
+    size_t i;
+    for(i=0; i<session->frameLength; i++) free_mutation(&session->frame[i]);
+    session->frameLength = 0;
+    if(session->frameTableSize) {
+        memset(session->frameTable, 0, session->frameTableSize * sizeof(size_t));
+        memset(session->frameLocations, 0, session->frameTableSize * sizeof(hipe_loc));
+    }
+    pthread_mutex_unlock(&session->send_lock);
+    instruction_decoder_clear(&session->incomingInstruction); /*drop any partly received instruction.*/
+    instruction_decoder_init(&session->incomingInstruction);
+
+    int fd = -1;
+    long delay = RECONNECT_DELAY;
+    int attempt;
+    for(attempt=0; attempt<RECONNECT_ATTEMPTS && fd == -1; attempt++) {
+        if(attempt) {
+            struct timespec pause = { delay / 1000, (delay % 1000) * 1000000L };
+            nanosleep(&pause, 0);
+            delay *= 2;
+        }
+        fd = connect_socket(session->socketPath);
+    }
+    if(fd == -1) {
+        end_reconnect(session);
+        if(traceBegin) trace_span("reconnect", traceBegin, -1, -1);
+        return -1;
+    }
+
+    /*a restarted server writes a new keyfile. Otherwise, try the key the container was first granted with.*/
+    char key[200];
+    if(access(session->keyPath, R_OK) != 0 || read_keyfile(session->keyPath, key)) strcpy(key, session->hostKey);
+    pthread_mutex_lock(&session->send_lock);
+    session->connection_fd = fd;
+    session->uring = uring_create(fd);
+    session->replaying = 1;
+    pthread_mutex_unlock(&session->send_lock);
+    int result = request_container(session, key, session->clientName, hipe_replay_await);
+    if(!result) result = replay_restore(session->replay, session);
+    /*only the instructions rebuilding the frame can be in the batch (if the application was corked).*/
+    pthread_mutex_lock(&session->send_lock);
+    if(!result) result = flush_batch(session);
+    session->replaying = 0;
+    pthread_mutex_unlock(&session->send_lock);
+    if(result) hipe_disconnect(session);
+    end_reconnect(session);
+    if(traceBegin) trace_span("reconnect", traceBegin, -1, -1);
+    return result ? -1 : 0;
+}
+
 int hipe_send_instruction(hipe_session session, hipe_instruction instruction) {
 /*encode and transmit an instruction.*/
-    ssize_t err;
-    if(session->connection_fd == -1) return -1; //not connected.
-
     pthread_mutex_lock(&session->send_lock);
     //enforce atomicity so that two threads can send instructions without
     //messing up the encoding. Note that receiving instructions is NOT
     //thread safe, so only one thread should require and be checking for
     //replies.
+    if(session->connection_fd == -1
+       || (session->reconnecting && !pthread_equal(session->reconnector, pthread_self()))) {
+        /*not connected. A lost connection is restored by the thread receiving instructions.*/
+        pthread_mutex_unlock(&session->send_lock);
+        return -1;
+    }
+    uint64_t traceBegin = TRACING() ? trace_now() : 0;
+
+    if(session->replay && !session->replaying) {
+        /*record the instruction in the replay log, and translate the location to the server's.
+          (Translated first, as recording a deletion forgets the element's location.)*/
+        hipe_loc location = replay_to_server(session->replay, instruction.location);
+        if(instruction.location && !location) { /*the element was lost with the old server.*/
+            pthread_mutex_unlock(&session->send_lock);
+            return -1;
+        }
+        replay_record(session->replay, &instruction);
+        instruction.location = location;
+    }
 
     instruction_encoder_encodeinstruction(&session->outgoingInstruction, instruction);
-    /*send the instruction over the connection.*/
-    err = send(session->connection_fd, session->outgoingInstruction.encoded_output,
-               session->outgoingInstruction.encoded_length, MSG_NOSIGNAL);
+    const char* encoded = session->outgoingInstruction.encoded_output;
+    size_t length = session->outgoingInstruction.encoded_length;
+    if(traceBegin) {
+        trace_request(session, &instruction);
+        trace_span("encode", traceBegin, instruction.opcode, length);
+    }
 
-    if(err == -1) hipe_disconnect(session);
+    if(session->frameInterval && instruction.location && !session->replaying
+       && (instruction.opcode == HIPE_OP_SET_TEXT || instruction.opcode == HIPE_OP_SET_STYLE)) {
+        /*hold the mutation for the next frame, replacing any earlier one of the same property.*/
+        if(hold_mutation(session, &instruction, encoded, length) != 0) {
+            flush_frame(session);
+            emit(session, encoded, length);
+        }
+    } else {
+        /*anything else that involves an element must come after the mutations already made to it. So must any
+          request the server replies to (a lookup by ID, or the content of an element, may depend on any of them),
+          and any deletion or clearing (which may remove elements that mutations are held for, further down).*/
+        if(reply_opcode(&instruction) || instruction.opcode == HIPE_OP_DELETE || instruction.opcode == HIPE_OP_CLEAR
+           || frame_has_location(session, instruction.location))
+            flush_frame(session);
+        emit(session, encoded, length);
+    }
+    if(frame_due(session)) flush_frame(session);
     pthread_mutex_unlock(&session->send_lock);
 
     return 0; /*success*/
 }
 
+void hipe_cork(hipe_session session)
+{
+    pthread_mutex_lock(&session->send_lock);
+    session->corked++;
+    pthread_mutex_unlock(&session->send_lock);
+}
+
+int hipe_set_reconnect(hipe_session session, short enabled)
+{
+    if(!enabled) {
+        replay_destroy(session->replay);
+        session->replay = 0;
+        return 0;
+    }
+    if(!session->replay) session->replay = replay_create();
+    return session->replay ? 0 : -1;
+}
+
+short hipe_replay_await(hipe_session session, hipe_instruction* instruction_ret, short opcode)
+{
+    while(1) {
+        hipe_instruction* previous = 0;
+        hipe_instruction* current;
+        for(current = session->replayReplies; current; previous = current, current = current->next) {
+            if(current->opcode != opcode) continue;
+            if(previous) previous->next = current->next;
+            else session->replayReplies = current->next;
+            if(current == session->newestReplayReply) session->newestReplayReply = previous;
+            *instruction_ret = *current;
+            instruction_ret->next = 0;
+            free(current);
+            return 1;
+        }
+        if(read_to_queue(session, 1) < 0) return -1;
+    }
+}
+
+int hipe_set_frame_interval(hipe_session session, unsigned interval)
+{
+    int result = 0;
+    pthread_mutex_lock(&session->send_lock);
+    session->frameInterval = interval;
+    if(!interval) result = flush_frame(session);
+    pthread_mutex_unlock(&session->send_lock);
+    return result;
+}
+
+int hipe_flush_frame(hipe_session session)
+{
+    int result;
+    pthread_mutex_lock(&session->send_lock);
+    result = flush_frame(session);
+    pthread_mutex_unlock(&session->send_lock);
+    return result;
+}
+
+int hipe_uncork(hipe_session session)
+{
+    int result = 0;
+    pthread_mutex_lock(&session->send_lock);
+    if(session->corked && --session->corked == 0)
+        result = flush_batch(session);
+    pthread_mutex_unlock(&session->send_lock);
+    return result;
+}
+
+
+int hipe_set_coalescing(hipe_session session, uint64_t requestor, short policy)
+{
+    size_t i;
+    for(i=0; i<session->coalesceRuleCount; i++) {
+        if(session->coalesceRules[i].requestor != requestor) continue;
+        if(policy == HIPE_COALESCE_NONE) { /*remove the rule by moving the last one into its place.*/
+            session->coalesceRules[i] = session->coalesceRules[--session->coalesceRuleCount];
+        } else {
+            session->coalesceRules[i].policy = policy;
+        }
+        return 0;
+    }
+    if(policy == HIPE_COALESCE_NONE) return 0;
+
+    struct coalesce_rule* rules = (struct coalesce_rule*) realloc(session->coalesceRules,
+                                  (session->coalesceRuleCount+1) * sizeof(struct coalesce_rule));
+    if(!rules) return -1;
+    session->coalesceRules = rules;
+    rules[session->coalesceRuleCount].requestor = requestor;
+    rules[session->coalesceRuleCount].policy = policy;
+    rules[session->coalesceRuleCount].pending = 0;
+    rules[session->coalesceRuleCount].folded = 0;
+    session->coalesceRuleCount++;
+    return 0;
+}
+
+static void coalesce_count(hipe_instruction* event, uint64_t folded)
+/*writes the number of events folded into a queued event into its last argument slot, unless the event uses it.*/
+{
+    if(event->arg[HIPE_NARGS-1]) return;
+    char* count = (char*) malloc(24);
+    if(!count) return;
+    event->arg_length[HIPE_NARGS-1] = snprintf(count, 24, "%llu", (unsigned long long) folded);
+    event->arg[HIPE_NARGS-1] = count;
+}
+
+static short coalesce_event(hipe_session session, hipe_instruction* event)
+/*Folds a newly decoded event into the matching queued event, if its subscription has a coalescing rule
+ *and an event from the same location (and of the same type) is still queued.
+ *Returns 1 if the event was folded and must not be queued, otherwise 0. */
+{
+    size_t i;
+    for(i=0; i<session->coalesceRuleCount; i++) {
+        struct coalesce_rule* rule = &session->coalesceRules[i];
+        if(rule->requestor != event->requestor) continue;
+
+        hipe_instruction* pending = rule->pending;
+        if(!pending || pending->location != event->location
+           || pending->arg_length[0] != event->arg_length[0]
+           || (event->arg_length[0] && memcmp(pending->arg[0], event->arg[0], event->arg_length[0]))) {
+            rule->folded = 0; /*the new event will become the rule's pending event once queued.*/
+            return 0;
+        }
+
+        /*replace the queued event's values in place, keeping its position in the queue.*/
+        hipe_instruction* next = pending->next;
+        hipe_instruction_clear(pending);
+        hipe_instruction_copy(pending, event);
+        pending->next = next;
+        rule->folded++;
+
+        if(rule->policy == HIPE_COALESCE_COUNT) coalesce_count(pending, rule->folded);
+        return 1;
+    }
+    return 0;
+}
+
+static void coalesce_track(hipe_session session, hipe_instruction* queued)
+/*Records a newly queued event as the pending event of its subscription's coalescing rule, if any.*/
+{
+    size_t i;
+    for(i=0; i<session->coalesceRuleCount; i++) {
+        if(session->coalesceRules[i].requestor == queued->requestor) {
+            session->coalesceRules[i].pending = queued;
+            session->coalesceRules[i].folded = 1;
+            if(session->coalesceRules[i].policy == HIPE_COALESCE_COUNT) coalesce_count(queued, 1);
+            return;
+        }
+    }
+}
+
+static void coalesce_forget(hipe_session session, hipe_instruction* dequeued)
+/*Must be called when an instruction leaves the queue, so that later events are no longer folded into it.*/
+{
+    size_t i;
+    for(i=0; i<session->coalesceRuleCount; i++)
+        if(session->coalesceRules[i].pending == dequeued)
+            session->coalesceRules[i].pending = 0;
+}
+
+
+int hipe_set_queue_order(hipe_session session, short order)
+{
+    if(order != HIPE_ORDER_ARRIVAL && order != HIPE_ORDER_PRIORITY) return -1;
+    session->queueOrder = order;
+    return 0;
+}
+
+int hipe_set_lane_priority(hipe_session session, short lane, short priority, unsigned burst)
+{
+    if(lane < 0 || lane >= HIPE_LANES) return -1;
+    session->lanes[lane].priority = priority;
+    session->lanes[lane].burst = burst;
+    return 0;
+}
+
+int hipe_set_opcode_lane(hipe_session session, char opcode, short lane)
+{
+    if(lane < 0 || lane >= HIPE_LANES) return -1;
+    session->laneOf[(unsigned char) opcode] = lane;
+    return 0;
+}
+
+int hipe_session_fd(hipe_session session)
+{
+    int fd = session->connection_fd;
+    if(fd == -1) {
+        /*a lost connection is restored by the next read, so until then its shut down descriptor, which polls
+          as readable, is given out instead.*/
+        if(!session->replay || session->denied) return -1;
+        fd = session->retiredFd;
+    }
+    if(session->uring) return uring_fd(session->uring); /*the kernel reads from the connection by itself*/
+    return fd;
+}
+
+uint64_t hipe_last_sequence(hipe_session session)
+{
+    return session->lastSequence;
+}
+
+static short next_lane(hipe_session session)
+/*Chooses the lane that hipe_next_instruction should take its next instruction from.
+ *Precondition: at least one instruction is queued. */
+{
+    short lane, best = -1, runnerUp = -1;
+
+    if(session->queueOrder == HIPE_ORDER_ARRIVAL) { /*the lane whose oldest instruction arrived first.*/
+        for(lane=0; lane<HIPE_LANES; lane++) {
+            hipe_instruction* oldest = session->lanes[lane].oldestInstruction;
+            if(oldest && (best < 0 || ((struct queued_instruction*) oldest)->sequence
+                          < ((struct queued_instruction*) session->lanes[best].oldestInstruction)->sequence))
+                best = lane;
+        }
+        return best;
+    }
+
+    /*HIPE_ORDER_PRIORITY: the highest priority waiting lane, unless it has used up its burst.*/
+    for(lane=0; lane<HIPE_LANES; lane++) {
+        if(!session->lanes[lane].oldestInstruction) continue;
+        if(best < 0 || session->lanes[lane].priority < session->lanes[best].priority) {
+            runnerUp = best;
+            best = lane;
+        } else if(runnerUp < 0 || session->lanes[lane].priority < session->lanes[runnerUp].priority) {
+            runnerUp = lane;
+        }
+    }
+    if(runnerUp >= 0 && session->lanes[best].burst && best == session->lastLane
+       && session->lanes[best].served >= session->lanes[best].burst)
+        return runnerUp;
+    return best;
+}
+
+static void dequeue_instruction(hipe_session session, short lane, hipe_instruction* previous,
+                                hipe_instruction* current, hipe_instruction* instruction_ret)
+/*Splices current (preceded by previous, or null if current is the oldest) out of a lane and
+ *moves it into instruction_ret. */
+{
+    struct instruction_lane* l = &session->lanes[lane];
+
+    *instruction_ret = *current; /*return a shallow copy to use existing allocations. We'll delete the original */
+    session->lastSequence = ((struct queued_instruction*) current)->sequence;
+
+    if(previous)
+        previous->next = current->next;
+    else /* current is at start of queue */
+        l->oldestInstruction = current->next;
+
+    if(current == l->newestInstruction) {
+        l->newestInstruction = previous;
+        if(previous)
+            l->newestInstruction->next = 0;
+    }
+    session->queuedInstructions--;
+
+    if(session->coalesceRuleCount) coalesce_forget(session, current);
+    free((struct queued_instruction*) current); /*shallow clear. Any args now exist in instruction_ret only.*/
+    instruction_ret->next = 0;
+}
+
 
 short hipe_next_instruction(hipe_session session, hipe_instruction* instruction_ret, short blocking)
 {
@@ -232,7 +1146,13 @@ short hipe_next_instruction(hipe_session session, hipe_instruction* instruction_
     hipe_instruction_clear(instruction_ret);
     /*clear any previous instruction so that the user doesn't have to.*/
 
-    while(!session->oldestInstruction) {
+    /*a frame may have fallen due since the last mutation was sent. (Other threads hold mutations under
+      send_lock, so the frame is only looked at with it held.)*/
+    pthread_mutex_lock(&session->send_lock);
+    if(frame_due(session)) flush_frame(session);
+    pthread_mutex_unlock(&session->send_lock);
+
+    while(!session->queuedInstructions) {
     /*Only read something new from server if the queue is empty.*/
         result = read_to_queue(session, blocking);
         if(!blocking && result == 0) return 0;
@@ -242,90 +1162,207 @@ short hipe_next_instruction(hipe_session session, hipe_instruction* instruction_
         }
     }
 
-    /*pull next instruction from queue and update queue.*/
-    *instruction_ret = *(session->oldestInstruction); /*shallow copy*/
-    if(session->oldestInstruction == session->newestInstruction)
-        session->newestInstruction = 0; /* if this was the only waiting instruction, reflect the now empty state of queue */
-    free(session->oldestInstruction);   /*shallow clear. Any args now exist in instruction_ret only.*/
-    session->oldestInstruction = instruction_ret->next;
-    instruction_ret->next = 0;
+    if(session->queueOrder == HIPE_ORDER_PRIORITY && session->connection_fd != -1)
+        read_to_queue(session, 0);
+    /*when serving by priority, pick up anything that has already arrived, so that an urgent
+      instruction is not held back behind instructions that were queued before it.*/
+
+    /*pull next instruction from the chosen lane and update queue.*/
+    short lane = next_lane(session);
+    if(lane == session->lastLane) {
+        session->lanes[lane].served++;
+    } else {
+        session->lanes[lane].served = 1;
+        session->lastLane = lane;
+    }
+    dequeue_instruction(session, lane, 0, session->lanes[lane].oldestInstruction, instruction_ret);
 
     return 1; /*success*/
 }
 
 
+static uint64_t read_clock(void)
+/*microseconds, on a clock that only goes forward.*/
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void set_read_budget(hipe_session session)
+/*sets the read budget to what is expected to take the read latency to decode, at the measured rate.*/
+{
+    double budget = session->readRate * session->readLatency;
+    if(budget < READ_BUDGET_MIN) budget = READ_BUDGET_MIN;
+    if(budget > READ_BUDGET_MAX) budget = READ_BUDGET_MAX;
+    session->readBudget = (size_t) budget;
+}
+
+static void tune_read_budget(hipe_session session, size_t bytesRead, uint64_t started)
+/*updates the measured rate with that at which a call to read_to_queue() that started at started has read and
+ *decoded bytesRead bytes, and the read budget with it.*/
+{
+    uint64_t elapsed = read_clock() - started;
+    if(bytesRead < READ_BUFFER_SIZE || !elapsed) return; /*too little to tell the rate from.*/
+    double rate = (double) bytesRead / elapsed;
+    session->readRate = session->readRate ? (session->readRate * 3 + rate) / 4 : rate;
+    set_read_budget(session);
+}
+
+int hipe_set_read_latency(hipe_session session, unsigned microseconds)
+{
+    session->readLatency = microseconds ? microseconds : READ_LATENCY_DEFAULT;
+    if(session->readRate) set_read_budget(session); /*otherwise it is set once the rate has been measured.*/
+    return 0;
+}
+
 int read_to_queue(hipe_session session, int blocking)
 /*If blocking is set, the function will not return until at least a partial
  *instruction has been read. This function processes zero or more complete
  *instructions before it returns. It then adds these to the session's incoming
- *instruction queue.
+ *instruction queue. It stops once it has read its read budget of bytes, or spent
+ *the read latency reading, even if more has arrived.
  *
  *Returns the number of completed instructions read into the session queue (if
- *any), or -1 on error.
+ *any), or -1 on error. If the connection has been lost and is restored, returns 0.
  */
 {
-    if(session->connection_fd == -1) return -1; /*not connected*/
+    if(session->connection_fd == -1) return reconnect(session); /*not connected*/
+
+    if(blocking) {
+        /*a reply being waited for may depend on instructions still held in the batch or the frame.
+          Going idle also ends the frame.*/
+        pthread_mutex_lock(&session->send_lock);
+        flush_frame(session);
+        flush_batch(session);
+        pthread_mutex_unlock(&session->send_lock);
+        if(session->connection_fd == -1) return reconnect(session);
+    }
 
     int completedInstructions;
     completedInstructions = 0;
-    short bufferedChars; /*number of characters that have been read into the buffer. Must be <=READ_BUFFER_SIZE */
-    short n;
-    for(n=0; n<MAX_READS; n++) {
+    ssize_t bufferedChars; /*number of characters that have been read into the buffer. Must be <=READ_BUFFER_SIZE */
+    size_t bytesRead = 0;
+    uint64_t started = 0; /*when the first read returned: time spent waiting for it doesn't count*/
+    while(1) {
     /*stay in this function for as long as characters are available to be read,
-      or until the maximum number of allowed iterations is exhausted.
+      or until the read budget or the read latency is used up.
     */
-
-        if(n>0) blocking=0; /*only enable blocking for the first iteration. Anything that follows is a freebie.*/
+        size_t left = session->readBudget - bytesRead;
+        size_t wanted = left < READ_BUFFER_SIZE ? left : READ_BUFFER_SIZE;
 
         /*attempt to read new characters*/
-        bufferedChars = recv(session->connection_fd, session->readBuffer, READ_BUFFER_SIZE, (blocking ? 0 : MSG_DONTWAIT));
+        uint64_t traceBegin = blocking && TRACING() ? trace_now() : 0;
+        const char* input = session->readBuffer;
+        if(session->uring) /*what the kernel has already received for us, in one of its buffers (maybe more than wanted)*/
+            bufferedChars = uring_recv(session->uring, &input, blocking);
+        else if(session->shm) /*decoded where the server wrote it, so not limited to the read buffer's size*/
+            bufferedChars = shm_recv(session->shm, &input, left, blocking);
+        else
+            bufferedChars = recv(session->connection_fd, session->readBuffer, wanted, (blocking ? 0 : MSG_DONTWAIT));
         /*can return -1 if connection closed, or 0 when no more ready.*/
+        if(traceBegin) trace_span("wait", traceBegin, -1, bufferedChars > 0 ? bufferedChars : 0);
+        traceBegin = TRACING() ? trace_now() : 0;
+        if(!started) started = read_clock();
+        blocking = 0; /*only enable blocking for the first iteration. Anything that follows is a freebie.*/
 
         int p;
         if(bufferedChars < 0) { /*connection closed, or error. Or nothing to read right now.*/
             if(errno == EAGAIN) { /*nothing more to read right now*/
+                tune_read_budget(session, bytesRead, started);
                 return completedInstructions; /*success*/
             } else { /*disconnected by peer, broken pipe, etc.*/
                 hipe_disconnect(session);
-                return -1;
+                return reconnect(session) ? -1 : completedInstructions;
             }
         } else if(bufferedChars == 0) { /*connection closed by peer*/
             hipe_disconnect(session);
-            return -1;
+            return reconnect(session) ? -1 : completedInstructions;
         } else for(p=0; p<bufferedChars;) { /*let's process our input! (p represents current offset from start of input buffer)*/
 
             p += instruction_decoder_feed(&session->incomingInstruction, 
-                                          session->readBuffer + p, bufferedChars-p);
+                                          (char*) input + p, bufferedChars-p);
             if(instruction_decoder_iscomplete(&session->incomingInstruction)) {
+                if(traceBegin) trace_reply(session, &session->incomingInstruction.output);
 
                 if(session->incomingInstruction.output.opcode == HIPE_OP_SERVER_DENIED) {
                 /*Access to the server has been denied. Critical. Disconnect*/
+                    session->denied = 1;
                     hipe_disconnect(session);
                     if(completedInstructions) return completedInstructions;
                     else return -1; /*disconnected*/
                 }
 
+                if(session->replaying && (session->incomingInstruction.output.opcode == HIPE_OP_CONTAINER_GRANT
+                   || session->incomingInstruction.output.opcode == HIPE_OP_LOCATION_RETURN)) {
+                    /*a reply to the instructions rebuilding the frame: kept apart from the replies the client awaits.*/
+                    hipe_instruction* reply = (hipe_instruction*) malloc(sizeof(hipe_instruction));
+                    if(reply) {
+                        hipe_instruction_copy(reply, &session->incomingInstruction.output);
+                        reply->next = 0;
+                        if(session->newestReplayReply) session->newestReplayReply->next = reply;
+                        else session->replayReplies = reply;
+                        session->newestReplayReply = reply;
+                    }
+                    instruction_decoder_clear(&session->incomingInstruction);
+                    continue;
+                }
+                if(session->replay && !session->replaying) {
+                    /*give the client its own locations for the elements, rather than the server's.*/
+                    pthread_mutex_lock(&session->send_lock);
+                    replay_incoming(session->replay, &session->incomingInstruction.output);
+                    pthread_mutex_unlock(&session->send_lock);
+                }
+
+                if(session->coalesceRuleCount && session->incomingInstruction.output.opcode == HIPE_OP_EVENT
+                   && coalesce_event(session, &session->incomingInstruction.output)) {
+                    /*folded into an event that is already queued.*/
+                    instruction_decoder_clear(&session->incomingInstruction);
+                    continue;
+                }
+
                 completedInstructions++;
 
-                /*Allocate the new instruction struct and add it to the session's queue of new instructions.*/
-                hipe_instruction* newInstruction = (hipe_instruction*) malloc(sizeof(hipe_instruction));
+                /*Allocate the new instruction struct and add it to the queue lane for its opcode.*/
+                struct queued_instruction* queued = (struct queued_instruction*) malloc(sizeof(struct queued_instruction));
+                hipe_instruction* newInstruction = &queued->instruction;
                 hipe_instruction_copy(newInstruction, &session->incomingInstruction.output);
+                queued->sequence = ++session->arrivals;
 
                 instruction_decoder_clear(&session->incomingInstruction);
 
-                if(session->newestInstruction) session->newestInstruction->next = newInstruction;
-                else session->oldestInstruction = newInstruction; /*if the queue is empty, then it's our oldest as well as our newest.*/
-                session->newestInstruction = newInstruction;
+                struct instruction_lane* lane = &session->lanes[(unsigned char) session->laneOf[(unsigned char) newInstruction->opcode]];
+                if(lane->newestInstruction) lane->newestInstruction->next = newInstruction;
+                else lane->oldestInstruction = newInstruction; /*if the lane is empty, then it's our oldest as well as our newest.*/
+                lane->newestInstruction = newInstruction;
+                session->queuedInstructions++;
+
+                if(session->coalesceRuleCount && newInstruction->opcode == HIPE_OP_EVENT)
+                    coalesce_track(session, newInstruction);
             }
         }
+        if(traceBegin) trace_span("decode", traceBegin, -1, bufferedChars);
+
+        bytesRead += bufferedChars;
+        if(bytesRead >= session->readBudget || read_clock() - started >= session->readLatency) {
+            /*leave the rest for the next call, so that what has been decoded can be handled.*/
+            tune_read_budget(session, bytesRead, started);
+            return completedInstructions; /*success*/
+        }
     }
-    return completedInstructions; /*success*/
 }
 
 
 short hipe_close_session(hipe_session session)
 {
+    pthread_mutex_lock(&session->send_lock);
+    flush_frame(session); /*send anything still held back for the next frame, or by hipe_cork()*/
+    flush_batch(session);
+    pthread_mutex_unlock(&session->send_lock);
     hipe_disconnect(session);
+    pthread_mutex_lock(&session->send_lock);
+    release_connection(session);
+    pthread_mutex_unlock(&session->send_lock);
     hipe_session_clear(session);
     free(session);
     return 0;
@@ -334,35 +1371,24 @@ short hipe_close_session(hipe_session session)
 
 short hipe_await_instruction(hipe_session session, hipe_instruction* instruction_ret, short opcode)
 {
-    hipe_instruction* current=session->oldestInstruction; /* the last instruction we have examined in the queue, or are about to examine. */
+    /* Only the lane that instructions with this opcode are queued in needs to be searched. */
+    short lane = session->laneOf[(unsigned char) opcode];
+    hipe_instruction* current=session->lanes[lane].oldestInstruction; /* the last instruction we have examined in the lane, or are about to examine. */
     hipe_instruction* previous=0; /* the instruction that points to current. */
     int fetched_instructions=0;
+    uint64_t traceBegin = TRACING() ? trace_now() : 0; /* the wait for the reply is shown as one span, around those of reading it */
 
     while(1) { /* we will either return the desired instruction eventually, or return an error condition, such as disconnection. */
         while(current) { /* when we run out of instructions to examine, we'll have to leave this loop to get more */
             /* examine current instruction */
             if(current->opcode == opcode) {
-                /* we've found the element we're looking for. Splice it out of the queue and return it. */
-                *instruction_ret = *current; /*return a shallow copy to use existing allocations. We'll delete the original */
-
-                if(previous)
-                    previous->next = current->next;
-                else /* current is at start of queue */
-                    session->oldestInstruction = current->next;
-
-                if(current == session->newestInstruction) {
-                    session->newestInstruction = previous;
-                    if(previous)
-                        session->newestInstruction->next = 0;
-                }
-
-                free(current);
-                instruction_ret->next = 0;
-
+                /* we've found the element we're looking for. Splice it out of the lane and return it. */
+                dequeue_instruction(session, lane, previous, current, instruction_ret);
+                if(traceBegin) trace_span("await", traceBegin, opcode, -1);
                 return 1; /* success */
             }
 
-            /* traverse to next in queue */
+            /* traverse to next in lane */
             previous = current;
             current = current->next;
         }
@@ -370,14 +1396,16 @@ short hipe_await_instruction(hipe_session session, hipe_instruction* instruction
         /* need to fetch more instructions */
         do {
             fetched_instructions = read_to_queue(session, 1);
-            if(fetched_instructions < 0) /*bad. handle error.*/
+            if(fetched_instructions < 0) { /*bad. handle error.*/
+                if(traceBegin) trace_span("await", traceBegin, opcode, -1);
                 return -1;
+            }
         } while(fetched_instructions == 0);
 
         if(previous)
             current = previous->next;
         else
-            current = session->oldestInstruction;
+            current = session->lanes[lane].oldestInstruction;
     }
 }
 
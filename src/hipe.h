@@ -56,11 +56,198 @@ short hipe_await_instruction(hipe_session session, hipe_instruction* instruction
  * an acknowledgement from the server.
  */
 
+int hipe_session_fd(hipe_session session);
+/* Returns the file descriptor of the session's connection to the server, or -1 if disconnected, so that
+ * an application can wait (with poll, select, etc.) for the server and its own file descriptors at once.
+ * Only read from the connection through this library. The descriptor becoming readable means
+ * hipe_next_instruction has something to read, but instructions may also already be waiting in the
+ * session queue: call hipe_next_instruction with !blocking until it returns 0 before waiting.
+ * If the connection is lost while reconnection is on (see hipe_set_reconnect), the descriptor polls as
+ * readable, so that the next hipe_next_instruction connects again; call this again afterwards.
+ * If the library was built with HIPE_USE_IO_URING, this may be the session's io_uring descriptor rather
+ * than the socket, which is polled the same way. (With HIPE_USE_SHM, it is the socket even when instructions
+ * go through shared memory, as the server wakes the session through it.)
+ */
+
+int hipe_set_read_latency(hipe_session session, unsigned microseconds);
+/* Sets how long a call that reads from the server (hipe_next_instruction, hipe_await_instruction) may spend
+ * reading and decoding what has arrived, once it has something, before returning what it has decoded; the rest
+ * is read by the next call. This bounds how long handling an event can be held up while the server streams a
+ * large amount of data. Each call also reads at most a budget of bytes, tuned from the rate at which earlier
+ * calls decoded to what can be decoded in the time. A call may run over by the time it takes to finish the
+ * instruction it is decoding. 0 restores the default of 1000. Returns 0.
+ */
+
 int hipe_send(hipe_session session, char opcode, uint64_t requestor, hipe_loc location, int n_args, ...);
 /* Convenience function to send instructions when the arguments (0 or more) are null-terminated strings expressed
  * as char* or const char*
  */
- 
+
+void hipe_cork(hipe_session session);
+/* Holds back outgoing instructions until the matching hipe_uncork, so that a batch of changes made together
+ * (e.g. deleting many elements at once) is sent in a few large writes instead of one write per instruction.
+ * Calls may be nested; instructions are sent when the outermost hipe_cork is matched. Held instructions are
+ * also sent if they build up past an internal limit, and before any blocking wait for an instruction from
+ * the server, since the server can't reply to a request it hasn't received.
+ */
+
+int hipe_uncork(hipe_session session);
+/* Ends a batch started with hipe_cork. Returns 0 on success, or -1 if sending failed.
+ */
+
+int hipe_set_frame_interval(hipe_session session, unsigned interval);
+/* Turns on frame pacing, so that changes to elements are sent to the server once per frame of interval
+ * milliseconds rather than as they are made. While it is on, HIPE_OP_SET_TEXT and HIPE_OP_SET_STYLE
+ * instructions are held back, and a later one for the same element (and, for HIPE_OP_SET_STYLE, the same
+ * property) replaces the one held, so the server lays the frame out once with only the final values.
+ * The held changes are sent, in the order they were made, once interval has passed since the first of
+ * them (checked when sending and by hipe_next_instruction), before any blocking wait for an instruction
+ * from the server, before any other instruction involving an element with changes held, and before any
+ * request that the server replies to and any HIPE_OP_DELETE or HIPE_OP_CLEAR.
+ * An interval of 0 turns frame pacing off, sending anything held. Returns 0, or -1 if sending failed.
+ */
+
+int hipe_flush_frame(hipe_session session);
+/* Sends the changes held for the next frame straight away. An application that waits by itself (e.g. by
+ * polling hipe_session_fd) should call this when it becomes idle, before it waits.
+ * Returns 0, or -1 if sending failed.
+ */
+
+int hipe_set_reconnect(hipe_session session, short enabled);
+/* Turns automatic reconnection on (or off). While it is on, the session keeps a compacted log of the
+ * instructions that built its frame: the elements appended, their text, styles and attributes, the event
+ * requests and style rules, with deleted elements and overwritten values left out. If the connection is
+ * lost (e.g. the display server is restarted), the next call that reads from the server (on the thread that
+ * receives instructions) connects again, is granted a new container, and rebuilds the frame from the log in
+ * one batch per level of nesting, rather than with a lookup per element. Until it has, sending fails,
+ * returning -1; instructions held back for the old server are dropped, as the log already has them.
+ * The locations the application already has stay valid: they are translated to the new server's locations,
+ * and incoming instructions are translated back. Location and content requests that were not answered are
+ * sent again, but other pending requests (e.g. an open dialog) are lost.
+ * Only elements with an ID that were looked up by it, or appended with a location request, can be restored
+ * with their locations; sending to the location of an element that wasn't restored fails, returning -1.
+ * Turn it on straight after opening the session, so that the whole frame is in the log.
+ * Returns 0, or -1 on allocation failure.
+ */
+
+
+/* Queue lanes. Incoming instructions are queued in one of these lanes according to their opcode,
+ * so that replies being awaited, and frame lifecycle instructions, need not wait behind queued events.
+ */
+#define HIPE_LANE_REPLY 0 /* replies to requests: HIPE_OP_LOCATION_RETURN, HIPE_OP_CONTENT_RETURN, etc. */
+#define HIPE_LANE_FRAME 1 /* frame lifecycle instructions such as HIPE_OP_FRAME_CLOSE */
+#define HIPE_LANE_EVENT 2 /* user events and anything else */
+#define HIPE_LANES 3
+
+/* Queue orders, for use with hipe_set_queue_order() */
+#define HIPE_ORDER_ARRIVAL 0  /* hipe_next_instruction returns instructions in order of arrival (default) */
+#define HIPE_ORDER_PRIORITY 1 /* hipe_next_instruction serves lanes in order of priority */
+
+int hipe_set_queue_order(hipe_session session, short order);
+/* Selects the order in which hipe_next_instruction returns queued instructions. Returns 0, or -1 if
+ * order is not valid.
+ */
+
+int hipe_set_lane_priority(hipe_session session, short lane, short priority, unsigned burst);
+/* Configures a lane for HIPE_ORDER_PRIORITY. Lanes with a lower priority value are served first
+ * (defaults: reply 0, frame 1, event 2). For fairness, burst limits how many instructions in a row
+ * may be taken from the lane while a lane of lower priority has instructions waiting, after which
+ * one instruction is taken from the next waiting lane. A burst of 0 means no limit.
+ * Returns 0, or -1 if lane is not valid.
+ */
+
+int hipe_set_opcode_lane(hipe_session session, char opcode, short lane);
+/* Reassigns the lane in which instructions with a particular opcode are queued.
+ * Returns 0, or -1 if lane is not valid.
+ */
+
+uint64_t hipe_last_sequence(hipe_session session);
+/* Returns the arrival sequence number (starting from 1) of the instruction most recently returned by
+ * hipe_next_instruction or hipe_await_instruction, so that applications that reorder instructions
+ * by priority can still recover the order in which they were received.
+ */
+
+
+/* Event coalescing policies, for use with hipe_set_coalescing() */
+#define HIPE_COALESCE_NONE 0   /* every event is queued (default) */
+#define HIPE_COALESCE_LATEST 1 /* a new event replaces the subscription's queued event, if it has one */
+#define HIPE_COALESCE_COUNT 2  /* as HIPE_COALESCE_LATEST, and the number of events folded into the queued
+                                * event (1 if none were) is written as a decimal string into its last
+                                * argument slot, unless the event uses that slot itself */
+
+int hipe_set_coalescing(hipe_session session, uint64_t requestor, short policy);
+/* Sets how HIPE_OP_EVENT instructions for an event subscription (identified by the requestor value
+ * given in its HIPE_OP_EVENT_REQUEST) are handled when they arrive while an earlier event from the same
+ * subscription and location is still waiting in the session queue. The queued event keeps its place in
+ * the queue, so a burst of high-frequency events (mousemove, scroll, input...) collapses into a single
+ * queued event carrying the latest values. Returns 0 on success, -1 on allocation failure.
+ */
+
+
+/* Event dispatch.
+ * A dispatcher maps incoming instructions to handler callbacks, so that an event loop can pass each
+ * instruction it dequeues straight to the code responsible for it, rather than switching on the
+ * requestor and having the handler fetch the event again. Handlers are kept in flat hash tables,
+ * so lookup cost does not depend on how many handlers are registered.
+ */
+
+struct _hipe_dispatcher;
+typedef struct _hipe_dispatcher* hipe_dispatcher;
+
+typedef void (*hipe_handler)(hipe_session session, hipe_instruction* instruction, void* userdata);
+/* A handler receives the instruction that was actually dequeued. The instruction remains owned
+ * by the caller of hipe_dispatch, so the handler must copy anything it needs to keep. */
+
+hipe_dispatcher hipe_dispatcher_create(void);
+
+void hipe_dispatcher_destroy(hipe_dispatcher dispatcher);
+
+int hipe_dispatch_requestor(hipe_dispatcher dispatcher, uint64_t requestor, hipe_handler handler, void* userdata);
+/* Registers (or replaces) the handler for instructions carrying a particular requestor value.
+ * Passing a null handler removes the registration. Returns 0 on success, -1 on allocation failure.
+ */
+
+int hipe_dispatch_location(hipe_dispatcher dispatcher, hipe_loc location, const char* event_type, hipe_handler handler, void* userdata);
+/* Registers (or replaces) the handler for HIPE_OP_EVENT instructions of a particular event type
+ * (e.g. "click") occurring at a particular location. These take precedence over requestor handlers.
+ * Passing a null handler removes the registration. Returns 0 on success, -1 on allocation failure.
+ */
+
+void hipe_dispatch_default(hipe_dispatcher dispatcher, hipe_handler handler, void* userdata);
+/* Sets a fallback handler for instructions that match no other registration. */
+
+short hipe_dispatch(hipe_dispatcher dispatcher, hipe_session session, hipe_instruction* instruction);
+/* Calls the handler registered for an instruction. Returns 1 if a handler was called, otherwise 0.
+ */
+
+
+/* Tracing.
+ * While a trace is being recorded, the library records a timeline of where its time goes, in every thread
+ * and session: encoding and sending instructions, waiting for the server, decoding what it sends, and
+ * running handlers called by hipe_dispatch. Each request that the server replies to is linked to its reply
+ * by an arrow. The trace is written as Chrome trace JSON, which can be opened in chrome://tracing or in
+ * the Perfetto UI (ui.perfetto.dev).
+ */
+
+int hipe_trace_start(const char* path, size_t events_per_thread);
+/* Starts recording a trace, to be written to the file at path by hipe_trace_stop. Each thread keeps its
+ * most recent events_per_thread events (0 for the default of 65536), in a buffer of its own, so recording
+ * takes no lock. Returns 0, or -1 if the file can't be opened or a trace is already being recorded.
+ */
+
+int hipe_trace_stop(void);
+/* Stops recording, and writes the trace. Returns 0, or -1 if no trace was being recorded or the trace
+ * couldn't be written.
+ */
+
+uint64_t hipe_trace_begin(void);
+void hipe_trace_end(const char* name, uint64_t begin);
+/* Records a span of the application's own (e.g. rendering a list) in the calling thread's timeline:
+ * hipe_trace_end(name, hipe_trace_begin()) at its end. name must stay valid until the trace is written
+ * (e.g. a string literal). When no trace is being recorded, hipe_trace_begin returns 0 and
+ * hipe_trace_end does nothing.
+ */
+
 
 #endif
 
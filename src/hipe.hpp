@@ -35,6 +35,13 @@
 //of the normal Hipe API.
 
 
+//When compiled as C++20, a coroutine interface is also provided. A hipe::scheduler
+//owns the session's incoming instruction stream and resumes each suspended
+//coroutine when the reply or event it is waiting on arrives, so many multi-step
+//interactions (request, await reply, open dialog, await input...) can be in progress
+//at once on a single thread, without blocking in hipe_await_instruction.
+
+
 #pragma once
 
 #include <hipe.h>
@@ -42,10 +49,25 @@
 #include <map>
 #include <stdexcept>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#if __cplusplus >= 202002L
+#include <coroutine>
+#include <exception>
+#include <functional>
+#define HIPE_COROUTINES 1
+#endif
 
 namespace hipe {
 
 class session;
+class subtree;
+#ifdef HIPE_COROUTINES
+class scheduler;
+#endif
 
 class loc {
 ///Provides an interface to managed hipe_loc objects.
@@ -90,6 +112,16 @@ class loc {
         loc appendAndGetTag(std::string type, std::string id="");
         //convenience function to append a tag to this element and wait for its
         //location to be returned.
+
+        subtree descendants(size_t window=64);
+        //returns an iterable range over all elements below this one. Traversal requests
+        //are pipelined, with up to window requests awaiting replies at any time.
+
+        friend class subtree;
+
+#ifdef HIPE_COROUTINES
+        friend class scheduler;
+#endif
 };
 
 
@@ -101,6 +133,21 @@ class session : public loc {
 
         std::map<hipe_loc, size_t> referenceCounts; //local reference count for each location ID.
         //keep track of these counts so we can tell hipe to free resources that we no longer have references to.
+
+        static const size_t SHARDS = 64; //number of independently locked reference count tables in concurrent mode.
+        static const size_t RETIRE_THRESHOLD = 256; //retired locations per shard before a collection is attempted.
+
+        struct shard { //a slice of the reference count table, selected by location value.
+            std::mutex lock;
+            std::unordered_map<hipe_loc, size_t> counts;
+            std::vector<hipe_loc> retired; //locations whose count has reached zero since the last collection.
+        };
+        std::shared_ptr<shard> shards; //array of SHARDS, or null unless concurrent mode is enabled.
+        //(shared rather than unique, so that the session stays copyable.)
+
+        shard& shardFor(hipe_loc location) { return shards.get()[location % SHARDS]; }
+        void reclaim(shard& s);
+        //sends a free instruction for each location retired that is still unreferenced.
     protected:
         void incrementReferenceCount(hipe_loc location);
         //increments our local reference count for the location
@@ -117,12 +164,94 @@ class session : public loc {
 
         void close(); //close the hipe session
 
+        void enableConcurrency();
+        //switches reference counting to sharded, per-shard locked tables so that loc objects
+        //can be copied and destroyed from any thread. Must be called before any loc objects
+        //other than the session itself exist. In this mode a location whose count reaches zero
+        //is not freed straight away; it is retired, and freed by a later collect() only if its
+        //count is still zero. (A new reference can only be taken by copying a loc that holds
+        //one, so a location whose count is zero under its shard's lock stays unreferenced.)
+
+        void collect();
+        //frees the retired locations that are still unreferenced. Called automatically as
+        //locations are retired, and by close(); may also be called periodically (e.g. once per
+        //event loop iteration) to release locations promptly.
+
         operator hipe_session() const; //cast to the underlying hipe_session handle
 
         friend class loc;
 };
 
 
+class subtree {
+//Iterable range over the descendants of an element, walked by sending speculative
+//first-child and next-sibling requests for each discovered element without waiting
+//for the replies in between. Elements are expanded breadth-first and yielded in the
+//order they are discovered. The server replies to requests in the order they were
+//sent, so the walk must not be interleaved with other location requests on the same
+//session until iteration is complete. A location of 0 in a reply means 'no such element'.
+    private:
+        enum relation { FIRST_CHILD, NEXT_SIBLING };
+
+        session* _session;
+        size_t window; //maximum number of requests awaiting replies.
+        std::deque<relation> inFlight; //requests sent, in the order they were sent.
+        std::deque<loc> toExpand; //discovered elements whose child and sibling are still to be requested.
+        std::deque<loc> ready; //discovered elements not yet yielded by the iterator.
+        bool rootExpanded = false;
+
+        void request(relation r, const loc& l);
+        bool fill(); //waits for at least one element to be ready. Returns false when the walk is complete.
+
+    public:
+        class iterator { //single-pass input iterator; advancing may wait for replies from the server.
+            private:
+                subtree* range;
+            public:
+                iterator(subtree* range=0) : range(range) {}
+                const loc& operator* () const { return range->ready.front(); }
+                const loc* operator-> () const { return &range->ready.front(); }
+                iterator& operator++ ();
+                bool operator== (const iterator& other) const { return range == other.range; }
+                bool operator!= (const iterator& other) const { return range != other.range; }
+        };
+
+        subtree(const loc& root, size_t window);
+        subtree(const subtree&) = delete;
+        subtree& operator= (const subtree&) = delete;
+        subtree(subtree&& orig); //takes over the walk, leaving orig with no replies to await.
+        subtree& operator= (subtree&&) = delete;
+        ~subtree(); //awaits the replies still in flight (e.g. after a loop broke out early), so that
+                    //they aren't taken as the replies to later requests.
+
+        iterator begin() { return fill() ? iterator(this) : iterator(); }
+        iterator end() { return iterator(); }
+};
+
+
+class trace {
+///Records a timeline of the library's activity in every thread, to be opened in chrome://tracing or the
+///Perfetto UI (see hipe_trace_start() in hipe.h), along with spans of the application's own.
+    public:
+        static bool start(const char* path, size_t eventsPerThread=0) { return hipe_trace_start(path, eventsPerThread) == 0; }
+        //starts recording, keeping the most recent eventsPerThread events of each thread (0 for the default).
+
+        static bool stop() { return hipe_trace_stop() == 0; } //stops recording and writes the trace.
+
+        class span { //records the time from its construction to its destruction. name must outlive the trace
+                     //(e.g. a string literal).
+            private:
+                const char* name;
+                uint64_t begin;
+            public:
+                span(const char* name) : name(name), begin(hipe_trace_begin()) {}
+                span(const span&) = delete;
+                span& operator= (const span&) = delete;
+                ~span() { hipe_trace_end(name, begin); }
+        };
+};
+
+
 ///session class implementation
 //////////////
 
@@ -132,6 +261,12 @@ inline session::session() : loc(0,this) {
 inline void session::incrementReferenceCount(hipe_loc location) {
 //increments our local reference count for the location
     if(location == 0) return; //the body element is always 0, not requiring allocation.
+    if(shards) {
+        shard& s = shardFor(location);
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.counts[location]++; //a retired location that gains a new reference is simply not freed.
+        return;
+    }
     try { //try to increment referenceCounts.at(location)
     //the [] operator creates elements if they don't exist, while .at() throws exception.
         referenceCounts[location] = referenceCounts.at(location) + 1;
@@ -144,6 +279,19 @@ inline void session::decrementReferenceCount(hipe_loc location) {
 //decrmements local reference count for a particular location, or frees the location
 //if its reference count is zero.
     if(location == 0) return; //the body element is always 0, not requiring allocation.
+    if(shards) {
+        shard& s = shardFor(location);
+        bool full;
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            size_t& count = s.counts[location];
+            if(count > 0 && --count > 0) return;
+            s.retired.push_back(location);
+            full = s.retired.size() >= RETIRE_THRESHOLD;
+        }
+        if(full) collect();
+        return;
+    }
     size_t currentCount = referenceCounts[location];
     if(currentCount == 0) {
         //free this location.
@@ -153,6 +301,30 @@ inline void session::decrementReferenceCount(hipe_loc location) {
     }
 }
 
+inline void session::reclaim(shard& s) {
+    std::lock_guard<std::mutex> guard(s.lock);
+    for(hipe_loc location : s.retired) {
+        auto it = s.counts.find(location);
+        if(it != s.counts.end() && it->second == 0) {
+            s.counts.erase(it);
+            //sent with the lock held, so that no new reference can be taken to the location before
+            //the server is told to free it. (hipe_send is itself threadsafe.)
+            hipe_send((hipe_session) *this, HIPE_OP_FREE_LOCATION, 0, location, 0,0);
+        } //otherwise it was referenced again since retirement, or already freed via a duplicate entry.
+    }
+    s.retired.clear();
+}
+
+inline void session::enableConcurrency() {
+    if(!shards) shards.reset(new shard[SHARDS], std::default_delete<shard[]>());
+}
+
+inline void session::collect() {
+    if(!shards) return;
+    for(size_t i=0; i<SHARDS; i++)
+        reclaim(shards.get()[i]);
+}
+
 inline bool session::open(const char* host_key, const char* socket_path, const char* key_path, const char* client_name) {
 //open a new hipe session
     hipeSession = hipe_open_session(host_key, socket_path, key_path, client_name);
@@ -161,6 +333,7 @@ inline bool session::open(const char* host_key, const char* socket_path, const c
 
 inline void session::close() {
 //close the hipe session
+    collect(); //free what has been retired while the session can still be told.
     hipe_close_session(hipeSession);
     hipeSession = 0;
 }
@@ -280,6 +453,10 @@ inline loc loc::appendAndGetTag(std::string type, std::string id) {
     return loc(location, _session);
 }
 
+inline subtree loc::descendants(size_t window) {
+    return subtree(*this, window);
+}
+
 inline loc::operator hipe_loc() const { //allow casting to a hipe_loc variable for use with hipe API C functions.
     return location;
 }
@@ -328,4 +505,318 @@ inline bool loc::operator< (const loc& other) const {
 }
 
 
+///subtree class implementation
+//////////////
+
+inline subtree::subtree(const loc& root, size_t window) {
+    _session = root._session;
+    this->window = window ? window : 1;
+    toExpand.push_back(root);
+}
+
+inline subtree::subtree(subtree&& orig) : _session(orig._session), window(orig.window),
+        inFlight(std::move(orig.inFlight)), toExpand(std::move(orig.toExpand)), ready(std::move(orig.ready)),
+        rootExpanded(orig.rootExpanded) {
+    orig.inFlight.clear(); //a moved-from deque is only guaranteed to be valid, not empty.
+    orig.toExpand.clear();
+    orig.ready.clear();
+}
+
+inline subtree::~subtree() {
+    while(!inFlight.empty()) {
+        hipe_instruction instruction;
+        hipe_instruction_init(&instruction);
+        if(hipe_await_instruction(*_session, &instruction, HIPE_OP_LOCATION_RETURN) < 0) return;
+        loc unwanted(instruction.location, _session); //freed again as it goes out of scope.
+        hipe_instruction_clear(&instruction);
+        inFlight.pop_front();
+    }
+}
+
+inline void subtree::request(relation r, const loc& l) {
+    hipe_send(*_session, r == FIRST_CHILD ? HIPE_OP_GET_FIRST_CHILD : HIPE_OP_GET_NEXT_SIBLING, 0, l, 0, 0);
+    inFlight.push_back(r);
+}
+
+inline bool subtree::fill() {
+    while(ready.empty()) {
+        //keep the pipeline full: each discovered element needs its first child and (except
+        //for the root) its next sibling requested.
+        while(!toExpand.empty() && inFlight.size() < window) {
+            request(FIRST_CHILD, toExpand.front());
+            if(rootExpanded) request(NEXT_SIBLING, toExpand.front());
+            rootExpanded = true;
+            toExpand.pop_front();
+        }
+        if(inFlight.empty()) return false; //nothing left to discover.
+
+        hipe_instruction instruction;
+        hipe_instruction_init(&instruction);
+        if(hipe_await_instruction(*_session, &instruction, HIPE_OP_LOCATION_RETURN) < 0) return false;
+        hipe_loc location = instruction.location;
+        hipe_instruction_clear(&instruction);
+        inFlight.pop_front();
+
+        if(location == 0) continue; //no child or no further sibling.
+        loc discovered(location, _session);
+        toExpand.push_back(discovered);
+        ready.push_back(discovered);
+    }
+    return true;
+}
+
+inline subtree::iterator& subtree::iterator::operator++ () {
+    range->ready.pop_front();
+    if(!range->fill()) range = 0;
+    return *this;
+}
+
+
+#ifdef HIPE_COROUTINES
+
+class instruction {
+///Owning, move-only wrapper around a hipe_instruction received from the server.
+    private:
+        hipe_instruction data;
+    public:
+        instruction() { hipe_instruction_init(&data); }
+        instruction(const instruction&) = delete;
+        instruction& operator= (const instruction&) = delete;
+        instruction(instruction&& orig) noexcept : data(orig.data) { hipe_instruction_init(&orig.data); }
+        instruction& operator= (instruction&& orig) noexcept;
+        ~instruction() { hipe_instruction_clear(&data); }
+
+        char opcode() const { return data.opcode; }
+        uint64_t requestor() const { return data.requestor; }
+        hipe_loc location() const { return data.location; }
+        std::string arg(size_t i) const; //returns argument i as a string ("" if absent).
+
+        hipe_instruction* get() { return &data; } //access to the underlying C instruction.
+};
+
+
+class task {
+///Return type for fire-and-forget coroutines driven by a hipe::scheduler.
+///The coroutine starts running immediately and its frame is destroyed when it finishes.
+    public:
+        struct promise_type {
+            task get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() { std::terminate(); }
+        };
+};
+
+
+class scheduler {
+//Single-threaded scheduler that multiplexes coroutines over one session.
+//Each request made through the scheduler is tagged with a unique requestor value,
+//which the server echoes in its reply, so replies are matched to the coroutine
+//that is waiting on them regardless of the order in which they arrive.
+//Instructions that no coroutine is waiting for are passed to the unhandled callback.
+    private:
+        struct waiter {
+            char opcode;
+            std::coroutine_handle<> handle;
+            instruction* slot;
+        };
+
+        session& _session;
+        uint64_t nextRequestor = (uint64_t) 1 << 32; //keep clear of small application-defined requestor values.
+        std::unordered_map<uint64_t, std::deque<waiter>> waiting; //suspended coroutines keyed by requestor.
+        size_t waitingCount = 0;
+        bool stopped = false;
+
+        void enqueue(char opcode, uint64_t requestor, std::coroutine_handle<> h, instruction* slot);
+        bool resume(instruction& incoming); //returns false if no coroutine was waiting for it.
+
+    public:
+        class reply { //awaitable for the next instruction with a given opcode and requestor.
+            protected:
+                scheduler* _scheduler;
+                char opcode;
+                uint64_t requestor;
+                instruction result;
+            public:
+                reply(scheduler* s, char opcode, uint64_t requestor) : _scheduler(s), opcode(opcode), requestor(requestor) {}
+                bool await_ready() const noexcept { return false; }
+                void await_suspend(std::coroutine_handle<> h) { _scheduler->enqueue(opcode, requestor, h, &result); }
+                instruction await_resume() { return std::move(result); }
+        };
+
+        class location_reply : public reply { //resumes with the returned location as a managed loc.
+            public:
+                using reply::reply;
+                loc await_resume();
+        };
+
+        class text_reply : public reply { //resumes with the first argument of the reply.
+            public:
+                using reply::reply;
+                std::string await_resume() { return result.arg(0); }
+        };
+
+        std::function<void(instruction&)> unhandled;
+        //called for instructions (e.g. events with application-defined requestors) that no
+        //coroutine is waiting for.
+
+        scheduler(session& s) : _session(s) {}
+
+        uint64_t newRequestor() { return nextRequestor++; } //allocate a unique requestor value.
+
+        location_reply getById(const std::string& id);
+        location_reply firstChild(const loc& l);
+        location_reply lastChild(const loc& l);
+        location_reply nextSibling(const loc& l);
+        location_reply prevSibling(const loc& l);
+        location_reply appendAndGetTag(const loc& parent, const std::string& type, const std::string& id="");
+        //awaitable location queries. Each sends its request immediately.
+
+        text_reply content(const loc& l); //awaitable content query (HIPE_OP_GET_CONTENT).
+
+        text_reply dialogInput(const std::string& title, const std::string& prompt, const std::string& defaultText="");
+        //opens an input dialog and resumes with the text entered by the user.
+
+        uint64_t listen(const loc& l, const std::string& eventType);
+        //requests events of the given type from an element, and returns the requestor value
+        //to pass to event().
+
+        reply event(uint64_t requestor); //awaits the next event delivered to a requestor.
+
+        void run();
+        //dispatches incoming instructions to waiting coroutines until the frame is closed,
+        //the connection is lost, or stop() is called.
+
+        void stop() { stopped = true; }
+
+        size_t pending() const { return waitingCount; } //number of suspended coroutines.
+};
+
+
+///instruction class implementation
+//////////////
+
+inline instruction& instruction::operator= (instruction&& orig) noexcept {
+    if(&orig == this) return *this;
+    hipe_instruction_clear(&data);
+    data = orig.data;
+    hipe_instruction_init(&orig.data);
+    return *this;
+}
+
+inline std::string instruction::arg(size_t i) const {
+    if(i >= HIPE_NARGS || !data.arg[i]) return "";
+    return std::string(data.arg[i], data.arg_length[i]);
+}
+
+
+///scheduler class implementation
+//////////////
+
+inline void scheduler::enqueue(char opcode, uint64_t requestor, std::coroutine_handle<> h, instruction* slot) {
+    waiting[requestor].push_back({opcode, h, slot});
+    waitingCount++;
+}
+
+inline bool scheduler::resume(instruction& incoming) {
+//hand the instruction to the first coroutine waiting on its requestor and opcode, then resume it.
+    auto it = waiting.find(incoming.requestor());
+    if(it == waiting.end()) return false;
+    std::deque<waiter>& queue = it->second;
+    for(auto w = queue.begin(); w != queue.end(); w++) {
+        if(w->opcode != incoming.opcode()) continue;
+        waiter found = *w;
+        queue.erase(w);
+        if(queue.empty()) waiting.erase(it);
+        waitingCount--;
+        *found.slot = std::move(incoming);
+        found.handle.resume(); //may register new waiters before returning.
+        return true;
+    }
+    return false;
+}
+
+inline scheduler::location_reply scheduler::getById(const std::string& id) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_GET_BY_ID, requestor, 0, 1, id.c_str());
+    return location_reply(this, HIPE_OP_LOCATION_RETURN, requestor);
+}
+
+inline scheduler::location_reply scheduler::firstChild(const loc& l) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_GET_FIRST_CHILD, requestor, l, 0);
+    return location_reply(this, HIPE_OP_LOCATION_RETURN, requestor);
+}
+
+inline scheduler::location_reply scheduler::lastChild(const loc& l) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_GET_LAST_CHILD, requestor, l, 0);
+    return location_reply(this, HIPE_OP_LOCATION_RETURN, requestor);
+}
+
+inline scheduler::location_reply scheduler::nextSibling(const loc& l) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_GET_NEXT_SIBLING, requestor, l, 0);
+    return location_reply(this, HIPE_OP_LOCATION_RETURN, requestor);
+}
+
+inline scheduler::location_reply scheduler::prevSibling(const loc& l) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_GET_PREV_SIBLING, requestor, l, 0);
+    return location_reply(this, HIPE_OP_LOCATION_RETURN, requestor);
+}
+
+inline scheduler::location_reply scheduler::appendAndGetTag(const loc& parent, const std::string& type, const std::string& id) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_APPEND_TAG, requestor, parent, 3, type.c_str(), id.c_str(), "1");
+    return location_reply(this, HIPE_OP_LOCATION_RETURN, requestor);
+}
+
+inline scheduler::text_reply scheduler::content(const loc& l) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_GET_CONTENT, requestor, l, 0);
+    return text_reply(this, HIPE_OP_CONTENT_RETURN, requestor);
+}
+
+inline scheduler::text_reply scheduler::dialogInput(const std::string& title, const std::string& prompt, const std::string& defaultText) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_DIALOG_INPUT, requestor, 0, 3, title.c_str(), prompt.c_str(), defaultText.c_str());
+    return text_reply(this, HIPE_OP_DIALOG_RETURN, requestor);
+}
+
+inline uint64_t scheduler::listen(const loc& l, const std::string& eventType) {
+    uint64_t requestor = newRequestor();
+    hipe_send(_session, HIPE_OP_EVENT_REQUEST, requestor, l, 1, eventType.c_str());
+    return requestor;
+}
+
+inline scheduler::reply scheduler::event(uint64_t requestor) {
+    return reply(this, HIPE_OP_EVENT, requestor);
+}
+
+inline loc scheduler::location_reply::await_resume() {
+    return loc(result.location(), &_scheduler->_session);
+}
+
+inline void scheduler::run() {
+    stopped = false;
+    instruction incoming;
+    while(!stopped) {
+        if(hipe_next_instruction(_session, incoming.get(), 1) < 0) break; //disconnected.
+        {
+            trace::span resuming("resume"); //time until the coroutine suspends again or finishes.
+            if(resume(incoming)) continue;
+        }
+        if(incoming.opcode() == HIPE_OP_FRAME_CLOSE) stopped = true;
+        if(unhandled) {
+            trace::span handling("unhandled");
+            unhandled(incoming);
+        }
+    }
+}
+
+#endif
+
+
 };//end of hipe:: namespace
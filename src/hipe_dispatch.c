@@ -0,0 +1,242 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include "hipe.h"
+#include "hipe_trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 64 /*must be a power of two.*/
+/* Tables are rehashed when more than 3/4 of their slots are occupied, counting removed slots,
+ * so that probe sequences stay short. They double in size only if at least half of their slots
+ * are in use; otherwise the rehash just clears out the removed slots. */
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+#define SLOT_REMOVED 2 /*tombstone; keeps probe sequences intact after a removal.*/
+
+struct dispatch_slot {
+    char state;
+    uint64_t key;     /*requestor value, or location for location/event-type registrations.*/
+    uint64_t subkey;  /*hash of the event type for location registrations, otherwise 0.*/
+    char* event_type; /*copy of the event type for location registrations, otherwise null.*/
+    hipe_handler handler;
+    void* userdata;
+};
+
+struct dispatch_table { /*open-addressed hash table with linear probing.*/
+    struct dispatch_slot* slots;
+    size_t capacity;
+    size_t used; /*slots in state SLOT_USED*/
+    size_t occupied; /*slots in state SLOT_USED or SLOT_REMOVED*/
+};
+
+struct _hipe_dispatcher {
+    struct dispatch_table by_requestor;
+    struct dispatch_table by_location;
+    hipe_handler default_handler;
+    void* default_userdata;
+};
+
+
+static uint64_t mix(uint64_t x) {
+/*splitmix64 finaliser. Requestor and location values tend to be small sequential integers,
+ *so they are scrambled before being reduced to a slot index.*/
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t hash_string(const char* str, size_t length) {
+/*FNV-1a hash of an event type string.*/
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for(i=0; i<length; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int table_init(struct dispatch_table* table, size_t capacity) {
+    table->slots = (struct dispatch_slot*) calloc(capacity, sizeof(struct dispatch_slot));
+    if(!table->slots) return -1;
+    table->capacity = capacity;
+    table->used = 0;
+    table->occupied = 0;
+    return 0;
+}
+
+static void table_clear(struct dispatch_table* table) {
+    size_t i;
+    for(i=0; i<table->capacity; i++)
+        free(table->slots[i].event_type);
+    free(table->slots);
+    table->slots = 0;
+}
+
+static struct dispatch_slot* table_find(struct dispatch_table* table, uint64_t key, uint64_t subkey,
+                                        const char* event_type, size_t event_type_length) {
+/*returns the slot holding key, or null if it is not present.*/
+    size_t mask = table->capacity - 1;
+    size_t i = mix(key ^ subkey) & mask;
+    while(table->slots[i].state != SLOT_EMPTY) {
+        struct dispatch_slot* slot = &table->slots[i];
+        if(slot->state == SLOT_USED && slot->key == key && slot->subkey == subkey) {
+            if(!slot->event_type) return slot;
+            if(strlen(slot->event_type) == event_type_length
+               && memcmp(slot->event_type, event_type, event_type_length) == 0)
+                return slot;
+        }
+        i = (i+1) & mask;
+    }
+    return 0;
+}
+
+static int table_rehash(struct dispatch_table* table, size_t capacity) {
+/*rehash into a table of the given size, discarding tombstones.*/
+    struct dispatch_table rehashed;
+    size_t i;
+    if(table_init(&rehashed, capacity)) return -1;
+    for(i=0; i<table->capacity; i++) {
+        struct dispatch_slot* slot = &table->slots[i];
+        if(slot->state != SLOT_USED) continue;
+        size_t j = mix(slot->key ^ slot->subkey) & (rehashed.capacity - 1);
+        while(rehashed.slots[j].state != SLOT_EMPTY) j = (j+1) & (rehashed.capacity - 1);
+        rehashed.slots[j] = *slot;
+        rehashed.used++;
+        rehashed.occupied++;
+    }
+    free(table->slots);
+    *table = rehashed;
+    return 0;
+}
+
+static int table_set(struct dispatch_table* table, uint64_t key, uint64_t subkey, const char* event_type,
+                     hipe_handler handler, void* userdata) {
+/*inserts, replaces or (if handler is null) removes a registration.*/
+    size_t event_type_length = event_type ? strlen(event_type) : 0;
+    struct dispatch_slot* slot = table_find(table, key, subkey, event_type, event_type_length);
+
+    if(!handler) { /*removal*/
+        if(slot) {
+            free(slot->event_type);
+            slot->event_type = 0;
+            slot->state = SLOT_REMOVED;
+            table->used--;
+        }
+        return 0;
+    }
+    if(slot) { /*replacement*/
+        slot->handler = handler;
+        slot->userdata = userdata;
+        return 0;
+    }
+
+    if((table->occupied + 1) * 4 > table->capacity * 3) {
+        /*mostly tombstones (e.g. handlers registered and removed one at a time) need no more room.*/
+        size_t capacity = (table->used + 1) * 2 > table->capacity ? table->capacity * 2 : table->capacity;
+        if(table_rehash(table, capacity)) return -1;
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t i = mix(key ^ subkey) & mask;
+    while(table->slots[i].state == SLOT_USED) i = (i+1) & mask; /*reuse the first tombstone or empty slot*/
+    slot = &table->slots[i];
+    if(slot->state == SLOT_EMPTY) table->occupied++;
+    slot->event_type = 0;
+    if(event_type) {
+        slot->event_type = strdup(event_type);
+        if(!slot->event_type) return -1;
+    }
+    slot->state = SLOT_USED;
+    slot->key = key;
+    slot->subkey = subkey;
+    slot->handler = handler;
+    slot->userdata = userdata;
+    table->used++;
+    return 0;
+}
+
+
+hipe_dispatcher hipe_dispatcher_create(void) {
+    hipe_dispatcher dispatcher = (hipe_dispatcher) malloc(sizeof(struct _hipe_dispatcher));
+    if(!dispatcher) return 0;
+    if(table_init(&dispatcher->by_requestor, INITIAL_CAPACITY)) {
+        free(dispatcher);
+        return 0;
+    }
+    if(table_init(&dispatcher->by_location, INITIAL_CAPACITY)) {
+        table_clear(&dispatcher->by_requestor);
+        free(dispatcher);
+        return 0;
+    }
+    dispatcher->default_handler = 0;
+    dispatcher->default_userdata = 0;
+    return dispatcher;
+}
+
+void hipe_dispatcher_destroy(hipe_dispatcher dispatcher) {
+    if(!dispatcher) return;
+    table_clear(&dispatcher->by_requestor);
+    table_clear(&dispatcher->by_location);
+    free(dispatcher);
+}
+
+int hipe_dispatch_requestor(hipe_dispatcher dispatcher, uint64_t requestor, hipe_handler handler, void* userdata) {
+    return table_set(&dispatcher->by_requestor, requestor, 0, 0, handler, userdata);
+}
+
+int hipe_dispatch_location(hipe_dispatcher dispatcher, hipe_loc location, const char* event_type, hipe_handler handler, void* userdata) {
+    uint64_t subkey = hash_string(event_type, strlen(event_type));
+    return table_set(&dispatcher->by_location, location, subkey, event_type, handler, userdata);
+}
+
+void hipe_dispatch_default(hipe_dispatcher dispatcher, hipe_handler handler, void* userdata) {
+    dispatcher->default_handler = handler;
+    dispatcher->default_userdata = userdata;
+}
+
+short hipe_dispatch(hipe_dispatcher dispatcher, hipe_session session, hipe_instruction* instruction) {
+    struct dispatch_slot* slot = 0;
+
+    if(instruction->opcode == HIPE_OP_EVENT && dispatcher->by_location.used && instruction->arg[0]) {
+        /*most specific registration first: this event type at this location.*/
+        size_t length = instruction->arg_length[0];
+        slot = table_find(&dispatcher->by_location, instruction->location,
+                          hash_string(instruction->arg[0], length), instruction->arg[0], length);
+    }
+    if(!slot && dispatcher->by_requestor.used)
+        slot = table_find(&dispatcher->by_requestor, instruction->requestor, 0, 0, 0);
+
+    uint64_t traceBegin = TRACING() ? trace_now() : 0; /*handlers are shown as spans named "handler"*/
+    short opcode = instruction->opcode; /*the handler may clear the instruction*/
+    if(slot) {
+        slot->handler(session, instruction, slot->userdata);
+    } else if(dispatcher->default_handler) {
+        dispatcher->default_handler(session, instruction, dispatcher->default_userdata);
+    } else {
+        return 0;
+    }
+    if(traceBegin) trace_span("handler", traceBegin, opcode, -1);
+    return 1;
+}
@@ -0,0 +1,614 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include "hipe_replay.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAP_INITIAL_CAPACITY 64 /*must be a power of two.*/
+
+struct loc_map { /*open-addressed hash table from 64-bit keys to 64-bit values, with linear probing. Key 0 marks an empty slot.*/
+    uint64_t* keys;
+    uint64_t* values;
+    size_t capacity;
+    size_t used;
+};
+
+struct replay_node { /*an element or run of text in the shadow document.*/
+    hipe_instruction creation; /*the HIPE_OP_APPEND_TAG or HIPE_OP_APPEND_TEXT that created it (opcode 0 for the body)*/
+    struct replay_node* parent;
+    struct replay_node* firstChild;
+    struct replay_node* lastChild;
+    struct replay_node* prev;
+    struct replay_node* next;
+    hipe_loc* locations; /*the client's locations for the element (usually one)*/
+    size_t locationCount;
+    hipe_instruction* properties; /*the HIPE_OP_SET_STYLE, HIPE_OP_SET_ATTRIBUTE and HIPE_OP_EVENT_REQUEST instructions in effect*/
+    size_t propertyCount;
+    size_t propertyCapacity;
+    hipe_loc serverLocation; /*the element's location on the new server, while restoring*/
+};
+
+struct request_queue { /*ring buffer of the requests still waiting for a reply, oldest first.*/
+    hipe_instruction* requests;
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+struct hipe_replay {
+    struct replay_node root; /*the body*/
+    struct loc_map nodes; /*client location -> node*/
+    struct loc_map ids; /*hash of an element ID -> the node most recently created with that ID*/
+    struct loc_map toServer; /*client location -> server location, once the frame has been restored*/
+    struct loc_map toClient; /*server location -> client location, once the frame has been restored*/
+    hipe_instruction* globals; /*HIPE_OP_ADD_STYLE_RULE and HIPE_OP_SET_TITLE instructions in effect*/
+    size_t globalCount;
+    size_t globalCapacity;
+    struct request_queue locationRequests; /*requests answered by HIPE_OP_LOCATION_RETURN*/
+    struct request_queue contentRequests; /*requests answered by HIPE_OP_CONTENT_RETURN*/
+    unsigned restores; /*number of times the frame has been restored on a new server*/
+    hipe_loc highestLocation; /*the highest location given to the client; new elements' locations are given out after it*/
+};
+
+
+static uint64_t mix(uint64_t x) {
+/*splitmix64 finaliser, as used by the dispatcher.*/
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t hash_id(const char* id, size_t length) {
+/*FNV-1a hash of an element ID. Never 0, so it can be used as a map key.*/
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for(i=0; i<length; i++) {
+        h ^= (unsigned char) id[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+static void map_clear(struct loc_map* map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(*map));
+}
+
+static uint64_t map_get(const struct loc_map* map, uint64_t key, short* found) {
+    *found = 0;
+    if(!map->capacity || !key) return 0;
+    size_t mask = map->capacity - 1;
+    size_t i;
+    for(i = mix(key) & mask; map->keys[i]; i = (i+1) & mask) {
+        if(map->keys[i] == key) {
+            *found = 1;
+            return map->values[i];
+        }
+    }
+    return 0;
+}
+
+static int map_set(struct loc_map* map, uint64_t key, uint64_t value) {
+    if(!key) return 0;
+    if((map->used + 1) * 4 > map->capacity * 3) { /*grow, keeping the table at most three quarters full.*/
+        struct loc_map bigger;
+        bigger.capacity = map->capacity ? map->capacity * 2 : MAP_INITIAL_CAPACITY;
+        bigger.keys = (uint64_t*) calloc(bigger.capacity, sizeof(uint64_t));
+        bigger.values = (uint64_t*) calloc(bigger.capacity, sizeof(uint64_t));
+        bigger.used = 0;
+        if(!bigger.keys || !bigger.values) {
+            free(bigger.keys);
+            free(bigger.values);
+            return -1;
+        }
+        size_t i;
+        for(i=0; i<map->capacity; i++)
+            if(map->keys[i]) map_set(&bigger, map->keys[i], map->values[i]);
+        map_clear(map);
+        *map = bigger;
+    }
+    size_t mask = map->capacity - 1;
+    size_t i = mix(key) & mask;
+    while(map->keys[i] && map->keys[i] != key) i = (i+1) & mask;
+    if(!map->keys[i]) map->used++;
+    map->keys[i] = key;
+    map->values[i] = value;
+    return 0;
+}
+
+static void map_remove(struct loc_map* map, uint64_t key) {
+/*removes a key, moving later keys in its probe sequence back so that none are cut off from their home slot.*/
+    if(!map->capacity || !key) return;
+    size_t mask = map->capacity - 1;
+    size_t i = mix(key) & mask;
+    while(map->keys[i] && map->keys[i] != key) i = (i+1) & mask;
+    if(!map->keys[i]) return;
+    size_t empty = i;
+    for(i = (empty+1) & mask; map->keys[i]; i = (i+1) & mask) {
+        size_t home = mix(map->keys[i]) & mask;
+        short canMove = empty <= i ? (home <= empty || home > i) : (home <= empty && home > i);
+        if(canMove) {
+            map->keys[empty] = map->keys[i];
+            map->values[empty] = map->values[i];
+            empty = i;
+        }
+    }
+    map->keys[empty] = 0;
+    map->values[empty] = 0;
+    map->used--;
+}
+
+
+static int queue_push(struct request_queue* queue, const hipe_instruction* request) {
+    if(queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+        hipe_instruction* requests = (hipe_instruction*) malloc(capacity * sizeof(hipe_instruction));
+        if(!requests) return -1;
+        size_t i;
+        for(i=0; i<queue->count; i++)
+            requests[i] = queue->requests[(queue->head + i) % queue->capacity];
+        free(queue->requests);
+        queue->requests = requests;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+    hipe_instruction* slot = &queue->requests[(queue->head + queue->count) % queue->capacity];
+    hipe_instruction_init(slot);
+    hipe_instruction_copy(slot, (hipe_instruction*) request);
+    queue->count++;
+    return 0;
+}
+
+static short queue_pop(struct request_queue* queue, hipe_instruction* request_ret) {
+/*moves the oldest request into request_ret. Returns 0 if the queue is empty.*/
+    if(!queue->count) return 0;
+    *request_ret = queue->requests[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    return 1;
+}
+
+static void queue_clear(struct request_queue* queue) {
+    hipe_instruction request;
+    while(queue_pop(queue, &request)) hipe_instruction_clear(&request);
+    free(queue->requests);
+    memset(queue, 0, sizeof(*queue));
+}
+
+
+static short same_arg(const hipe_instruction* a, const hipe_instruction* b, short arg) {
+    return a->arg_length[arg] == b->arg_length[arg]
+           && (!a->arg_length[arg] || !memcmp(a->arg[arg], b->arg[arg], a->arg_length[arg]));
+}
+
+static short same_property(const hipe_instruction* a, const hipe_instruction* b) {
+/*returns 1 if instruction b replaces the effect of instruction a: the same style or attribute, the same
+ *event subscription, or (for global instructions) the same title or the same style rule.*/
+    if(a->opcode != b->opcode) return 0;
+    switch(a->opcode) {
+    case HIPE_OP_EVENT_REQUEST:
+        return a->requestor == b->requestor && same_arg(a, b, 0);
+    case HIPE_OP_SET_TITLE:
+        return 1;
+    case HIPE_OP_ADD_STYLE_RULE:
+        return same_arg(a, b, 0) && same_arg(a, b, 1);
+    default:
+        return same_arg(a, b, 0);
+    }
+}
+
+static int upsert(hipe_instruction** list, size_t* count, size_t* capacity, const hipe_instruction* instruction) {
+/*adds a copy of an instruction to a list, replacing the one whose effect it replaces, if any.*/
+    size_t i;
+    for(i=0; i<*count; i++) {
+        if(same_property(&(*list)[i], instruction)) {
+            hipe_instruction_clear(&(*list)[i]);
+            hipe_instruction_copy(&(*list)[i], (hipe_instruction*) instruction);
+            (*list)[i].location = 0;
+            return 0;
+        }
+    }
+    if(*count == *capacity) {
+        size_t bigger = *capacity ? *capacity * 2 : 4;
+        hipe_instruction* grown = (hipe_instruction*) realloc(*list, bigger * sizeof(hipe_instruction));
+        if(!grown) return -1;
+        *list = grown;
+        *capacity = bigger;
+    }
+    hipe_instruction_init(&(*list)[*count]);
+    hipe_instruction_copy(&(*list)[*count], (hipe_instruction*) instruction);
+    (*list)[*count].location = 0;
+    (*count)++;
+    return 0;
+}
+
+
+static struct replay_node* find_node(struct hipe_replay* replay, hipe_loc location) {
+/*the element with a client location, the body for location 0, or null if the element is not recorded.*/
+    if(!location) return &replay->root;
+    short found;
+    uint64_t node = map_get(&replay->nodes, location, &found);
+    return found ? (struct replay_node*) (uintptr_t) node : 0;
+}
+
+static void forget_location(struct hipe_replay* replay, hipe_loc location) {
+    short found;
+    uint64_t server = map_get(&replay->toServer, location, &found);
+    if(found) {
+        map_remove(&replay->toServer, location);
+        map_remove(&replay->toClient, server);
+    }
+    map_remove(&replay->nodes, location);
+}
+
+static void free_children(struct hipe_replay* replay, struct replay_node* node);
+
+static void free_node(struct hipe_replay* replay, struct replay_node* node) {
+/*frees a node and everything in it. The node must already be unlinked from its parent.*/
+    size_t i;
+    free_children(replay, node);
+    for(i=0; i<node->locationCount; i++)
+        forget_location(replay, node->locations[i]);
+    if(node->creation.opcode == HIPE_OP_APPEND_TAG && node->creation.arg_length[1]) {
+        short found;
+        uint64_t key = hash_id(node->creation.arg[1], node->creation.arg_length[1]);
+        if((struct replay_node*) (uintptr_t) map_get(&replay->ids, key, &found) == node)
+            map_remove(&replay->ids, key);
+    }
+    for(i=0; i<node->propertyCount; i++)
+        hipe_instruction_clear(&node->properties[i]);
+    free(node->properties);
+    free(node->locations);
+    hipe_instruction_clear(&node->creation);
+    free(node);
+}
+
+static void free_children(struct hipe_replay* replay, struct replay_node* node) {
+    struct replay_node* child = node->firstChild;
+    while(child) {
+        struct replay_node* next = child->next;
+        free_node(replay, child);
+        child = next;
+    }
+    node->firstChild = 0;
+    node->lastChild = 0;
+}
+
+static void unlink_node(struct replay_node* node) {
+    if(node->prev) node->prev->next = node->next;
+    else node->parent->firstChild = node->next;
+    if(node->next) node->next->prev = node->prev;
+    else node->parent->lastChild = node->prev;
+    node->prev = 0;
+    node->next = 0;
+}
+
+static struct replay_node* append_node(struct replay_node* parent, const hipe_instruction* creation) {
+    struct replay_node* node = (struct replay_node*) calloc(1, sizeof(struct replay_node));
+    if(!node) return 0;
+    hipe_instruction_init(&node->creation);
+    hipe_instruction_copy(&node->creation, (hipe_instruction*) creation);
+    node->creation.location = 0;
+    node->creation.next = 0;
+    node->parent = parent;
+    node->prev = parent->lastChild;
+    if(parent->lastChild) parent->lastChild->next = node;
+    else parent->firstChild = node;
+    parent->lastChild = node;
+    return node;
+}
+
+static void bind_location(struct hipe_replay* replay, const char* id, size_t idLength, hipe_loc location) {
+/*records the location returned for the element with an ID, looked up or just appended.*/
+    short found;
+    struct replay_node* node = (struct replay_node*) (uintptr_t) map_get(&replay->ids, hash_id(id, idLength), &found);
+    if(!found || node->creation.arg_length[1] != idLength || memcmp(node->creation.arg[1], id, idLength))
+        return; /*not an element this client created (or a hash collision)*/
+    size_t i;
+    for(i=0; i<node->locationCount; i++)
+        if(node->locations[i] == location) return;
+
+    struct replay_node* previous = find_node(replay, location);
+    if(previous && previous != node) { /*the server has reused the location of an element it no longer has.*/
+        size_t j;
+        for(j=0; j<previous->locationCount; j++)
+            if(previous->locations[j] == location) previous->locations[j] = previous->locations[--previous->locationCount];
+    }
+    hipe_loc* locations = (hipe_loc*) realloc(node->locations, (node->locationCount + 1) * sizeof(hipe_loc));
+    if(!locations) return;
+    node->locations = locations;
+    node->locations[node->locationCount++] = location;
+    map_set(&replay->nodes, location, (uint64_t) (uintptr_t) node);
+}
+
+
+struct hipe_replay* replay_create(void) {
+    struct hipe_replay* replay = (struct hipe_replay*) calloc(1, sizeof(struct hipe_replay));
+    if(!replay) return 0;
+    hipe_instruction_init(&replay->root.creation);
+    return replay;
+}
+
+void replay_destroy(struct hipe_replay* replay) {
+    if(!replay) return;
+    free_children(replay, &replay->root);
+    size_t i;
+    for(i=0; i<replay->root.propertyCount; i++)
+        hipe_instruction_clear(&replay->root.properties[i]);
+    free(replay->root.properties);
+    for(i=0; i<replay->globalCount; i++)
+        hipe_instruction_clear(&replay->globals[i]);
+    free(replay->globals);
+    map_clear(&replay->nodes);
+    map_clear(&replay->ids);
+    map_clear(&replay->toServer);
+    map_clear(&replay->toClient);
+    queue_clear(&replay->locationRequests);
+    queue_clear(&replay->contentRequests);
+    free(replay);
+}
+
+void replay_record(struct hipe_replay* replay, const hipe_instruction* instruction) {
+    struct replay_node* node;
+    switch(instruction->opcode) {
+    case HIPE_OP_APPEND_TAG:
+    case HIPE_OP_APPEND_TEXT:
+        if(instruction->opcode == HIPE_OP_APPEND_TAG && instruction->arg_length[2] && instruction->arg[2][0] == '1')
+            queue_push(&replay->locationRequests, instruction); /*the server returns the new element's location.*/
+        if(!(node = find_node(replay, instruction->location))) return;
+        node = append_node(node, instruction);
+        if(node && instruction->opcode == HIPE_OP_APPEND_TAG && instruction->arg_length[1])
+            map_set(&replay->ids, hash_id(instruction->arg[1], instruction->arg_length[1]), (uint64_t) (uintptr_t) node);
+        return;
+    case HIPE_OP_SET_TEXT: /*replaces the element's content with the text.*/
+        if(!(node = find_node(replay, instruction->location))) return;
+        free_children(replay, node);
+        if(instruction->arg_length[0]) {
+            hipe_instruction text = *instruction;
+            text.opcode = HIPE_OP_APPEND_TEXT;
+            append_node(node, &text);
+        }
+        return;
+    case HIPE_OP_CLEAR:
+        if((node = find_node(replay, instruction->location))) free_children(replay, node);
+        return;
+    case HIPE_OP_DELETE:
+        if(!instruction->location || !(node = find_node(replay, instruction->location))) return;
+        unlink_node(node);
+        free_node(replay, node);
+        return;
+    case HIPE_OP_SET_STYLE:
+    case HIPE_OP_SET_ATTRIBUTE:
+    case HIPE_OP_EVENT_REQUEST:
+        if((node = find_node(replay, instruction->location)))
+            upsert(&node->properties, &node->propertyCount, &node->propertyCapacity, instruction);
+        return;
+    case HIPE_OP_EVENT_CANCEL:
+        if((node = find_node(replay, instruction->location))) {
+            size_t i;
+            for(i=0; i<node->propertyCount; i++) {
+                hipe_instruction* request = &node->properties[i];
+                if(request->opcode == HIPE_OP_EVENT_REQUEST && request->requestor == instruction->requestor
+                   && (!instruction->arg_length[0] || same_arg(request, instruction, 0))) {
+                    hipe_instruction_clear(request);
+                    node->properties[i--] = node->properties[--node->propertyCount];
+                }
+            }
+        }
+        return;
+    case HIPE_OP_FREE_LOCATION:
+        if(instruction->location && (node = find_node(replay, instruction->location))) {
+            size_t i;
+            for(i=0; i<node->locationCount; i++)
+                if(node->locations[i] == instruction->location) node->locations[i] = node->locations[--node->locationCount];
+            forget_location(replay, instruction->location);
+        }
+        return;
+    case HIPE_OP_ADD_STYLE_RULE:
+    case HIPE_OP_SET_TITLE:
+        upsert(&replay->globals, &replay->globalCount, &replay->globalCapacity, instruction);
+        return;
+    case HIPE_OP_GET_BY_ID:
+    case HIPE_OP_GET_FIRST_CHILD:
+    case HIPE_OP_GET_LAST_CHILD:
+    case HIPE_OP_GET_NEXT_SIBLING:
+    case HIPE_OP_GET_PREV_SIBLING:
+        queue_push(&replay->locationRequests, instruction);
+        return;
+    case HIPE_OP_GET_CONTENT:
+        queue_push(&replay->contentRequests, instruction);
+        return;
+    }
+}
+
+hipe_loc replay_to_server(struct hipe_replay* replay, hipe_loc location) {
+    if(!replay->restores || !location) return location;
+    short found;
+    hipe_loc server = map_get(&replay->toServer, location, &found);
+    return found ? server : 0;
+}
+
+static hipe_loc to_client(struct hipe_replay* replay, hipe_loc location) {
+/*translates a server location. If the client has no location for it yet, it is given a new one, so that it
+ *can't be mistaken for an element that the client knew by that location before the frame was restored.*/
+    if(!location) return 0;
+    if(!replay->restores) {
+        if(location > replay->highestLocation) replay->highestLocation = location;
+        return location;
+    }
+    short found;
+    hipe_loc client = map_get(&replay->toClient, location, &found);
+    if(found) return client;
+    client = ++replay->highestLocation;
+    map_set(&replay->toClient, location, client);
+    map_set(&replay->toServer, client, location);
+    return client;
+}
+
+void replay_incoming(struct hipe_replay* replay, hipe_instruction* instruction) {
+    hipe_instruction request;
+    if(instruction->opcode == HIPE_OP_LOCATION_RETURN) {
+        instruction->location = to_client(replay, instruction->location);
+        if(queue_pop(&replay->locationRequests, &request)) {
+            if(instruction->location && request.opcode == HIPE_OP_GET_BY_ID)
+                bind_location(replay, request.arg[0], request.arg_length[0], instruction->location);
+            else if(instruction->location && request.opcode == HIPE_OP_APPEND_TAG && request.arg_length[1])
+                bind_location(replay, request.arg[1], request.arg_length[1], instruction->location);
+            hipe_instruction_clear(&request);
+        }
+        return;
+    }
+    if(instruction->opcode == HIPE_OP_CONTENT_RETURN && queue_pop(&replay->contentRequests, &request))
+        hipe_instruction_clear(&request);
+    instruction->location = to_client(replay, instruction->location);
+}
+
+
+static int send_at(hipe_session session, const hipe_instruction* instruction, hipe_loc location) {
+/*sends a recorded instruction to a location on the new server.*/
+    hipe_instruction copy = *instruction;
+    copy.location = location;
+    copy.next = 0;
+    if(copy.opcode == HIPE_OP_APPEND_TAG) copy.arg_length[2] = 0; /*its location was asked for only once.*/
+    return hipe_send_instruction(session, copy);
+}
+
+static int resend_requests(struct hipe_replay* replay, hipe_session session, struct request_queue* queue) {
+/*each request is taken from the front of the queue and put back at the end once it has been sent.
+ *A request for an element that wasn't restored can't be sent: a location request is replaced by a lookup
+ *that finds nothing, so the client is still answered, and a content request is dropped.*/
+    size_t i, count = queue->count;
+    int result = 0;
+    for(i=0; i<count; i++) {
+        hipe_instruction request;
+        queue_pop(queue, &request);
+        hipe_loc location = replay_to_server(replay, request.location);
+        if(!result && (request.opcode == HIPE_OP_APPEND_TAG || (request.location && !location))) {
+            if(request.opcode == HIPE_OP_GET_CONTENT) {
+                hipe_instruction_clear(&request);
+                continue;
+            }
+            /*an appended element has been rebuilt already, so it is looked up (by its ID, if it has one) instead.*/
+            hipe_instruction lookup;
+            hipe_instruction_init(&lookup);
+            lookup.opcode = HIPE_OP_GET_BY_ID;
+            if(request.opcode == HIPE_OP_APPEND_TAG) {
+                lookup.arg[0] = request.arg[1];
+                lookup.arg_length[0] = request.arg_length[1];
+            }
+            result = hipe_send_instruction(session, lookup);
+        } else if(!result) {
+            result = send_at(session, &request, location);
+        }
+        if(queue_push(queue, &request)) result = -1;
+        hipe_instruction_clear(&request);
+    }
+    return result;
+}
+
+int replay_restore(struct hipe_replay* replay, hipe_session session) {
+    size_t i, j;
+    int result = 0;
+
+    /*the new server knows none of the client's locations.*/
+    map_clear(&replay->toServer);
+    map_clear(&replay->toClient);
+    replay->restores++;
+    replay->root.serverLocation = 0;
+
+    struct replay_node** level = (struct replay_node**) malloc(sizeof(struct replay_node*));
+    size_t levelCount = 1;
+    if(!level) return -1;
+    level[0] = &replay->root;
+
+    hipe_cork(session);
+    for(i=0; i<replay->globalCount && !result; i++)
+        result = send_at(session, &replay->globals[i], 0);
+
+    while(levelCount && !result) {
+        /*send the properties of the elements on this level, the content of each, and a lookup for each element
+          in that content that the client has a location for, then collect the replies.*/
+        size_t nextCount = 0, nextCapacity = 0;
+        struct replay_node** next = 0;
+        for(i=0; i<levelCount && !result; i++) {
+            struct replay_node* node = level[i];
+            struct replay_node* child;
+            for(j=0; j<node->propertyCount && !result; j++)
+                result = send_at(session, &node->properties[j], node->serverLocation);
+            for(child = node->firstChild; child && !result; child = child->next) {
+                result = send_at(session, &child->creation, node->serverLocation);
+                if(result || child->creation.opcode != HIPE_OP_APPEND_TAG || !child->locationCount
+                   || !child->creation.arg_length[1])
+                    continue; /*text, or an element that can't be (and needn't be) looked up.*/
+                if(nextCount == nextCapacity) {
+                    nextCapacity = nextCapacity ? nextCapacity * 2 : 16;
+                    struct replay_node** grown = (struct replay_node**) realloc(next, nextCapacity * sizeof(struct replay_node*));
+                    if(!grown) {
+                        result = -1;
+                        break;
+                    }
+                    next = grown;
+                }
+                next[nextCount++] = child;
+                hipe_instruction lookup;
+                hipe_instruction_init(&lookup);
+                lookup.opcode = HIPE_OP_GET_BY_ID;
+                lookup.arg[0] = child->creation.arg[1];
+                lookup.arg_length[0] = child->creation.arg_length[1];
+                result = hipe_send_instruction(session, lookup);
+            }
+        }
+        hipe_uncork(session);
+
+        size_t found = 0;
+        for(i=0; i<nextCount && !result; i++) {
+            hipe_instruction reply;
+            hipe_instruction_init(&reply);
+            if(hipe_replay_await(session, &reply, HIPE_OP_LOCATION_RETURN) != 1) {
+                result = -1;
+                break;
+            }
+            struct replay_node* node = next[i];
+            node->serverLocation = reply.location;
+            hipe_instruction_clear(&reply);
+            if(!node->serverLocation) continue; /*the server couldn't find it; it can't be restored any further.*/
+            for(j=0; j<node->locationCount; j++) {
+                map_set(&replay->toServer, node->locations[j], node->serverLocation);
+                map_set(&replay->toClient, node->serverLocation, node->locations[j]);
+            }
+            next[found++] = node;
+        }
+        free(level);
+        level = next;
+        levelCount = found;
+        hipe_cork(session);
+    }
+    free(level);
+
+    /*the replies to these were lost with the old connection.*/
+    if(!result) result = resend_requests(replay, session, &replay->locationRequests);
+    if(!result) result = resend_requests(replay, session, &replay->contentRequests);
+    if(hipe_uncork(session)) result = -1;
+    return result;
+}
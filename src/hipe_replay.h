@@ -0,0 +1,69 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Private interface between hipe.c and hipe_replay.c; not part of the library's API.
+ *
+ * A replay log is a compacted record of the instructions that built a session's frame, kept so that the
+ * frame can be rebuilt over a new connection (see hipe_set_reconnect). Rather than a list of instructions,
+ * it is a shadow copy of the document: each element appended by the client, its text, styles, attributes
+ * and event requests, so that deleted elements, replaced text and overwritten styles take up no space and
+ * are not replayed.
+ *
+ * Locations are assigned by the server, so they change when the frame is rebuilt. The client keeps the
+ * locations it was given before: the log maps them to the new server's locations on the way out, and maps
+ * the new server's locations back on the way in.
+ */
+
+#ifndef _HIPE_REPLAY_H
+#define _HIPE_REPLAY_H
+
+#include "hipe.h"
+
+struct hipe_replay;
+
+struct hipe_replay* replay_create(void);
+
+void replay_destroy(struct hipe_replay* replay);
+
+void replay_record(struct hipe_replay* replay, const hipe_instruction* instruction);
+/* Records an outgoing instruction, as given by the client (before its location is translated). */
+
+hipe_loc replay_to_server(struct hipe_replay* replay, hipe_loc location);
+/* Translates a client location to the current server's location for the same element.
+ * After a restore, returns 0 for an element that the new server doesn't have, so the instruction can be dropped. */
+
+void replay_incoming(struct hipe_replay* replay, hipe_instruction* instruction);
+/* Translates the location in an incoming instruction to the client's location for the same element.
+ * Location and content replies are matched with the requests they answer, and an element looked up
+ * by ID (or appended with a location request) is recorded as having the location returned. */
+
+int replay_restore(struct hipe_replay* replay, hipe_session session);
+/* Rebuilds the recorded document over a session's new connection, once its container has been granted,
+ * then sends again any location or content requests that were not answered before the connection was lost.
+ * Elements are rebuilt one level of nesting at a time: the instructions for a level and the lookups
+ * of its elements are sent as one batch, so rebuilding takes one round trip per level.
+ * Returns 0, or -1 if the connection failed. */
+
+short hipe_replay_await(hipe_session session, hipe_instruction* instruction_ret, short opcode);
+/* Implemented in hipe.c: awaits a reply to an instruction sent by replay_restore, without disturbing
+ * the replies that the client may be waiting for. */
+
+#endif
@@ -0,0 +1,265 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE /*for memfd_create()*/
+#include "hipe_shm.h"
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef HIPE_USE_SHM
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_WAIT_CHECK 50
+/*milliseconds that a send waiting for space in the ring waits at a time, before checking that the server is
+ *still connected.*/
+
+struct ring { /*one direction's ring, as mapped into this process.*/
+    int fd;
+    struct shm_header* header;
+    char* data; /*mapped twice in a row, so that the SHM_RING_SIZE bytes from any position are contiguous*/
+    size_t headerSize;
+};
+
+struct hipe_shm {
+    int socket;
+    struct ring out; /*to the server; written with the session's send_lock held*/
+    struct ring in; /*from the server; read by the thread reading from the server*/
+    size_t returned; /*bytes returned by the last shm_recv, to be released to the server by the next*/
+};
+
+
+static int ring_create(struct ring* ring) {
+    ring->headerSize = (size_t) sysconf(_SC_PAGESIZE);
+    ring->fd = memfd_create("hipe ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(ring->fd < 0) return -1;
+    /*sealed at its size, so that the server can map it without it being shrunk under it.*/
+    if(ftruncate(ring->fd, ring->headerSize + SHM_RING_SIZE)
+       || fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+        close(ring->fd);
+        return -1;
+    }
+    /*a new memfd is filled with zeros, so head, tail and both flags start at 0.*/
+    ring->header = (struct shm_header*) mmap(0, ring->headerSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    /*reserve room for the data twice over, then map it into both halves.*/
+    ring->data = (char*) mmap(0, 2 * SHM_RING_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->header == MAP_FAILED || ring->data == MAP_FAILED
+       || mmap(ring->data, SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+               ring->fd, ring->headerSize) == MAP_FAILED
+       || mmap(ring->data + SHM_RING_SIZE, SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+               ring->fd, ring->headerSize) == MAP_FAILED) {
+        if(ring->header != MAP_FAILED) munmap(ring->header, ring->headerSize);
+        if(ring->data != MAP_FAILED) munmap(ring->data, 2 * SHM_RING_SIZE);
+        close(ring->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void ring_destroy(struct ring* ring) {
+    munmap(ring->header, ring->headerSize);
+    munmap(ring->data, 2 * SHM_RING_SIZE);
+    close(ring->fd);
+}
+
+static int send_rest(int socket, const char* data, size_t length) {
+    while(length) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if(sent == -1 && errno == EINTR) continue;
+        if(sent <= 0) return -1;
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+static void wake_server(struct hipe_shm* shm) {
+/*sends a wakeup byte if the server is waiting for one. Called after tail has been moved on.*/
+    if(__atomic_exchange_n(&shm->out.header->consumerWaiting, 0, __ATOMIC_SEQ_CST)) {
+        char wakeup = 0;
+        /*if the socket is full, the server has wakeups to read already.*/
+        send(shm->socket, &wakeup, 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+}
+
+static int wait_for_space(struct hipe_shm* shm, uint64_t head) {
+/*waits until the server has moved head on from where it was. Returns 0, or -1 if the server has gone.*/
+    struct shm_header* header = shm->out.header;
+    while(1) {
+        __atomic_store_n(&header->producerWaiting, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) != head) return 0;
+        struct timespec timeout = { 0, SHM_WAIT_CHECK * 1000000L };
+        syscall(SYS_futex, &header->producerWaiting, FUTEX_WAIT, 1, &timeout, 0, 0);
+        struct pollfd connection = { shm->socket, 0, 0 };
+        if(poll(&connection, 1, 0) > 0 && (connection.revents & (POLLHUP | POLLERR))) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+}
+
+
+struct hipe_shm* shm_create(int socket) {
+    struct hipe_shm* shm = (struct hipe_shm*) calloc(1, sizeof(struct hipe_shm));
+    if(!shm) return 0;
+    shm->socket = socket;
+    if(ring_create(&shm->out)) {
+        free(shm);
+        return 0;
+    }
+    if(ring_create(&shm->in)) {
+        ring_destroy(&shm->out);
+        free(shm);
+        return 0;
+    }
+    return shm;
+}
+
+void shm_destroy(struct hipe_shm* shm) {
+    if(!shm) return;
+    ring_destroy(&shm->out);
+    ring_destroy(&shm->in);
+    free(shm);
+}
+
+int shm_offer(struct hipe_shm* shm, const char* data, size_t length) {
+    int fds[2] = { shm->out.fd, shm->in.fd };
+    union { /*aligned for the header*/
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec piece = { (void*) data, length };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &piece;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    struct cmsghdr* descriptors = CMSG_FIRSTHDR(&message);
+    descriptors->cmsg_level = SOL_SOCKET;
+    descriptors->cmsg_type = SCM_RIGHTS;
+    descriptors->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(descriptors), fds, sizeof(fds));
+
+    ssize_t sent;
+    do sent = sendmsg(shm->socket, &message, MSG_NOSIGNAL);
+    while(sent == -1 && errno == EINTR);
+    if(sent <= 0) return -1;
+    return send_rest(shm->socket, data + sent, length - sent); /*the descriptors went with the first part*/
+}
+
+ssize_t shm_recv(struct hipe_shm* shm, const char** data_ret, size_t wanted, short blocking) {
+    struct shm_header* header = shm->in.header;
+    uint64_t head = header->head; /*only written here*/
+    if(shm->returned) { /*the data returned last time has been decoded: make room for the server.*/
+        head += shm->returned;
+        shm->returned = 0;
+        __atomic_store_n(&header->head, head, __ATOMIC_SEQ_CST);
+        if(__atomic_exchange_n(&header->producerWaiting, 0, __ATOMIC_SEQ_CST))
+            syscall(SYS_futex, &header->producerWaiting, FUTEX_WAKE, 1, 0, 0, 0);
+    }
+    while(1) {
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        if(tail != head) {
+            size_t available = (size_t) (tail - head);
+            shm->returned = available < wanted ? available : wanted;
+            *data_ret = shm->in.data + (head & (SHM_RING_SIZE - 1));
+            return shm->returned;
+        }
+        /*nothing has been written. Ask the server for a wakeup byte once it is, then check again (in case it
+          was written in between), and read the socket: for a wakeup if blocking, and to see whether the server
+          has closed the connection (and clear out old wakeups, so that hipe_session_fd isn't left readable).*/
+        __atomic_store_n(&header->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) != head) continue;
+        char wakeups[64];
+        ssize_t received = recv(shm->socket, wakeups, sizeof(wakeups), blocking ? 0 : MSG_DONTWAIT);
+        if(received == 0) return 0; /*closed by the server*/
+        if(received < 0 && errno != EINTR) return -1;
+    }
+}
+
+int shm_send(struct hipe_shm* shm, const struct iovec* pieces, size_t count) {
+    struct shm_header* header = shm->out.header;
+    uint64_t tail = header->tail; /*only written here*/
+    size_t i;
+    for(i=0; i<count; i++) {
+        const char* data = (const char*) pieces[i].iov_base;
+        size_t length = pieces[i].iov_len;
+        while(length) {
+            uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+            size_t space = SHM_RING_SIZE - (size_t) (tail - head);
+            if(!space) { /*let the server have what has been written, and wait for it to make room.*/
+                __atomic_store_n(&header->tail, tail, __ATOMIC_SEQ_CST);
+                wake_server(shm);
+                if(wait_for_space(shm, head)) return -1;
+                continue;
+            }
+            size_t n = length < space ? length : space;
+            memcpy(shm->out.data + (tail & (SHM_RING_SIZE - 1)), data, n);
+            tail += n;
+            data += n;
+            length -= n;
+        }
+    }
+    __atomic_store_n(&header->tail, tail, __ATOMIC_SEQ_CST);
+    wake_server(shm);
+    return 0;
+}
+
+#else /*without shared memory: sessions always use the socket as usual.*/
+
+struct hipe_shm* shm_create(int socket) {
+    (void) socket;
+    return 0;
+}
+
+void shm_destroy(struct hipe_shm* shm) {
+    (void) shm;
+}
+
+int shm_offer(struct hipe_shm* shm, const char* data, size_t length) {
+    (void) shm; (void) data; (void) length;
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t shm_recv(struct hipe_shm* shm, const char** data_ret, size_t wanted, short blocking) {
+    (void) shm; (void) data_ret; (void) wanted; (void) blocking;
+    errno = ENOSYS;
+    return -1;
+}
+
+int shm_send(struct hipe_shm* shm, const struct iovec* pieces, size_t count) {
+    (void) shm; (void) pieces; (void) count;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
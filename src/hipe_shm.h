@@ -0,0 +1,86 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Private interface between hipe.c and hipe_shm.c; not part of the library's API.
+ *
+ * When the library is compiled with HIPE_USE_SHM defined (on Linux), a session offers the server a pair of
+ * shared memory rings, one for each direction, so that instructions (and large ones in particular, such as
+ * the text of a long HIPE_OP_SET_TEXT or a HIPE_OP_CONTENT_RETURN) are written once into memory that the other
+ * side decodes in place, rather than being copied into the kernel and out again in socket-sized pieces.
+ *
+ * The offer goes with the container request: its third argument is SHM_OFFER, and the sendmsg carrying it
+ * also passes two memfds (SCM_RIGHTS): the ring from the client to the server, then the ring back. A server
+ * that takes up the offer grants the container with SHM_OFFER as the grant's second argument, and from then
+ * on both sides send every instruction (in the usual encoding) through the rings. A server that doesn't
+ * know of the offer ignores the argument (and the descriptors, which the kernel closes once it has read past
+ * them), and the session carries on over the socket.
+ *
+ * Each memfd holds a page-sized struct shm_header, followed by SHM_RING_SIZE bytes of ring data. head and
+ * tail count bytes consumed and produced since the start, and the data for position n is at n % SHM_RING_SIZE.
+ * Once the rings are in use, the socket only carries single wakeup bytes (of any value): the producer sends
+ * one after adding data if the consumer has set its waiting flag (clearing it). A producer waiting for space
+ * sets its own waiting flag, and sleeps on it as a futex, which the consumer wakes (clearing it) once it has
+ * moved head. Either side closing the socket ends the session as usual.
+ */
+
+#ifndef _HIPE_SHM_H
+#define _HIPE_SHM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SHM_OFFER "shm1"
+#define SHM_RING_SIZE (1 << 20) /*bytes of data in each ring: a power of two, and a multiple of the page size.*/
+
+struct shm_header { /*at the start of each ring's memfd. Every field is accessed atomically.*/
+    uint64_t head; /*written by the consumer*/
+    char headPadding[56]; /*keeps head and tail in different cache lines*/
+    uint64_t tail; /*written by the producer*/
+    char tailPadding[56];
+    uint32_t consumerWaiting; /*set by the consumer before it waits for a wakeup byte; cleared by the producer*/
+    uint32_t producerWaiting; /*set by the producer before it waits (as a futex) for space; cleared by the consumer*/
+};
+
+struct hipe_shm;
+
+struct hipe_shm* shm_create(int socket);
+/*creates and maps a pair of rings to offer the server over a connected socket. Returns null if they can't
+ *be used.*/
+
+void shm_destroy(struct hipe_shm* shm);
+/*unmaps the rings and frees everything. The socket is left open (to be closed by the caller afterwards).*/
+
+int shm_offer(struct hipe_shm* shm, const char* data, size_t length);
+/*sends data (the encoded container request) over the socket, with the rings' descriptors attached.
+ *Returns 0, or -1 with errno set.*/
+
+ssize_t shm_recv(struct hipe_shm* shm, const char** data_ret, size_t wanted, short blocking);
+/*returns what the server has written next (up to wanted bytes), as recv() would, but pointing data_ret at it
+ *in the ring rather than copying it. The data stays valid until the next call. Returns 0 if the server closed
+ *the connection, or -1 with errno set (EAGAIN if !blocking and nothing has been written).
+ *Must only be called from one thread at a time.*/
+
+int shm_send(struct hipe_shm* shm, const struct iovec* pieces, size_t count);
+/*writes pieces of data to the server, in order, waiting for space as needed. Returns 0, or -1 with errno set.
+ *Must only be called from one thread at a time.*/
+
+#endif
@@ -0,0 +1,273 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include "hipe.h"
+#include "hipe_trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TRACE_DEFAULT_EVENTS 65536
+/*events kept per thread when hipe_trace_start() is given 0. Once a thread's ring is full, each new event
+ *overwrites the oldest, so a trace always holds the most recent activity.*/
+
+struct trace_event {
+    const char* name;
+    uint64_t begin; /*nanoseconds, from trace_now()*/
+    uint64_t duration;
+    uint64_t flow; /*id of the flow, for flow events*/
+    int64_t bytes; /*-1 if not given*/
+    short opcode; /*-1 if not given*/
+    char phase; /*as in the trace format: 'X' for a span, 's' and 'f' for the start and finish of a flow*/
+};
+
+struct trace_ring { /*the events recorded by one thread. Only that thread writes to it.*/
+    struct trace_ring* next; /*in the list of every ring made*/
+    unsigned id; /*shown as the thread's id in the trace*/
+    int owned; /*cleared when the thread exits, so that a thread started later can take the ring over*/
+    unsigned generation; /*the trace that the ring's events belong to*/
+    struct trace_event* events;
+    size_t capacity;
+    uint64_t head; /*number of events recorded in this trace; event i is kept in events[i % capacity]*/
+};
+
+int trace_active;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; /*held by hipe_trace_start() and hipe_trace_stop()*/
+static FILE* trace_file;
+static size_t trace_capacity;
+static uint64_t trace_origin; /*when the trace was started: timestamps are written relative to this*/
+static unsigned trace_generation; /*incremented for each trace, so that a ring from an earlier one is started again*/
+static uint64_t trace_flows; /*the last flow id given out*/
+static struct trace_ring* trace_rings; /*every ring made, newest first. Rings are never freed.*/
+static unsigned trace_threads; /*the last thread id given out*/
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key; /*to find out when a thread exits*/
+static __thread struct trace_ring* thread_ring;
+
+
+uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void release_ring(void* ring) {
+/*called as a thread that has recorded events exits. Its events are kept for the trace.*/
+    __atomic_store_n(&((struct trace_ring*) ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    pthread_key_create(&trace_key, release_ring);
+}
+
+static struct trace_ring* ring_of_thread(void) {
+/*returns the calling thread's ring, ready for this trace's events, or null if none could be allocated.*/
+    struct trace_ring* ring = thread_ring;
+    if(!ring) {
+        /*take over a ring left by a thread that has exited, or make a new one.*/
+        pthread_once(&trace_once, make_key);
+        for(ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+            int unowned = 0;
+            if(__atomic_compare_exchange_n(&ring->owned, &unowned, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+        }
+        if(!ring) {
+            ring = (struct trace_ring*) calloc(1, sizeof(struct trace_ring));
+            if(!ring) return 0;
+            ring->owned = 1;
+            ring->id = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+            ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+            while(!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        }
+        pthread_setspecific(trace_key, ring);
+        thread_ring = ring;
+    }
+
+    unsigned generation = __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE);
+    if(ring->generation != generation) {
+        /*the first event of a new trace: start the ring again, at the size asked for.*/
+        if(ring->capacity != trace_capacity) {
+            free(ring->events);
+            ring->events = (struct trace_event*) malloc(trace_capacity * sizeof(struct trace_event));
+            ring->capacity = ring->events ? trace_capacity : 0;
+        }
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->generation, generation, __ATOMIC_RELEASE);
+    }
+    return ring->capacity ? ring : 0;
+}
+
+static void record(const struct trace_event* event) {
+    struct trace_ring* ring = ring_of_thread();
+    if(!ring) return;
+    uint64_t head = ring->head;
+    ring->events[head % ring->capacity] = *event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE); /*publishes the event to hipe_trace_stop()*/
+}
+
+void trace_span(const char* name, uint64_t begin, short opcode, int64_t bytes) {
+    struct trace_event event;
+    event.name = name;
+    event.begin = begin;
+    event.duration = trace_now() - begin;
+    event.flow = 0;
+    event.bytes = bytes;
+    event.opcode = opcode;
+    event.phase = 'X';
+    record(&event);
+}
+
+static void flow_event(char phase, uint64_t flow) {
+    struct trace_event event;
+    event.name = "reply";
+    event.begin = trace_now();
+    event.duration = 0;
+    event.flow = flow;
+    event.bytes = -1;
+    event.opcode = -1;
+    event.phase = phase;
+    record(&event);
+}
+
+uint64_t trace_flow_start(void) {
+    uint64_t flow = __atomic_add_fetch(&trace_flows, 1, __ATOMIC_RELAXED);
+    flow_event('s', flow);
+    return flow;
+}
+
+void trace_flow_finish(uint64_t flow) {
+    flow_event('f', flow);
+}
+
+
+static void write_name(FILE* file, const char* name) {
+/*writes a name as a JSON string.*/
+    fputc('"', file);
+    for(; *name; name++) {
+        unsigned char c = (unsigned char) *name;
+        if(c == '"' || c == '\\') fprintf(file, "\\%c", c);
+        else if(c < 0x20) fprintf(file, "\\u%04x", c);
+        else fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+static void write_event(FILE* file, const struct trace_event* event, unsigned thread, pid_t pid) {
+    double ts = (event->begin >= trace_origin ? event->begin - trace_origin : 0) / 1000.0; /*microseconds*/
+    fprintf(file, ",\n{\"name\":");
+    write_name(file, event->name);
+    fprintf(file, ",\"cat\":\"hipe\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f", event->phase, (int) pid, thread, ts);
+    if(event->phase == 'X') {
+        fprintf(file, ",\"dur\":%.3f", event->duration / 1000.0);
+        if(event->opcode >= 0 || event->bytes >= 0) {
+            fprintf(file, ",\"args\":{");
+            if(event->opcode >= 0) fprintf(file, "\"opcode\":%d%s", event->opcode, event->bytes >= 0 ? "," : "");
+            if(event->bytes >= 0) fprintf(file, "\"bytes\":%lld", (long long) event->bytes);
+            fprintf(file, "}");
+        }
+    } else {
+        /*a flow is drawn from the span that encloses its start to the span that encloses its finish.*/
+        fprintf(file, ",\"id\":%llu%s", (unsigned long long) event->flow, event->phase == 'f' ? ",\"bp\":\"e\"" : "");
+    }
+    fprintf(file, "}");
+}
+
+static void write_ring(FILE* file, struct trace_ring* ring, unsigned generation, pid_t pid) {
+/*writes the events of this trace kept in a ring. The thread that owns the ring may still be recording,
+ *so its events are copied out first, and any that may have been overwritten while copying are dropped.*/
+    if(__atomic_load_n(&ring->generation, __ATOMIC_ACQUIRE) != generation || !ring->capacity) return;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > ring->capacity ? head - ring->capacity : 0;
+    struct trace_event* copy = (struct trace_event*) malloc((head - first) * sizeof(struct trace_event) + 1);
+    if(!copy) return;
+    uint64_t i;
+    for(i=first; i<head; i++)
+        copy[i - first] = ring->events[i % ring->capacity];
+    uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t valid = after >= ring->capacity ? after - ring->capacity + 1 : 0; /*the slot of event 'after' may be half written*/
+
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+            (int) pid, ring->id, ring->id);
+    for(i=(valid > first ? valid : first); i<head; i++)
+        write_event(file, &copy[i - first], ring->id, pid);
+    free(copy);
+}
+
+int hipe_trace_start(const char* path, size_t events_per_thread)
+{
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file) { /*already recording*/
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    trace_file = fopen(path, "w");
+    if(!trace_file) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    trace_capacity = events_per_thread ? events_per_thread : TRACE_DEFAULT_EVENTS;
+    trace_origin = trace_now();
+    __atomic_add_fetch(&trace_generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+int hipe_trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if(!trace_file) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    __atomic_store_n(&trace_active, 0, __ATOMIC_RELEASE);
+
+    pid_t pid = getpid();
+    unsigned generation = __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE);
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"hipe client\"}}", (int) pid);
+    struct trace_ring* ring;
+    for(ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+        write_ring(trace_file, ring, generation, pid);
+    fprintf(trace_file, "\n]}\n");
+
+    int result = ferror(trace_file) ? -1 : 0;
+    if(fclose(trace_file)) result = -1;
+    trace_file = 0;
+    pthread_mutex_unlock(&trace_lock);
+    return result;
+}
+
+uint64_t hipe_trace_begin(void)
+{
+    if(!TRACING()) return 0;
+    uint64_t now = trace_now();
+    return now ? now : 1;
+}
+
+void hipe_trace_end(const char* name, uint64_t begin)
+{
+    if(begin && TRACING()) trace_span(name, begin, -1, -1);
+}
@@ -0,0 +1,55 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Private interface between the library and hipe_trace.c; not part of the library's API.
+ * See hipe_trace_start() in hipe.h for the public side.
+ *
+ * Each thread records its events into a ring buffer of its own, so recording takes no lock. A span
+ * is recorded once it ends, as a single event holding its start and duration. Request and reply are
+ * linked by a flow: the flow is started (within the span that sends the request) with a new id, and
+ * finished with the same id within the span that decodes the reply.
+ */
+
+#ifndef _HIPE_TRACE_H
+#define _HIPE_TRACE_H
+
+#include <stdint.h>
+
+extern int trace_active;
+#define TRACING() __atomic_load_n(&trace_active, __ATOMIC_RELAXED)
+/*nonzero while a trace is being recorded. Checked before anything else is done for the tracer, so that
+ *tracing costs one load when it is off.*/
+
+uint64_t trace_now(void);
+/*the current time in nanoseconds, on the clock that the trace is recorded with.*/
+
+void trace_span(const char* name, uint64_t begin, short opcode, int64_t value);
+/*records a span from begin (from trace_now()) until now. name must stay valid until the trace is written
+ *(e.g. a string literal). opcode is the instruction the span concerns, or -1; value is a count shown with
+ *the span (e.g. of bytes), or -1.*/
+
+uint64_t trace_flow_start(void);
+/*starts a flow at the current time, and returns its id (never 0).*/
+
+void trace_flow_finish(uint64_t flow);
+/*finishes a flow at the current time.*/
+
+#endif
@@ -0,0 +1,436 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include "hipe_uring.h"
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef HIPE_USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define URING_SEND_ENTRIES 8
+#define URING_SEND_PIECES 1024 /*IOV_MAX*/
+/*submission queue size of the ring used for sending, and the most pieces of data sent by each entry. Each
+ *entry is a sendmsg of many pieces rather than a send of one, since the kernel takes each write into the socket
+ *as (at least) one buffer, and a frame's worth of small instructions written one by one would fill the
+ *socket's send buffer long before the bytes themselves would. A longer run is submitted in groups.*/
+
+#define URING_RECV_ENTRIES 8
+/*submission queue size of the ring used for receiving, which only ever has the receive (or its cancellation)
+ *to submit. Its completion queue is twice the size, which holds a completion for every buffer, and the ones
+ *ending the receive when they run out (and cancelling it). It must never overflow: the kernel keeps the
+ *completions that don't fit until it is next entered, which uring_recv avoids while the receive is in place.*/
+
+#define URING_BUFFERS 8 /*must be a power of two.*/
+#define URING_BUFFER_SIZE 4096
+/*buffers provided to the kernel to receive into. Once they are all full, the kernel stops receiving (and the
+ *server is held back) until they have been decoded.*/
+
+#define URING_BUFFER_GROUP 0
+#define URING_RECV 1 /*user_data of the multishot receive, and of its cancellation:*/
+#define URING_CANCEL 2
+
+struct ring { /*one io_uring instance, and its queues shared with the kernel.*/
+    int fd;
+    unsigned entries;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap; /*the same as sqMap if the kernel maps both queues together*/
+    size_t cqMapSize;
+    size_t sqesSize;
+    unsigned queued; /*entries added to the submission queue and not yet submitted*/
+};
+
+struct hipe_uring {
+    int socket;
+    struct ring in; /*for the receive; used by the thread reading from the server*/
+    struct ring out; /*for sends; used with the session's send_lock held*/
+    struct io_uring_buf_ring* buffers; /*the ring of buffers provided to the kernel, shared with it*/
+    unsigned short bufferTail;
+    char* bufferMemory;
+    short armed; /*whether the multishot receive is in place*/
+    int spent; /*buffer returned by the last uring_recv, to be given back to the kernel by the next, or -1*/
+    struct msghdr messages[URING_SEND_ENTRIES]; /*of the sends submitted, which the kernel reads until they complete*/
+};
+
+
+static int ring_setup(struct ring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) return -1;
+    ring->entries = params.sq_entries;
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cqMapSize > ring->sqMapSize) ring->sqMapSize = ring->cqMapSize;
+        ring->cqMapSize = ring->sqMapSize;
+    }
+    ring->sqMap = mmap(0, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sqMap == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cqMap = ring->sqMap;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cqMap = mmap(0, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cqMap == MAP_FAILED) {
+            munmap(ring->sqMap, ring->sqMapSize);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        if(ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapSize);
+        munmap(ring->sqMap, ring->sqMapSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = (char*) ring->sqMap;
+    char* cq = (char*) ring->cqMap;
+    ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    ring->queued = 0;
+    return 0;
+}
+
+static void ring_destroy(struct ring* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if(ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapSize);
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+}
+
+static struct io_uring_sqe* ring_sqe(struct ring* ring) {
+/*adds an entry to the submission queue, cleared, to be submitted by ring_enter. The caller must not add more
+ *than the ring has entries before entering.*/
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE); /*the kernel reads it once entered*/
+    ring->queued++;
+    return sqe;
+}
+
+static struct io_uring_cqe* ring_peek(struct ring* ring) {
+/*returns the oldest completion, or null if there are none, without a system call.*/
+    unsigned head = *ring->cqHead;
+    if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return 0;
+    return &ring->cqes[head & ring->cqMask];
+}
+
+static void ring_advance(struct ring* ring) {
+/*frees the completion returned by ring_peek for the kernel to reuse.*/
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned ring_ready(struct ring* ring) {
+    return __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead;
+}
+
+static int ring_enter(struct ring* ring, unsigned wait) {
+/*submits the entries queued, and waits until at least wait completions are ready. Returns 0, or -1.*/
+    while(ring->queued || ring_ready(ring) < wait) {
+        unsigned needed = wait > ring_ready(ring) ? wait - ring_ready(ring) : 0;
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, needed, needed ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+        if(submitted < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        ring->queued -= submitted;
+    }
+    return 0;
+}
+
+
+static void provide_buffer(struct hipe_uring* uring, int buffer) {
+/*gives a buffer (back) to the kernel to receive into.*/
+    struct io_uring_buf* entry = &uring->buffers->bufs[uring->bufferTail & (URING_BUFFERS - 1)];
+    entry->addr = (uint64_t) (uintptr_t) (uring->bufferMemory + (size_t) buffer * URING_BUFFER_SIZE);
+    entry->len = URING_BUFFER_SIZE;
+    entry->bid = buffer;
+    uring->bufferTail++;
+    __atomic_store_n(&uring->buffers->tail, uring->bufferTail, __ATOMIC_RELEASE);
+}
+
+static void arm(struct hipe_uring* uring) {
+/*queues a multishot receive, which completes once for each buffer the kernel fills, until it runs out.*/
+    struct io_uring_sqe* sqe = ring_sqe(&uring->in);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uring->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECV;
+    uring->armed = 1;
+}
+
+struct hipe_uring* uring_create(int socket) {
+    struct hipe_uring* uring = (struct hipe_uring*) calloc(1, sizeof(struct hipe_uring));
+    if(!uring) return 0;
+    uring->socket = socket;
+    uring->spent = -1;
+    if(ring_setup(&uring->in, URING_RECV_ENTRIES)) {
+        free(uring);
+        return 0;
+    }
+    if(ring_setup(&uring->out, URING_SEND_ENTRIES)) {
+        ring_destroy(&uring->in);
+        free(uring);
+        return 0;
+    }
+
+    /*the buffer ring must be page aligned.*/
+    uring->buffers = (struct io_uring_buf_ring*) mmap(0, URING_BUFFERS * sizeof(struct io_uring_buf),
+                                                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring->bufferMemory = (char*) malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t) (uintptr_t) uring->buffers;
+    registration.ring_entries = URING_BUFFERS;
+    registration.bgid = URING_BUFFER_GROUP;
+    if(uring->buffers == MAP_FAILED || !uring->bufferMemory
+       || syscall(__NR_io_uring_register, uring->in.fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        /*provided buffer rings need Linux 5.19.*/
+        if(uring->buffers != MAP_FAILED) munmap(uring->buffers, URING_BUFFERS * sizeof(struct io_uring_buf));
+        free(uring->bufferMemory);
+        ring_destroy(&uring->out);
+        ring_destroy(&uring->in);
+        free(uring);
+        return 0;
+    }
+    int i;
+    for(i=0; i<URING_BUFFERS; i++)
+        provide_buffer(uring, i);
+
+    /*a kernel without multishot receives (before Linux 6.0) fails the request straight away.*/
+    arm(uring);
+    struct io_uring_cqe* cqe;
+    if(ring_enter(&uring->in, 0) || ((cqe = ring_peek(&uring->in)) && cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        uring->armed = 0;
+        uring_destroy(uring);
+        return 0;
+    }
+    return uring;
+}
+
+void uring_destroy(struct hipe_uring* uring) {
+    if(!uring) return;
+    if(uring->armed) {
+        /*the kernel may still be receiving into the buffers: cancel the receive, and wait until it has ended.*/
+        struct io_uring_sqe* sqe = ring_sqe(&uring->in);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_RECV;
+        sqe->user_data = URING_CANCEL;
+        while(uring->armed && ring_enter(&uring->in, 1) == 0) {
+            struct io_uring_cqe* cqe;
+            while((cqe = ring_peek(&uring->in))) {
+                if(cqe->user_data == URING_RECV && !(cqe->flags & IORING_CQE_F_MORE)) uring->armed = 0;
+                ring_advance(&uring->in);
+            }
+        }
+    }
+    ring_destroy(&uring->in); /*also unregisters the buffer ring*/
+    ring_destroy(&uring->out);
+    munmap(uring->buffers, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(uring->bufferMemory);
+    free(uring);
+}
+
+int uring_fd(struct hipe_uring* uring) {
+    return uring->in.fd; /*an io_uring descriptor polls as readable while completions are waiting*/
+}
+
+ssize_t uring_recv(struct hipe_uring* uring, const char** data_ret, short blocking) {
+    if(uring->spent >= 0) { /*the data returned last time has been decoded.*/
+        provide_buffer(uring, uring->spent);
+        uring->spent = -1;
+    }
+    while(1) {
+        struct io_uring_cqe* cqe = ring_peek(&uring->in);
+        if(cqe) {
+            int result = cqe->res;
+            unsigned flags = cqe->flags;
+            uint64_t tag = cqe->user_data;
+            ring_advance(&uring->in);
+            if(tag != URING_RECV) continue;
+            if(!(flags & IORING_CQE_F_MORE)) uring->armed = 0;
+            if(result > 0 && (flags & IORING_CQE_F_BUFFER)) {
+                uring->spent = flags >> IORING_CQE_BUFFER_SHIFT;
+                *data_ret = uring->bufferMemory + (size_t) uring->spent * URING_BUFFER_SIZE;
+                return result;
+            }
+            if(result == 0) return 0; /*closed by the server*/
+            if(result == -ENOBUFS) continue; /*every buffer was full. Now that they have been decoded, receive again.*/
+            errno = -result;
+            return -1;
+        }
+        /*nothing has been received yet. Make sure the receive is in place, so that uring_fd is readable when
+          something is, then wait for it if blocking.*/
+        if(!uring->armed) arm(uring);
+        if(!blocking && !uring->in.queued) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if(ring_enter(&uring->in, blocking ? 1 : 0)) return -1;
+        if(!blocking && !ring_peek(&uring->in)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
+static int send_rest(int socket, const struct iovec* pieces, size_t count, size_t offset) {
+/*sends pieces with plain send calls, starting offset bytes into the first.*/
+    size_t i;
+    for(i=0; i<count; i++, offset=0) {
+        const char* data = (const char*) pieces[i].iov_base + offset;
+        size_t length = pieces[i].iov_len - offset;
+        while(length) {
+            ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+            if(sent == -1 && errno == EINTR) continue;
+            if(sent <= 0) return -1;
+            data += sent;
+            length -= sent;
+        }
+    }
+    return 0;
+}
+
+int uring_send(struct hipe_uring* uring, const struct iovec* pieces, size_t count) {
+    size_t first = 0;
+    while(first < count) {
+        /*link a group of sends, so that the kernel sends them in order, and submit them together.*/
+        size_t start[URING_SEND_ENTRIES + 1]; /*the first piece sent by each entry, and the end of the group*/
+        size_t n = 0;
+        start[0] = first;
+        while(n < uring->out.entries && start[n] < count) {
+            size_t length = count - start[n] < URING_SEND_PIECES ? count - start[n] : URING_SEND_PIECES;
+            struct msghdr* message = &uring->messages[n];
+            memset(message, 0, sizeof(*message));
+            message->msg_iov = (struct iovec*) (pieces + start[n]);
+            message->msg_iovlen = length;
+            struct io_uring_sqe* sqe = ring_sqe(&uring->out);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = uring->socket;
+            sqe->addr = (uint64_t) (uintptr_t) message;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = n;
+            sqe->flags = IOSQE_IO_LINK;
+            start[n + 1] = start[n] + length;
+            n++;
+        }
+        uring->out.sqes[(*uring->out.sqTail - 1) & uring->out.sqMask].flags = 0; /*the group's last entry*/
+        if(ring_enter(&uring->out, n)) return -1;
+
+        /*a send that fails, or is cut short, breaks the chain: the sends after it are cancelled.*/
+        size_t broken = n; /*the first entry of the group not sent in full*/
+        size_t partial = 0; /*how much of it was sent*/
+        int error = 0;
+        size_t i;
+        for(i=0; i<n; i++) {
+            struct io_uring_cqe* cqe = ring_peek(&uring->out);
+            size_t entry = cqe->user_data;
+            int result = cqe->res;
+            ring_advance(&uring->out);
+            size_t expected = 0, p;
+            for(p=start[entry]; p<start[entry + 1]; p++)
+                expected += pieces[p].iov_len;
+            if(result >= 0 && (size_t) result == expected) continue;
+            if(entry < broken) {
+                broken = entry;
+                partial = result > 0 ? result : 0;
+                error = result < 0 ? -result : 0;
+            }
+        }
+        if(broken < n) {
+            if(error && error != EINTR && error != EAGAIN && error != ECANCELED) {
+                errno = error;
+                return -1;
+            }
+            size_t piece = start[broken];
+            while(piece < start[n] && partial >= pieces[piece].iov_len) /*skip the pieces sent in full*/
+                partial -= pieces[piece++].iov_len;
+            if(send_rest(uring->socket, pieces + piece, start[n] - piece, partial)) return -1;
+        }
+        first = start[n];
+    }
+    return 0;
+}
+
+#else /*without io_uring: sessions always use the socket as usual.*/
+
+struct hipe_uring* uring_create(int socket) {
+    (void) socket;
+    return 0;
+}
+
+void uring_destroy(struct hipe_uring* uring) {
+    (void) uring;
+}
+
+int uring_fd(struct hipe_uring* uring) {
+    (void) uring;
+    return -1;
+}
+
+ssize_t uring_recv(struct hipe_uring* uring, const char** data_ret, short blocking) {
+    (void) uring; (void) data_ret; (void) blocking;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_send(struct hipe_uring* uring, const struct iovec* pieces, size_t count) {
+    (void) uring; (void) pieces; (void) count;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
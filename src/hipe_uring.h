@@ -0,0 +1,61 @@
+/*  Copyright (c) 2016-2018 Daniel Kos, General Development Systems
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of this Software library.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Private interface between hipe.c and hipe_uring.c; not part of the library's API.
+ *
+ * When the library is compiled with HIPE_USE_IO_URING defined (on Linux 6.0 or later), a session's connection
+ * is read and written through io_uring rather than with a send or recv call each time. A multishot receive is
+ * kept armed, so the kernel reads whatever the server sends into buffers provided to it, and the completions
+ * are collected from shared memory without a system call until there are none. A run of sends is submitted
+ * as linked entries, so the kernel sends them in order, and the whole run takes one system call.
+ *
+ * If io_uring, or any of the features needed, is not available (or HIPE_USE_IO_URING is not defined),
+ * uring_create returns null, and the session uses the socket as usual.
+ */
+
+#ifndef _HIPE_URING_H
+#define _HIPE_URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct hipe_uring;
+
+struct hipe_uring* uring_create(int socket);
+/*sets up io_uring for a connected socket. Returns null if it can't be used.*/
+
+void uring_destroy(struct hipe_uring* uring);
+/*ends the receive and frees everything. The socket is left open (to be closed by the caller afterwards).*/
+
+int uring_fd(struct hipe_uring* uring);
+/*a file descriptor that polls as readable while received data is waiting to be returned by uring_recv.*/
+
+ssize_t uring_recv(struct hipe_uring* uring, const char** data_ret, short blocking);
+/*returns what has been received next (up to one buffer's worth), as recv() would, but pointing data_ret at it
+ *rather than copying it. The data stays valid until the next call. Returns 0 if the server closed the
+ *connection, or -1 with errno set (EAGAIN if !blocking and nothing has been received).
+ *Must only be called from one thread at a time.*/
+
+int uring_send(struct hipe_uring* uring, const struct iovec* pieces, size_t count);
+/*sends pieces of data, in order, returning once they have all been sent. Returns 0, or -1 with errno set.
+ *Must only be called from one thread at a time.*/
+
+#endif
@@ -15,17 +15,33 @@ Team 23
 #define NEW_LIST_DELETE_EVENT 2
 #define NEW_LIST_EDIT_EVENT 3
 
+// Requestor values for the buttons of each entry are made from the entry's index and the event type,
+// so the handler can get the entry's index back from the requestor of the click event
+#define ENTRY_REQUESTOR(index, event) ((((uint64_t) (index) + 1) << 8) | (event))
+#define ENTRY_INDEX(requestor) ((size_t) ((requestor) >> 8) - 1)
+
 // Defining global variables to be used in program
 int counter = 1; // Used to append to div ID, giving each 'note' div a unique ID 
 hipe_session session; // The primary hipe session that the program runs on
+hipe_dispatcher dispatcher; // Routes incoming events to their event-handlers
+
+// The entries in the list, one array per field, indexed by the order the entries were added in.
+// The app keeps its own copy of each entry's text and locations, so it never has to ask the server for them.
+char** entryTexts;          // text of each entry, or NULL once it has been deleted
+hipe_loc* entryDivLocs;     // location of the div holding each entry
+hipe_loc* entryTextLocs;    // location of the p tag holding each entry's text
+size_t numEntries;
+size_t entriesCapacity;
+
+// Size of the buffers that element IDs are formatted into: room for the longest prefix plus any int
+#define ELEMENT_ID_SIZE 32
 
-// Utility function to concatenate two strings and return the result
-char* concat(const char *s1, const char *s2)
+// Utility function to make the ID of an element from a prefix and a number (e.g. "entryDivID12"),
+// formatted into a buffer given by the caller - normally on the stack, so no memory is allocated for it
+char* elementId(char* buffer, const char* prefix, int number)
 {
-    char *result = malloc(strlen(s1) + strlen(s2) + 1); // +1 for the null-terminator
-    strcpy(result, s1);
-    strcat(result, s2);
-    return result;
+    snprintf(buffer, ELEMENT_ID_SIZE, "%s%d", prefix, number);
+    return buffer;
 }
 
 // Function to get the hipe_location of an element by its ID
@@ -38,6 +54,10 @@ hipe_loc getLoc(char* id) {
     return instruction.location;
 }
 
+// Event-handlers for the buttons of each entry, defined below
+void deleteListEntry(hipe_session session, hipe_instruction* event, void* userdata);
+void editListEntry(hipe_session session, hipe_instruction* event, void* userdata);
+
 // Create a new entry in the list by calling HIPE_OP_DIALOG_INPUT
 void newListEntryDialog() {
     hipe_send(session, HIPE_OP_DIALOG_INPUT, 0,0, 4, "New note", "Start writing below: ", "Write here");
@@ -56,10 +76,9 @@ void newListEntryInput(hipe_session session) {
         if(listenForInput.arg[0] != '\0') {
             // If the content of the user entry is not empty, then we add it to the list
             // In case the content is empty, then the user has entered nothing into the text box, so we ignore
-            // Creating a unique 'entryNumber' string for each list entry. This uses the global counter value that we have. 
-            char entryNumber[50];
-            sprintf(entryNumber, "%d", counter);
-            char* uniqueEntryDivID = concat("entryDivID", entryNumber); // Now, the unique entry ID is something like entryDivID12, for example, if counter = 12.
+            // Creating a unique ID for each list entry's div. This uses the global counter value that we have. 
+            char uniqueEntryDivID[ELEMENT_ID_SIZE];
+            elementId(uniqueEntryDivID, "entryDivID", counter); // Now, the unique entry ID is something like entryDivID12, for example, if counter = 12.
 
             // We use hipe_send to append a new tag to the body, which is just a div, giving it the ID we entered.
             hipe_send(session, HIPE_OP_APPEND_TAG, 0, 0, 2, "div", uniqueEntryDivID);
@@ -69,7 +88,8 @@ void newListEntryInput(hipe_session session) {
             hipe_send(session, HIPE_OP_APPEND_TEXT, 0, entryDivLoc, 1, 	"➼ ");
             
             // Create a paragraph tag, giving it a unique ID, and appending it to the div
-            char* uniqueTextID = concat("textID", entryNumber);
+            char uniqueTextID[ELEMENT_ID_SIZE];
+            elementId(uniqueTextID, "textID", counter);
             hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 2, "p", uniqueTextID);
             hipe_loc p_loc = getLoc(uniqueTextID);  // Get its location 
 
@@ -85,7 +105,8 @@ void newListEntryInput(hipe_session session) {
             hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-bottom", "1em");
 
             // Create a unique ID for each delete button
-            char* uniqueDeleteButtonID = concat("deleteButtonID", entryNumber);
+            char uniqueDeleteButtonID[ELEMENT_ID_SIZE];
+            elementId(uniqueDeleteButtonID, "deleteButtonID", counter);
             // Adding the delete button to the DIV
             hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 3, "button", uniqueDeleteButtonID, uniqueEntryDivID);
             hipe_loc deleteButton = getLoc(uniqueDeleteButtonID);
@@ -95,7 +116,8 @@ void newListEntryInput(hipe_session session) {
             hipe_send(session, HIPE_OP_SET_STYLE, 0, deleteButton, 2, "float", "right");
 
             // Create a unique ID for each edit button
-            char* uniqueEditButtonID = concat("editButtonID", entryNumber);
+            char uniqueEditButtonID[ELEMENT_ID_SIZE];
+            elementId(uniqueEditButtonID, "editButtonID", counter);
             // Adding the edit button to the DIV
             hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 3, "button", uniqueEditButtonID, uniqueEntryDivID);
             hipe_loc editButton = getLoc(uniqueEditButtonID);
@@ -107,56 +129,72 @@ void newListEntryInput(hipe_session session) {
             // Add a horizontal line - acts as a separator between the entries
             hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 1, "hr");
 
-            //requests events for these buttons (delete, edit)
-            hipe_send(session, HIPE_OP_EVENT_REQUEST, NEW_LIST_DELETE_EVENT, deleteButton, 2, "click", uniqueEntryDivID);
-            hipe_send(session, HIPE_OP_EVENT_REQUEST, NEW_LIST_EDIT_EVENT, editButton, 2, "click", uniqueEntryDivID);
+            // Add the entry to the app's copy of the list
+            if(numEntries == entriesCapacity)
+            {
+                entriesCapacity = entriesCapacity ? entriesCapacity * 2 : 16;
+                entryTexts = realloc(entryTexts, entriesCapacity * sizeof(char*));
+                entryDivLocs = realloc(entryDivLocs, entriesCapacity * sizeof(hipe_loc));
+                entryTextLocs = realloc(entryTextLocs, entriesCapacity * sizeof(hipe_loc));
+            }
+            size_t index = numEntries++;
+            entryTexts[index] = strndup(listenForInput.arg[0], listenForInput.arg_length[0]);
+            entryDivLocs[index] = entryDivLoc;
+            entryTextLocs[index] = p_loc;
+
+            //requests events for these buttons (delete, edit), and register the handlers for this entry
+            hipe_send(session, HIPE_OP_EVENT_REQUEST, ENTRY_REQUESTOR(index, NEW_LIST_DELETE_EVENT), deleteButton, 2, "click", uniqueEntryDivID);
+            hipe_send(session, HIPE_OP_EVENT_REQUEST, ENTRY_REQUESTOR(index, NEW_LIST_EDIT_EVENT), editButton, 2, "click", uniqueEntryDivID);
+            hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_DELETE_EVENT), deleteListEntry, NULL);
+            hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_EDIT_EVENT), editListEntry, NULL);
             counter++; // increment the global counter since we have added an entry
         }
     }
 }
 
-// Function to delete a list entry - called when delete button is pressed
-void deleteListEntry(hipe_session session) {
-    hipe_instruction listenForDeleteEvent;
-    hipe_instruction_init(&listenForDeleteEvent);
-    
-    if(hipe_await_instruction(session, &listenForDeleteEvent, HIPE_OP_EVENT) == 1) {
-        // Delete based on location, we know div location is 2 less than the button location
-        hipe_loc deleteLocDiv = listenForDeleteEvent.location - 2;
-        hipe_send(session, HIPE_OP_DELETE, 0, deleteLocDiv, 2, "button", "deleteNoteDiv");
-    }
+// Event-handler for the new entry button: opens the dialog, then handles the input
+void newListEntry(hipe_session session, hipe_instruction* event, void* userdata) {
+    newListEntryDialog();
+    newListEntryInput(session);
+}
+
+// Function to delete a list entry - called by the dispatcher when a delete button is pressed
+void deleteListEntry(hipe_session session, hipe_instruction* event, void* userdata) {
+    // The entry is found from the requestor of the button, so only the deletion is sent to the server
+    size_t index = ENTRY_INDEX(event->requestor);
+    if(index >= numEntries || entryTexts[index] == NULL) return; // already deleted
+    hipe_send(session, HIPE_OP_DELETE, 0, entryDivLocs[index], 2, "button", "deleteNoteDiv");
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_DELETE_EVENT), NULL, NULL);
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_EDIT_EVENT), NULL, NULL);
+    free(entryTexts[index]);
+    entryTexts[index] = NULL;
 }
 
 // This function is called when edit button is pressed - opens a dialog box, sending it the current text which is in the entry
-void editListEntryDialog(hipe_session session, char* text) {
+void editListEntryDialog(hipe_session session, const char* text) {
     hipe_send(session, HIPE_OP_DIALOG_INPUT, 0,0, 4, "Edit note", "Start writing below: ", text);
 }
 
 // Function to deal with the input from the edit button dialog box
-void editListEntry(hipe_session session) {
-    hipe_instruction listenForEditEvent;
-    hipe_instruction_init(&listenForEditEvent);
-    // Wait for button press, and store it in the hipe_instruction we created above
-    if(hipe_await_instruction(session, &listenForEditEvent, HIPE_OP_EVENT) == 1) {
-        // Find the location of the div
-        hipe_loc editLocDiv = listenForEditEvent.location - 2;
-        // Get content of the div (the text that is currently in the list entry)
-        hipe_send(session, HIPE_OP_GET_CONTENT, 0, editLocDiv, 0);
-        // Await the reply from the server with the required content from the entry
-        if(hipe_await_instruction(session, &listenForEditEvent, HIPE_OP_CONTENT_RETURN) == 1) {
-            // Call the auxiliary function to open a dialog box, passing to it the current list entry contents
-            editListEntryDialog(session, listenForEditEvent.arg[0]);
-        }
-        hipe_instruction listenForInput;
-        hipe_instruction_init(&listenForInput);
-        // Await reply from dialog box
-        if(hipe_await_instruction(session, &listenForInput, HIPE_OP_DIALOG_RETURN) == 1) {
-            if(listenForInput.arg[0] != '\0') {
-                // If there is some text, we update the list entry
-                hipe_send(session, HIPE_OP_SET_TEXT, 0, editLocDiv, 1, listenForInput.arg[0]);
-            }
+// Called by the dispatcher with the click event from the edit button
+void editListEntry(hipe_session session, hipe_instruction* event, void* userdata) {
+    size_t index = ENTRY_INDEX(event->requestor);
+    if(index >= numEntries || entryTexts[index] == NULL) return; // deleted
+    // Call the auxiliary function to open a dialog box, passing to it the current list entry contents,
+    // which the app already has, so there is no need to ask the server for them
+    editListEntryDialog(session, entryTexts[index]);
+    hipe_instruction listenForInput;
+    hipe_instruction_init(&listenForInput);
+    // Await reply from dialog box
+    if(hipe_await_instruction(session, &listenForInput, HIPE_OP_DIALOG_RETURN) == 1) {
+        if(listenForInput.arg[0] != '\0' && entryTexts[index] != NULL) {
+            // If there is some text, we update the list entry
+            hipe_send(session, HIPE_OP_SET_TEXT, 0, entryTextLocs[index], 1, listenForInput.arg[0]);
+            free(entryTexts[index]);
+            entryTexts[index] = strndup(listenForInput.arg[0], listenForInput.arg_length[0]);
         }
     }
+    hipe_instruction_clear(&listenForInput);
 }
 
 int main(int argc, char** argv)
@@ -199,38 +237,23 @@ int main(int argc, char** argv)
     //requests event for the button
     hipe_send(session, HIPE_OP_EVENT_REQUEST, NEW_LIST_ENTRY_EVENT, newListEntryDialogButton, 1, "click");
     
+    // Register an event-handler for each of the event requestor values that we defined
+    // (the buttons of each entry get their handlers when the entry is added)
+    dispatcher = hipe_dispatcher_create();
+    hipe_dispatch_requestor(dispatcher, NEW_LIST_ENTRY_EVENT, newListEntry, 0);
+
     hipe_instruction event;
     hipe_instruction_init(&event);
     
     /* Main loop of the app. We wait for any events that are triggered by user actions, 
-    and call the event-handler functions accordingly */
+    and pass each one to the event-handler registered for it */
     do {
         // Get the next instruction
-        hipe_next_instruction(session, &event, 1);
-        
-        switch(event.requestor) {
-            // Based on the event requestor values that we defined, call the appropriate event-handler
-            case NEW_LIST_ENTRY_EVENT:   
-                {
-                    newListEntryDialog(); 
-                    newListEntryInput(session);
-                    break;
-                }
-
-            case NEW_LIST_DELETE_EVENT:
-                {
-                    deleteListEntry(session);
-                    break;
-                }
-            case NEW_LIST_EDIT_EVENT:
-                {
-                    editListEntry(session);
-                    break;
-                }
-
-        }
+        if(hipe_next_instruction(session, &event, 1) < 0) break;
+        hipe_dispatch(dispatcher, session, &event);
     } while(event.opcode != HIPE_OP_FRAME_CLOSE); //repeat until window closed.
     
+    hipe_dispatcher_destroy(dispatcher);
     return 0;
 }
 
@@ -0,0 +1,365 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Pipeline for importing lists from text files. See todoist_import.h.
+*/
+
+#define _GNU_SOURCE // for memrchr()
+#include "todoist_import.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define IMPORT_CHUNK_SIZE (256 * 1024) // bytes read from a file at a time
+#define IMPORT_WINDOW 16 // chunks that can be in the pipeline at once
+#define IMPORT_MAX_WORKERS 8
+
+// A chunk of a file waiting to be parsed. It holds whole lines only.
+typedef struct importChunk
+{
+    uint64_t sequence;  // position of the chunk in the import
+    char* data;
+    size_t length;
+} importChunk;
+
+struct todoistImport
+{
+    char** paths;
+    int numPaths;
+    pthread_t reader;
+    pthread_t workers[IMPORT_MAX_WORKERS];
+    int numWorkers;
+
+    pthread_mutex_t lock;           // protects everything below
+    pthread_cond_t chunkQueued;     // signalled when a chunk is queued, or reading stops
+    pthread_cond_t windowMoved;     // signalled when the app takes a batch, making room for another chunk
+    importChunk queue[IMPORT_WINDOW]; // chunks waiting to be parsed, oldest first
+    size_t queueHead;
+    size_t queueCount;
+    importBatch* done[IMPORT_WINDOW]; // parsed batches, in the slot for their chunk's sequence number
+    uint64_t numChunks;             // chunks read so far
+    uint64_t nextBatch;             // sequence number of the next batch for the app
+    bool readingDone;
+    bool cancelled;
+    int error;                      // errno value if reading failed
+    const char* errorPath;
+
+    int pipe[2];                    // a byte is written to pipe[1] each time a batch is parsed
+};
+
+// Queue a chunk for the workers, waiting while the window is full. Takes ownership of data.
+// Returns false if the import has been cancelled.
+static bool queueChunk(todoistImport* import, char* data, size_t length)
+{
+    pthread_mutex_lock(&import->lock);
+    while(import->numChunks - import->nextBatch >= IMPORT_WINDOW && !import->cancelled)
+    {
+        pthread_cond_wait(&import->windowMoved, &import->lock);
+    }
+    if(import->cancelled)
+    {
+        pthread_mutex_unlock(&import->lock);
+        free(data);
+        return false;
+    }
+    importChunk chunk = { import->numChunks++, data, length };
+    import->queue[(import->queueHead + import->queueCount++) % IMPORT_WINDOW] = chunk;
+    pthread_cond_signal(&import->chunkQueued);
+    pthread_mutex_unlock(&import->lock);
+    return true;
+}
+
+// Reader thread: reads the files in chunks that end at a line break
+static void* readFiles(void* arg)
+{
+    todoistImport* import = arg;
+    for(int i = 0; i < import->numPaths; i++)
+    {
+        FILE* file = fopen(import->paths[i], "r");
+        if(file == NULL)
+        {
+            pthread_mutex_lock(&import->lock);
+            import->error = errno;
+            import->errorPath = import->paths[i];
+            pthread_mutex_unlock(&import->lock);
+            break;
+        }
+        char* carry = NULL; // start of a line that continues in the next chunk
+        size_t carryLength = 0;
+        bool ok = true;
+        while(ok)
+        {
+            // +1 leaves room for a line break at the end of the file if it doesn't have one
+            char* data = malloc(carryLength + IMPORT_CHUNK_SIZE + 1);
+            memcpy(data, carry, carryLength);
+            free(carry);
+            carry = NULL;
+            size_t bytes_read = fread(data + carryLength, 1, IMPORT_CHUNK_SIZE, file);
+            size_t length = carryLength + bytes_read;
+            carryLength = 0;
+            if(bytes_read < IMPORT_CHUNK_SIZE)
+            {
+                if(ferror(file))
+                {
+                    pthread_mutex_lock(&import->lock);
+                    import->error = EIO;
+                    import->errorPath = import->paths[i];
+                    pthread_mutex_unlock(&import->lock);
+                    free(data);
+                    ok = false;
+                    break;
+                }
+                if(length > 0 && data[length - 1] != '\n')
+                {
+                    data[length++] = '\n';
+                }
+                ok = length == 0 || queueChunk(import, data, length);
+                if(length == 0)
+                {
+                    free(data);
+                }
+                break;
+            }
+            // Cut the chunk after its last line break, and carry the rest over to the next chunk
+            char* lastBreak = memrchr(data, '\n', length);
+            if(lastBreak == NULL)
+            {
+                carry = data; // a single line longer than a chunk; keep reading it
+                carryLength = length;
+                continue;
+            }
+            size_t cut = lastBreak - data + 1;
+            carryLength = length - cut;
+            carry = malloc(carryLength + 1);
+            memcpy(carry, data + cut, carryLength);
+            ok = queueChunk(import, data, cut);
+        }
+        free(carry);
+        fclose(file);
+        if(!ok)
+        {
+            break;
+        }
+    }
+    pthread_mutex_lock(&import->lock);
+    import->readingDone = true;
+    pthread_cond_broadcast(&import->chunkQueued);
+    pthread_mutex_unlock(&import->lock);
+    return NULL;
+}
+
+// Split a chunk into entries, one per non-blank line
+static importBatch* parseChunk(const importChunk* chunk)
+{
+    size_t lines = 0;
+    for(const char* c = chunk->data; (c = memchr(c, '\n', chunk->data + chunk->length - c)) != NULL; c++)
+    {
+        lines++;
+    }
+    importBatch* batch = malloc(sizeof(importBatch));
+    batch->texts = malloc((lines + 1) * sizeof(char*));
+    batch->lengths = malloc((lines + 1) * sizeof(size_t));
+    batch->count = 0;
+    const char* line = chunk->data;
+    const char* end = chunk->data + chunk->length;
+    while(line < end)
+    {
+        const char* lineEnd = memchr(line, '\n', end - line);
+        size_t length = lineEnd - line;
+        if(length > 0)
+        {
+            batch->texts[batch->count] = strndup(line, length);
+            batch->lengths[batch->count] = length;
+            batch->count++;
+        }
+        line = lineEnd + 1;
+    }
+    return batch;
+}
+
+// Worker thread: parses queued chunks until there are no more
+static void* parseChunks(void* arg)
+{
+    todoistImport* import = arg;
+    while(true)
+    {
+        pthread_mutex_lock(&import->lock);
+        while(import->queueCount == 0 && !import->readingDone && !import->cancelled)
+        {
+            pthread_cond_wait(&import->chunkQueued, &import->lock);
+        }
+        if(import->queueCount == 0 || import->cancelled)
+        {
+            pthread_mutex_unlock(&import->lock);
+            return NULL;
+        }
+        importChunk chunk = import->queue[import->queueHead];
+        import->queueHead = (import->queueHead + 1) % IMPORT_WINDOW;
+        import->queueCount--;
+        pthread_mutex_unlock(&import->lock);
+
+        importBatch* batch = parseChunk(&chunk);
+        free(chunk.data);
+
+        pthread_mutex_lock(&import->lock);
+        import->done[chunk.sequence % IMPORT_WINDOW] = batch;
+        pthread_mutex_unlock(&import->lock);
+        char ready = 1;
+        write(import->pipe[1], &ready, 1);
+    }
+}
+
+todoistImport* importStart(const char* const* paths, int numPaths)
+{
+    todoistImport* import = calloc(1, sizeof(todoistImport));
+    if(import == NULL || pipe(import->pipe) != 0)
+    {
+        free(import);
+        return NULL;
+    }
+    fcntl(import->pipe[0], F_SETFL, O_NONBLOCK);
+    import->paths = malloc(numPaths * sizeof(char*));
+    for(int i = 0; i < numPaths; i++)
+    {
+        import->paths[i] = strdup(paths[i]);
+    }
+    import->numPaths = numPaths;
+    pthread_mutex_init(&import->lock, NULL);
+    pthread_cond_init(&import->chunkQueued, NULL);
+    pthread_cond_init(&import->windowMoved, NULL);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores < 1 ? 1 : cores > IMPORT_MAX_WORKERS ? IMPORT_MAX_WORKERS : (int) cores;
+    while(import->numWorkers < wanted
+        && pthread_create(&import->workers[import->numWorkers], NULL, parseChunks, import) == 0)
+    {
+        import->numWorkers++;
+    }
+    if(import->numWorkers == 0 || pthread_create(&import->reader, NULL, readFiles, import) != 0)
+    {
+        // Without a reader, the workers are told to stop by marking reading as done
+        pthread_mutex_lock(&import->lock);
+        import->readingDone = true;
+        import->cancelled = true;
+        pthread_cond_broadcast(&import->chunkQueued);
+        pthread_mutex_unlock(&import->lock);
+        for(int i = 0; i < import->numWorkers; i++)
+        {
+            pthread_join(import->workers[i], NULL);
+        }
+        import->numWorkers = -1; // no reader to join
+        importFinish(import);
+        return NULL;
+    }
+    return import;
+}
+
+int importFd(todoistImport* import)
+{
+    return import->pipe[0];
+}
+
+importBatch* importNext(todoistImport* import)
+{
+    char ready[64];
+    while(read(import->pipe[0], ready, sizeof(ready)) > 0); // the pipe is only a wake-up signal
+
+    pthread_mutex_lock(&import->lock);
+    importBatch* batch = NULL;
+    if(import->nextBatch < import->numChunks)
+    {
+        batch = import->done[import->nextBatch % IMPORT_WINDOW];
+        if(batch != NULL)
+        {
+            import->done[import->nextBatch % IMPORT_WINDOW] = NULL;
+            import->nextBatch++;
+            pthread_cond_signal(&import->windowMoved);
+        }
+    }
+    pthread_mutex_unlock(&import->lock);
+    return batch;
+}
+
+bool importReady(todoistImport* import)
+{
+    pthread_mutex_lock(&import->lock);
+    bool ready = import->nextBatch < import->numChunks && import->done[import->nextBatch % IMPORT_WINDOW] != NULL;
+    pthread_mutex_unlock(&import->lock);
+    return ready;
+}
+
+bool importDone(todoistImport* import)
+{
+    pthread_mutex_lock(&import->lock);
+    bool done = import->readingDone && import->nextBatch == import->numChunks;
+    pthread_mutex_unlock(&import->lock);
+    return done;
+}
+
+int importError(todoistImport* import, const char** path)
+{
+    pthread_mutex_lock(&import->lock);
+    int error = import->error;
+    *path = import->errorPath;
+    pthread_mutex_unlock(&import->lock);
+    return error;
+}
+
+void importFreeBatch(importBatch* batch)
+{
+    for(size_t i = 0; i < batch->count; i++)
+    {
+        free(batch->texts[i]);
+    }
+    free(batch->texts);
+    free(batch->lengths);
+    free(batch);
+}
+
+void importFinish(todoistImport* import)
+{
+    if(import->numWorkers >= 0)
+    {
+        pthread_mutex_lock(&import->lock);
+        import->cancelled = true;
+        pthread_cond_broadcast(&import->chunkQueued);
+        pthread_cond_broadcast(&import->windowMoved);
+        pthread_mutex_unlock(&import->lock);
+        pthread_join(import->reader, NULL);
+        for(int i = 0; i < import->numWorkers; i++)
+        {
+            pthread_join(import->workers[i], NULL);
+        }
+    }
+
+    // Free whatever was still in the pipeline
+    for(size_t i = 0; i < import->queueCount; i++)
+    {
+        free(import->queue[(import->queueHead + i) % IMPORT_WINDOW].data);
+    }
+    for(int i = 0; i < IMPORT_WINDOW; i++)
+    {
+        if(import->done[i] != NULL)
+        {
+            importFreeBatch(import->done[i]);
+        }
+    }
+    for(int i = 0; i < import->numPaths; i++)
+    {
+        free(import->paths[i]);
+    }
+    free(import->paths);
+    close(import->pipe[0]);
+    close(import->pipe[1]);
+    pthread_mutex_destroy(&import->lock);
+    pthread_cond_destroy(&import->chunkQueued);
+    pthread_cond_destroy(&import->windowMoved);
+    free(import);
+}
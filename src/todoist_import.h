@@ -0,0 +1,55 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Pipeline for importing lists from text files, one entry per line.
+A reader thread reads the files in large chunks, each ending at a line break, so no entry is split
+between chunks. A pool of worker threads parses the chunks into batches of entries in parallel.
+The app takes the batches back in the order the chunks were read, so the entries always come out
+in the order they appear in the files, however the parsing is scheduled. Only a limited number of
+chunks is in the pipeline at once, so the reader doesn't get far ahead of the app.
+*/
+
+#ifndef TODOIST_IMPORT_H
+#define TODOIST_IMPORT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Entries parsed from one chunk
+typedef struct importBatch
+{
+    char** texts;       // text of each entry, null-terminated. The receiver takes ownership of these.
+    size_t* lengths;
+    size_t count;
+} importBatch;
+
+typedef struct todoistImport todoistImport;
+
+// Start importing a list of files, in order. Returns NULL if the pipeline can't be started.
+todoistImport* importStart(const char* const* paths, int numPaths);
+
+// File descriptor that becomes readable when a batch may be ready, for use with poll()
+int importFd(todoistImport* import);
+
+// Take the next batch, in order. Returns NULL if it hasn't been parsed yet.
+// Free the batch with importFreeBatch() once its texts have been taken.
+importBatch* importNext(todoistImport* import);
+
+// True if importNext() would return a batch
+bool importReady(todoistImport* import);
+
+// True once every batch has been taken (or reading has failed and every batch read before that has been taken)
+bool importDone(todoistImport* import);
+
+// If reading a file failed, returns the errno value and sets *path to the file's path, otherwise returns 0
+int importError(todoistImport* import, const char** path);
+
+// Free a batch. Texts that have been taken should be set to NULL first.
+void importFreeBatch(importBatch* batch);
+
+// Stop the pipeline (if it hasn't finished), wait for its threads, and free it
+void importFinish(todoistImport* import);
+
+#endif
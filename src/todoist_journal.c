@@ -0,0 +1,292 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Write-ahead journal of changes to the list. See todoist_journal.h.
+
+Journal file layout: records one after another, each a journalRecord followed by 'length' bytes of UTF-8 text,
+then 'metaLength' bytes of the entry's metadata.
+A record cut short at the end of the file (by a crash in the middle of a commit) is ignored.
+*/
+
+#include "todoist_journal.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Record types
+#define JOURNAL_PUT 1
+#define JOURNAL_DELETE 2
+
+typedef struct journalRecord
+{
+    uint32_t type;
+    uint32_t id;
+    uint32_t length; // length of the text that follows
+    uint32_t metaLength; // length of the metadata after the text
+} journalRecord;
+
+// Current time in milliseconds, from a clock that is not affected by changes to the system time
+static int64_t nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int journalOpen(todoistJournal* journal, const char* path)
+{
+    memset(journal, 0, sizeof(*journal));
+    journal->path = strdup(path);
+    journal->prevPath = malloc(strlen(path) + 6);
+    sprintf(journal->prevPath, "%s.prev", path);
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    struct stat info;
+    if(journal->fd < 0 || fstat(journal->fd, &info) != 0)
+    {
+        journalClose(journal);
+        return -1;
+    }
+    journal->size = info.st_size;
+    return 0;
+}
+
+void journalClose(todoistJournal* journal)
+{
+    if(journal->fd >= 0)
+    {
+        journalCommit(journal);
+        close(journal->fd);
+    }
+    free(journal->buffer);
+    free(journal->path);
+    free(journal->prevPath);
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+}
+
+// Add a record to the buffer, and start the commit timer if the buffer was empty
+static void appendRecord(todoistJournal* journal, uint32_t type, uint32_t id, const char* text, size_t length,
+    const void* meta, size_t metaLength)
+{
+    size_t size = sizeof(journalRecord) + length + metaLength;
+    if(journal->length + size > journal->capacity)
+    {
+        size_t capacity = journal->capacity ? journal->capacity * 2 : 4096;
+        while(capacity < journal->length + size)
+        {
+            capacity *= 2;
+        }
+        journal->buffer = realloc(journal->buffer, capacity);
+        journal->capacity = capacity;
+    }
+    if(journal->length == 0)
+    {
+        journal->commitDue = nowMs() + JOURNAL_COMMIT_INTERVAL_MS;
+    }
+    journalRecord record = { type, id, (uint32_t) length, (uint32_t) metaLength };
+    memcpy(journal->buffer + journal->length, &record, sizeof(record));
+    memcpy(journal->buffer + journal->length + sizeof(record), text, length);
+    if(metaLength > 0)
+    {
+        memcpy(journal->buffer + journal->length + sizeof(record) + length, meta, metaLength);
+    }
+    journal->length += size;
+    journal->size += size;
+}
+
+void journalPut(todoistJournal* journal, uint32_t id, const char* text, size_t length, const void* meta, size_t metaLength)
+{
+    appendRecord(journal, JOURNAL_PUT, id, text, length, meta, metaLength);
+}
+
+void journalDelete(todoistJournal* journal, uint32_t id)
+{
+    appendRecord(journal, JOURNAL_DELETE, id, NULL, 0, NULL, 0);
+}
+
+int journalCommit(todoistJournal* journal)
+{
+    if(journal->length == 0)
+    {
+        return 0;
+    }
+    off_t start = lseek(journal->fd, 0, SEEK_END);
+    size_t written = 0;
+    while(written < journal->length)
+    {
+        ssize_t result = write(journal->fd, journal->buffer + written, journal->length - written);
+        if(result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(result <= 0)
+        {
+            // Don't leave part of a record in the file; the whole buffer is written again next time
+            if(start >= 0 && ftruncate(journal->fd, start) != 0)
+            {
+                perror("Error truncating journal");
+            }
+            return -1;
+        }
+        written += result;
+    }
+    if(fdatasync(journal->fd) != 0)
+    {
+        return -1;
+    }
+    journal->length = 0;
+    return 0;
+}
+
+int journalTimeout(todoistJournal* journal)
+{
+    if(journal->length == 0)
+    {
+        return -1;
+    }
+    int64_t left = journal->commitDue - nowMs();
+    return left > 0 ? (int) left : 0;
+}
+
+// Append the contents of one file to another. Returns 0 on success, -1 on error.
+static int appendFile(int to, int from)
+{
+    char chunk[64 * 1024];
+    ssize_t bytes_read;
+    if(lseek(from, 0, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+    while((bytes_read = read(from, chunk, sizeof(chunk))) > 0)
+    {
+        if(write(to, chunk, bytes_read) != bytes_read)
+        {
+            return -1;
+        }
+    }
+    return bytes_read < 0 ? -1 : 0;
+}
+
+int journalRotate(todoistJournal* journal)
+{
+    if(journalCommit(journal) != 0)
+    {
+        return -1;
+    }
+    if(access(journal->prevPath, F_OK) == 0)
+    {
+        // The last export didn't finish, so its records are still needed: add these after them
+        int prev = open(journal->prevPath, O_WRONLY | O_APPEND);
+        int current = open(journal->path, O_RDONLY);
+        int failed = prev < 0 || current < 0 || appendFile(prev, current) != 0 || fdatasync(prev) != 0;
+        if(prev >= 0)
+        {
+            close(prev);
+        }
+        if(current >= 0)
+        {
+            close(current);
+        }
+        if(failed || ftruncate(journal->fd, 0) != 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        int fd = -1;
+        if(rename(journal->path, journal->prevPath) != 0
+            || (fd = open(journal->path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        {
+            return -1;
+        }
+        close(journal->fd);
+        journal->fd = fd;
+    }
+    journal->size = 0;
+    return 0;
+}
+
+void journalRetire(todoistJournal* journal)
+{
+    unlink(journal->prevPath);
+}
+
+// Apply the records in one journal file to a store. Returns the number applied, or -1 on error.
+static long replayFile(const char* path, todoistStore* store)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    long applied = 0;
+    journalRecord record;
+    char* text = NULL;
+    size_t textCapacity = 0;
+    while(fread(&record, sizeof(record), 1, file) == 1)
+    {
+        // The text and the metadata are read together; the metadata starts straight after the text
+        size_t size = (size_t) record.length + record.metaLength;
+        if(size > textCapacity)
+        {
+            textCapacity = size;
+            text = realloc(text, textCapacity);
+        }
+        if(fread(text, 1, size, file) != size)
+        {
+            break; // record cut short by a crash
+        }
+        if(record.type == JOURNAL_PUT)
+        {
+            if(storePut(store, record.id, text, record.length, record.metaLength ? text + record.length : NULL,
+                record.metaLength) != 0)
+            {
+                applied = -1;
+                break;
+            }
+        }
+        else if(record.type == JOURNAL_DELETE)
+        {
+            storeDelete(store, record.id); // fails harmlessly if the entry is already gone
+        }
+        else
+        {
+            break; // not a record; the rest of the file can't be trusted
+        }
+        applied++;
+    }
+    free(text);
+    fclose(file);
+    return applied;
+}
+
+long journalReplay(const char* path, todoistStore* store)
+{
+    char* prevPath = malloc(strlen(path) + 6);
+    sprintf(prevPath, "%s.prev", path);
+    long prev = replayFile(prevPath, store);
+    long current = prev < 0 ? -1 : replayFile(path, store);
+    free(prevPath);
+    if(current < 0 || storeSync(store) != 0)
+    {
+        return -1;
+    }
+    return prev + current;
+}
+
+void journalRemove(const char* path)
+{
+    char* prevPath = malloc(strlen(path) + 6);
+    sprintf(prevPath, "%s.prev", path);
+    unlink(prevPath);
+    unlink(path);
+    free(prevPath);
+}
@@ -0,0 +1,76 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Write-ahead journal of changes to the list, so that changes which have not been exported yet
+survive the app being closed or crashing.
+Each add, edit or delete is appended to an in-memory buffer as a small record, which costs
+no more than copying the entry's text. The buffer is written out and synced to disk in one go
+(a group commit) at most JOURNAL_COMMIT_INTERVAL_MS after the first change in it.
+
+Records hold the whole new text (and metadata) of an entry, identified by its store ID, so replaying them
+more than once gives the same result. The journal is rotated when an export starts: the records
+written until then are moved to the previous generation (path + ".prev"), which is deleted once
+the export has saved them. Recovery replays the previous generation, then the current one,
+over the store.
+*/
+
+#ifndef TODOIST_JOURNAL_H
+#define TODOIST_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "todoist_store.h"
+
+// Longest time a change waits in memory before it is committed to disk
+#define JOURNAL_COMMIT_INTERVAL_MS 100
+
+typedef struct todoistJournal
+{
+    int fd;                 // file descriptor of the current generation of the journal
+    char* path;
+    char* prevPath;         // path of the previous generation
+    char* buffer;           // records not yet written to the file
+    size_t length;
+    size_t capacity;
+    int64_t commitDue;      // time (in ms, from a monotonic clock) by which the buffer must be committed
+    uint64_t size;          // bytes in the current generation, including the buffer
+} todoistJournal;
+
+// Open (or create) the journal at path. Returns 0 on success, -1 on error.
+int journalOpen(todoistJournal* journal, const char* path);
+
+// Commit any buffered records and close the journal
+void journalClose(todoistJournal* journal);
+
+// Record that the entry with a given ID has been added or changed, and now has the given text and metadata
+// (meta may be NULL, if metaLength is 0)
+void journalPut(todoistJournal* journal, uint32_t id, const char* text, size_t length, const void* meta, size_t metaLength);
+
+// Record that the entry with a given ID has been deleted
+void journalDelete(todoistJournal* journal, uint32_t id);
+
+// Write the buffered records to the file and sync it. Returns 0 on success, -1 on error
+// (in which case the records stay buffered and are written by the next commit).
+int journalCommit(todoistJournal* journal);
+
+// Milliseconds until the buffered records are due to be committed, 0 if they are overdue,
+// or -1 if there is nothing to commit. Suitable as the timeout for poll().
+int journalTimeout(todoistJournal* journal);
+
+// Start a new generation: commit, and move the current records to the previous generation
+// (appending them to it, if the previous generation is still there). Returns 0 on success, -1 on error.
+int journalRotate(todoistJournal* journal);
+
+// Delete the previous generation, once its records have been saved in the store
+void journalRetire(todoistJournal* journal);
+
+// Apply the records of the journal at path (both generations) to a store, and sync the store.
+// Returns the number of records applied, or -1 on error.
+long journalReplay(const char* path, todoistStore* store);
+
+// Delete both generations of the journal at path
+void journalRemove(const char* path);
+
+#endif
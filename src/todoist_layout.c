@@ -0,0 +1,550 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Declarative layouts. See todoist_layout.h.
+*/
+
+#include "todoist_layout.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#define LAYOUT_MAX_DEPTH 32
+#define LAYOUT_ID_PREFIX "layoutElement"
+#define LAYOUT_ID_SIZE (sizeof(LAYOUT_ID_PREFIX) + 20) // room for the prefix and the digits of any size_t
+
+// Attribute set on an element once its other attributes have been, which shows it (see layoutBuild())
+#define LAYOUT_READY_ATTRIBUTE "data-layout"
+
+// Tags that have no content and no closing tag
+static const char* voidTags[] = { "area", "br", "col", "embed", "hr", "img", "input", "link", "meta", "source", "wbr" };
+
+typedef struct layoutParser
+{
+    const char* source;
+    const char* c;      // next character to parse
+} layoutParser;
+
+static int fail(const layoutParser* parser, const char* reason)
+{
+    int line = 1;
+    for(const char* c = parser->source; c < parser->c; c++)
+    {
+        line += *c == '\n';
+    }
+    fprintf(stderr, "Layout error on line %d: %s\n", line, reason);
+    return -1;
+}
+
+static void skipSpace(layoutParser* parser)
+{
+    while(isspace((unsigned char) *parser->c))
+    {
+        parser->c++;
+    }
+}
+
+// Copy text, decoding the basic character entities, and collapsing each run of whitespace into one space
+static char* decodeText(const char* start, size_t length)
+{
+    static const char* entities[][2] = { { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }, { "&nbsp;", "\xc2\xa0" } };
+    char* text = malloc(length + 1);
+    size_t out = 0;
+    const char* end = start + length;
+    for(const char* c = start; c < end; )
+    {
+        if(isspace((unsigned char) *c))
+        {
+            text[out++] = ' ';
+            while(c < end && isspace((unsigned char) *c))
+            {
+                c++;
+            }
+            continue;
+        }
+        bool decoded = false;
+        for(size_t e = 0; *c == '&' && e < sizeof(entities) / sizeof(entities[0]); e++)
+        {
+            size_t entityLength = strlen(entities[e][0]);
+            if((size_t) (end - c) >= entityLength && strncmp(c, entities[e][0], entityLength) == 0)
+            {
+                // every replacement is shorter than its entity, so it fits
+                memcpy(text + out, entities[e][1], strlen(entities[e][1]));
+                out += strlen(entities[e][1]);
+                c += entityLength;
+                decoded = true;
+                break;
+            }
+        }
+        if(!decoded)
+        {
+            text[out++] = *c++;
+        }
+    }
+    text[out] = '\0';
+    return text;
+}
+
+// Copy text with the whitespace at either end removed
+static char* trimmed(const char* start, const char* end)
+{
+    while(start < end && isspace((unsigned char) *start))
+    {
+        start++;
+    }
+    while(end > start && isspace((unsigned char) end[-1]))
+    {
+        end--;
+    }
+    return decodeText(start, end - start);
+}
+
+static void addPair(char*** pairs, size_t* count, char* name, char* value)
+{
+    *pairs = realloc(*pairs, (*count + 1) * 2 * sizeof(char*));
+    (*pairs)[*count * 2] = name;
+    (*pairs)[*count * 2 + 1] = value;
+    (*count)++;
+}
+
+static layoutNode* addNode(todoistLayout* layout, int parent, int depth)
+{
+    if(layout->count == layout->capacity)
+    {
+        layout->capacity = layout->capacity ? layout->capacity * 2 : 32;
+        layout->nodes = realloc(layout->nodes, layout->capacity * sizeof(layoutNode));
+    }
+    layoutNode* node = &layout->nodes[layout->count++];
+    memset(node, 0, sizeof(*node));
+    node->parent = parent;
+    node->depth = depth;
+    if(depth > layout->depth)
+    {
+        layout->depth = depth;
+    }
+    return node;
+}
+
+// Parse the declarations of a style attribute ("property: value; ...") into an element's styles
+static int parseStyle(layoutParser* parser, layoutNode* node, const char* style)
+{
+    while(*style)
+    {
+        const char* end = strchr(style, ';');
+        if(end == NULL)
+        {
+            end = style + strlen(style);
+        }
+        const char* colon = memchr(style, ':', end - style);
+        if(colon != NULL)
+        {
+            addPair(&node->styles, &node->numStyles, trimmed(style, colon), trimmed(colon + 1, end));
+        }
+        else
+        {
+            for(const char* c = style; c < end; c++)
+            {
+                if(!isspace((unsigned char) *c))
+                {
+                    return fail(parser, "style declaration without a ':'");
+                }
+            }
+        }
+        style = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Parse the CSS rules in a <style> block, up to its closing tag
+static int parseRules(layoutParser* parser, todoistLayout* layout)
+{
+    while(true)
+    {
+        skipSpace(parser);
+        if(strncmp(parser->c, "/*", 2) == 0)
+        {
+            const char* end = strstr(parser->c + 2, "*/");
+            if(end == NULL)
+            {
+                return fail(parser, "unterminated comment");
+            }
+            parser->c = end + 2;
+            continue;
+        }
+        if(strncmp(parser->c, "</style>", 8) == 0)
+        {
+            parser->c += 8;
+            return 0;
+        }
+        const char* open = strchr(parser->c, '{');
+        const char* close = open ? strchr(open, '}') : NULL;
+        if(close == NULL)
+        {
+            return fail(parser, "expected a CSS rule or </style>");
+        }
+        addPair(&layout->rules, &layout->numRules, trimmed(parser->c, open), trimmed(open + 1, close));
+        parser->c = close + 1;
+    }
+}
+
+// Parse the attributes of a start tag into node, up to the end of the tag. Sets *selfClosed if it ends with "/>".
+static int parseAttributes(layoutParser* parser, layoutNode* node, bool* selfClosed)
+{
+    *selfClosed = false;
+    while(true)
+    {
+        skipSpace(parser);
+        if(*parser->c == '>' || strncmp(parser->c, "/>", 2) == 0)
+        {
+            *selfClosed = *parser->c == '/';
+            parser->c += *selfClosed ? 2 : 1;
+            return 0;
+        }
+        const char* name = parser->c;
+        while(*parser->c && !isspace((unsigned char) *parser->c) && !strchr("=>/\"'", *parser->c))
+        {
+            parser->c++;
+        }
+        if(parser->c == name)
+        {
+            return fail(parser, *parser->c ? "unexpected character in tag" : "unterminated tag");
+        }
+        char* attribute = strndup(name, parser->c - name);
+        char* value = strdup("");
+        skipSpace(parser);
+        if(*parser->c == '=')
+        {
+            parser->c++;
+            skipSpace(parser);
+            char quote = *parser->c;
+            const char* end = (quote == '"' || quote == '\'') ? strchr(parser->c + 1, quote) : NULL;
+            if(end == NULL)
+            {
+                free(attribute);
+                free(value);
+                return fail(parser, "attribute value must be quoted");
+            }
+            free(value);
+            value = decodeText(parser->c + 1, end - parser->c - 1);
+            parser->c = end + 1;
+        }
+        if(strcmp(attribute, "id") == 0)
+        {
+            free(node->id);
+            node->id = value;
+            free(attribute);
+        }
+        else if(strcmp(attribute, "style") == 0)
+        {
+            int result = parseStyle(parser, node, value);
+            free(attribute);
+            free(value);
+            if(result != 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            addPair(&node->attributes, &node->numAttributes, attribute, value);
+        }
+    }
+}
+
+// Parse a layout's source into its nodes and rules. Returns 0 on success, -1 on error.
+static int parseLayout(todoistLayout* layout, const char* source)
+{
+    layoutParser parser = { source, source };
+    int open[LAYOUT_MAX_DEPTH]; // elements that haven't been closed yet, outermost first
+    int numOpen = 0;
+    while(*parser.c)
+    {
+        int parent = numOpen > 0 ? open[numOpen - 1] : -1;
+        if(strncmp(parser.c, "<!--", 4) == 0)
+        {
+            const char* end = strstr(parser.c + 4, "-->");
+            if(end == NULL)
+            {
+                return fail(&parser, "unterminated comment");
+            }
+            parser.c = end + 3;
+        }
+        else if(strncmp(parser.c, "</", 2) == 0)
+        {
+            const char* name = parser.c + 2;
+            size_t length = strcspn(name, " \t\r\n>");
+            if(numOpen == 0 || strlen(layout->nodes[parent].tag) != length
+                || strncmp(layout->nodes[parent].tag, name, length) != 0)
+            {
+                return fail(&parser, "closing tag doesn't match the open element");
+            }
+            parser.c = name + length;
+            skipSpace(&parser);
+            if(*parser.c != '>')
+            {
+                return fail(&parser, "expected '>'");
+            }
+            parser.c++;
+            numOpen--;
+        }
+        else if(*parser.c == '<')
+        {
+            const char* name = ++parser.c;
+            while(isalnum((unsigned char) *parser.c) || *parser.c == '-')
+            {
+                parser.c++;
+            }
+            if(parser.c == name)
+            {
+                return fail(&parser, "expected a tag name");
+            }
+            if(parser.c - name == 5 && strncmp(name, "style", 5) == 0)
+            {
+                skipSpace(&parser);
+                if(*parser.c != '>')
+                {
+                    return fail(&parser, "expected '>'");
+                }
+                parser.c++;
+                if(parseRules(&parser, layout) != 0)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            layoutNode* node = addNode(layout, parent, numOpen);
+            node->tag = strndup(name, parser.c - name);
+            bool selfClosed;
+            if(parseAttributes(&parser, node, &selfClosed) != 0)
+            {
+                return -1;
+            }
+            bool isVoid = selfClosed;
+            for(size_t i = 0; i < sizeof(voidTags) / sizeof(voidTags[0]) && !isVoid; i++)
+            {
+                isVoid = strcmp(node->tag, voidTags[i]) == 0;
+            }
+            if(!isVoid)
+            {
+                if(numOpen == LAYOUT_MAX_DEPTH)
+                {
+                    return fail(&parser, "elements nested too deeply");
+                }
+                open[numOpen++] = layout->count - 1;
+            }
+        }
+        else
+        {
+            const char* end = strchr(parser.c, '<');
+            if(end == NULL)
+            {
+                end = parser.c + strlen(parser.c);
+            }
+            char* text = decodeText(parser.c, end - parser.c);
+            parser.c = end;
+            if(strcmp(text, " ") == 0 || text[0] == '\0')
+            {
+                free(text); // only whitespace between tags
+                continue;
+            }
+            addNode(layout, parent, numOpen)->text = text;
+        }
+    }
+    if(numOpen > 0)
+    {
+        return fail(&parser, "element not closed by the end of the layout");
+    }
+    return 0;
+}
+
+int layoutCompile(todoistLayout* layout, const char* source)
+{
+    memset(layout, 0, sizeof(*layout));
+    if(parseLayout(layout, source) != 0)
+    {
+        layoutFree(layout);
+        return -1;
+    }
+
+    // Work out which elements' locations are needed, and give those without an ID a generated one
+    for(size_t i = 0; i < layout->count; i++)
+    {
+        layoutNode* node = &layout->nodes[i];
+        if(node->parent >= 0)
+        {
+            layout->nodes[node->parent].needsLoc = true; // something is added to its parent
+        }
+        if(node->tag != NULL && (node->id != NULL || node->numAttributes > 0 || node->numStyles > 0))
+        {
+            node->needsLoc = true;
+        }
+    }
+    for(size_t i = 0; i < layout->count; i++)
+    {
+        layoutNode* node = &layout->nodes[i];
+        if(node->needsLoc && node->id == NULL)
+        {
+            node->id = malloc(LAYOUT_ID_SIZE);
+            snprintf(node->id, LAYOUT_ID_SIZE, LAYOUT_ID_PREFIX "%zu", i);
+        }
+    }
+    return 0;
+}
+
+// Send the style rules that an element needs from the moment it is added: its inline styles, as a rule for its ID,
+// and if it has attributes (which can only be set once its location is known), a rule hiding it until they are set
+static void sendElementRules(const layoutNode* node, hipe_session session)
+{
+    size_t length = strlen(node->id) + sizeof(":not([" LAYOUT_READY_ATTRIBUTE "])") + 1;
+    for(size_t s = 0; s < node->numStyles; s++)
+    {
+        length += strlen(node->styles[s * 2]) + strlen(node->styles[s * 2 + 1]) + 3;
+    }
+    char* selector = malloc(length);
+    char* declarations = malloc(length);
+    sprintf(selector, "#%s", node->id);
+    declarations[0] = '\0';
+    for(size_t s = 0; s < node->numStyles; s++)
+    {
+        sprintf(declarations + strlen(declarations), "%s: %s;", node->styles[s * 2], node->styles[s * 2 + 1]);
+    }
+    if(node->numStyles > 0)
+    {
+        hipe_send(session, HIPE_OP_ADD_STYLE_RULE, 0, 0, 2, selector, declarations);
+    }
+    if(node->numAttributes > 0)
+    {
+        // (more specific than the rule above, so it wins over a display property there)
+        strcat(selector, ":not([" LAYOUT_READY_ATTRIBUTE "])");
+        hipe_send(session, HIPE_OP_ADD_STYLE_RULE, 0, 0, 2, selector, "display: none");
+    }
+    free(selector);
+    free(declarations);
+}
+
+int layoutBuild(todoistLayout* layout, hipe_session session)
+{
+    // The style rules need no locations, so they go out with the first level
+    hipe_cork(session);
+    for(size_t i = 0; i < layout->numRules; i++)
+    {
+        hipe_send(session, HIPE_OP_ADD_STYLE_RULE, 0, 0, 2, layout->rules[i * 2], layout->rules[i * 2 + 1]);
+    }
+    // Each pass first sets the attributes of the elements added by the pass before, whose locations are now known,
+    // then adds the nodes at one depth. An element's styles go out with it, as a rule for its ID, so that it is
+    // never displayed without them; an element with attributes is kept hidden until they have been set.
+    for(int depth = 0; depth <= layout->depth + 1; depth++)
+    {
+        if(depth > 0)
+        {
+            hipe_cork(session);
+        }
+        for(size_t i = 0; i < layout->count; i++)
+        {
+            layoutNode* node = &layout->nodes[i];
+            if(node->depth == depth - 1 && node->tag != NULL && node->numAttributes > 0)
+            {
+                for(size_t a = 0; a < node->numAttributes; a++)
+                {
+                    hipe_send(session, HIPE_OP_SET_ATTRIBUTE, 0, node->loc, 2, node->attributes[a * 2], node->attributes[a * 2 + 1]);
+                }
+                hipe_send(session, HIPE_OP_SET_ATTRIBUTE, 0, node->loc, 2, LAYOUT_READY_ATTRIBUTE, "");
+            }
+        }
+        for(size_t i = 0; i < layout->count; i++)
+        {
+            layoutNode* node = &layout->nodes[i];
+            if(node->depth == depth)
+            {
+                hipe_loc parentLoc = node->parent >= 0 ? layout->nodes[node->parent].loc : 0;
+                if(node->tag == NULL)
+                {
+                    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, parentLoc, 1, node->text);
+                    continue;
+                }
+                if(node->numStyles > 0 || node->numAttributes > 0)
+                {
+                    sendElementRules(node, session);
+                }
+                if(node->id != NULL)
+                {
+                    hipe_send(session, HIPE_OP_APPEND_TAG, 0, parentLoc, 2, node->tag, node->id);
+                }
+                else
+                {
+                    hipe_send(session, HIPE_OP_APPEND_TAG, 0, parentLoc, 1, node->tag);
+                }
+                if(node->needsLoc)
+                {
+                    hipe_send(session, HIPE_OP_GET_BY_ID, 0, 0, 1, node->id);
+                }
+            }
+        }
+        if(hipe_uncork(session) != 0)
+        {
+            return -1;
+        }
+
+        // The server answers the requests in order, so the locations come back in the order they were asked for
+        hipe_instruction reply;
+        hipe_instruction_init(&reply);
+        for(size_t i = 0; i < layout->count; i++)
+        {
+            layoutNode* node = &layout->nodes[i];
+            if(node->depth == depth && node->needsLoc)
+            {
+                if(hipe_await_instruction(session, &reply, HIPE_OP_LOCATION_RETURN) != 1)
+                {
+                    hipe_instruction_clear(&reply);
+                    return -1;
+                }
+                node->loc = reply.location;
+            }
+        }
+        hipe_instruction_clear(&reply);
+    }
+    return 0;
+}
+
+hipe_loc layoutLoc(const todoistLayout* layout, const char* id)
+{
+    for(size_t i = 0; i < layout->count; i++)
+    {
+        if(layout->nodes[i].id != NULL && strcmp(layout->nodes[i].id, id) == 0)
+        {
+            return layout->nodes[i].loc;
+        }
+    }
+    return 0;
+}
+
+void layoutFree(todoistLayout* layout)
+{
+    for(size_t i = 0; i < layout->count; i++)
+    {
+        layoutNode* node = &layout->nodes[i];
+        free(node->tag);
+        free(node->text);
+        free(node->id);
+        for(size_t a = 0; a < node->numAttributes * 2; a++)
+        {
+            free(node->attributes[a]);
+        }
+        free(node->attributes);
+        for(size_t s = 0; s < node->numStyles * 2; s++)
+        {
+            free(node->styles[s]);
+        }
+        free(node->styles);
+    }
+    free(layout->nodes);
+    for(size_t r = 0; r < layout->numRules * 2; r++)
+    {
+        free(layout->rules[r]);
+    }
+    free(layout->rules);
+    memset(layout, 0, sizeof(*layout));
+}
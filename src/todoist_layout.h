@@ -0,0 +1,65 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Declarative layouts: the static parts of the app's window written as a subset of HTML and CSS
+(tags with attributes, inline styles and text, plus a <style> block of CSS rules), compiled into
+the Hipe instructions that build them.
+Building the layout one element at a time needs a round trip to the server after each element
+that anything is added to, to find its location. A compiled layout is instead built one level of
+nesting at a time: the instructions for a whole level are sent together, the locations of all its
+elements are then asked for at once, and the replies all come back in one round trip. Building it
+takes as many round trips as the layout has levels, however many elements it has.
+An element is never displayed half-built: its inline styles go out ahead of it, as a style rule for its ID,
+and since attributes can only be set once its location is known, an element with attributes is
+hidden until the next level's instructions have set them.
+Elements with an id attribute can be looked up by it once the layout is built.
+*/
+
+#ifndef TODOIST_LAYOUT_H
+#define TODOIST_LAYOUT_H
+
+#include <hipe.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A tag, or a run of text, in a layout
+typedef struct layoutNode
+{
+    int parent;         // index of the enclosing element, or -1 for the body
+    int depth;          // 0 for nodes in the body, 1 for nodes in those, and so on
+    char* tag;          // tag name, or NULL for text
+    char* text;         // the text, for text nodes
+    char* id;           // ID of the element, from the layout or generated if it needs a location, or NULL
+    char** attributes;  // names and values of the element's attributes, other than id and style, in pairs
+    size_t numAttributes;
+    char** styles;      // CSS properties and values from the element's style attribute, in pairs
+    size_t numStyles;
+    bool needsLoc;      // true if the element's location is needed, to add to it or to look it up
+    hipe_loc loc;       // location of the element, once the layout is built
+} layoutNode;
+
+typedef struct todoistLayout
+{
+    layoutNode* nodes;  // in the order they appear in the layout
+    size_t count;
+    size_t capacity;
+    char** rules;       // selectors and declarations of the rules in <style> blocks, in pairs
+    size_t numRules;
+    int depth;          // depth of the most deeply nested node
+} todoistLayout;
+
+// Compile a layout from its source. Returns 0 on success, or -1 (after printing the line and
+// reason to stderr) if the source isn't valid.
+int layoutCompile(todoistLayout* layout, const char* source);
+
+// Build a compiled layout at the end of the body. Returns 0 on success, or -1 if the session failed.
+int layoutBuild(todoistLayout* layout, hipe_session session);
+
+// Location of the element with a given id, once the layout is built, or 0 if there is none
+hipe_loc layoutLoc(const todoistLayout* layout, const char* id);
+
+void layoutFree(todoistLayout* layout);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Indexed binary list files. See todoist_list.h.
+
+File layout (all integers little-endian, as written by the machines the app runs on):
+    header:  8-byte magic value, 32-bit version, 32-bit count of index slots,
+             64-bit offset of the index, 64-bit size of the file
+    index:   one 64-bit offset per slot, pointing at the slot's record (0 for an empty slot)
+    records: 32-bit text length, 32-bit metadata length, the text, then the metadata
+*/
+
+#include "todoist_list.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LIST_MAGIC "TDLIST\0\0"
+#define LIST_HEADER_SIZE 32
+#define LIST_RECORD_HEADER_SIZE 8
+
+typedef struct listHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t indexOffset;
+    uint64_t size;
+} listHeader;
+
+int listFileWrite(const char* path, const listFileEntry* entries, uint32_t count)
+{
+    char* tempPath = malloc(strlen(path) + 5);
+    sprintf(tempPath, "%s.tmp", path);
+    FILE* temp = fopen(tempPath, "wb");
+    if(temp == NULL)
+    {
+        free(tempPath);
+        return -1;
+    }
+
+    // The index comes straight after the header, and the records after that,
+    // so every offset is known before anything is written
+    listHeader header;
+    memcpy(header.magic, LIST_MAGIC, 8);
+    header.version = LIST_FILE_VERSION;
+    header.count = count;
+    header.indexOffset = LIST_HEADER_SIZE;
+    uint64_t offset = LIST_HEADER_SIZE + (uint64_t) count * sizeof(uint64_t);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if(entries[i].text != NULL)
+        {
+            offset += LIST_RECORD_HEADER_SIZE + entries[i].length + entries[i].metaLength;
+        }
+    }
+    header.size = offset;
+    fwrite(&header, sizeof(header), 1, temp);
+
+    offset = LIST_HEADER_SIZE + (uint64_t) count * sizeof(uint64_t);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        uint64_t recordOffset = entries[i].text != NULL ? offset : 0;
+        fwrite(&recordOffset, sizeof(recordOffset), 1, temp);
+        if(entries[i].text != NULL)
+        {
+            offset += LIST_RECORD_HEADER_SIZE + entries[i].length + entries[i].metaLength;
+        }
+    }
+    for(uint32_t i = 0; i < count; i++)
+    {
+        if(entries[i].text == NULL)
+        {
+            continue;
+        }
+        uint32_t lengths[2] = { entries[i].length, entries[i].metaLength };
+        fwrite(lengths, sizeof(lengths), 1, temp);
+        fwrite(entries[i].text, 1, entries[i].length, temp);
+        if(entries[i].metaLength > 0)
+        {
+            fwrite(entries[i].meta, 1, entries[i].metaLength, temp);
+        }
+    }
+
+    int failed = ferror(temp) || fflush(temp) != 0 || fsync(fileno(temp)) != 0;
+    failed |= fclose(temp) != 0;
+    if(failed || rename(tempPath, path) != 0)
+    {
+        unlink(tempPath);
+        free(tempPath);
+        return -1;
+    }
+    free(tempPath);
+    return 0;
+}
+
+int listFileOpen(listFile* list, const char* path)
+{
+    memset(list, 0, sizeof(*list));
+    list->fd = open(path, O_RDONLY);
+    if(list->fd < 0)
+    {
+        return -1;
+    }
+    struct stat info;
+    if(fstat(list->fd, &info) != 0)
+    {
+        listFileClose(list);
+        return -1;
+    }
+    list->size = info.st_size;
+
+    listHeader header;
+    if(list->size < LIST_HEADER_SIZE || pread(list->fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, LIST_MAGIC, 8) != 0 || header.version != LIST_FILE_VERSION
+        || header.size != list->size || header.indexOffset < LIST_HEADER_SIZE
+        || header.indexOffset + (uint64_t) header.count * sizeof(uint64_t) > list->size)
+    {
+        fprintf(stderr, "Not a valid To-doist list file: %s\n", path);
+        listFileClose(list);
+        errno = EINVAL;
+        return -1;
+    }
+    list->map = mmap(NULL, list->size, PROT_READ, MAP_SHARED, list->fd, 0);
+    if(list->map == MAP_FAILED)
+    {
+        list->map = NULL;
+        listFileClose(list);
+        return -1;
+    }
+    list->count = header.count;
+    return 0;
+}
+
+void listFileClose(listFile* list)
+{
+    if(list->map)
+    {
+        munmap((void*) list->map, list->size);
+    }
+    if(list->fd >= 0)
+    {
+        close(list->fd);
+    }
+    memset(list, 0, sizeof(*list));
+    list->fd = -1;
+}
+
+// Find the record for a slot and read its lengths. Returns its offset, or 0 if there is no valid record.
+static uint64_t recordOffset(const listFile* list, uint32_t index, uint32_t lengths[2])
+{
+    if(list->map == NULL || index >= list->count)
+    {
+        return 0;
+    }
+    uint64_t indexOffset;
+    memcpy(&indexOffset, list->map + 16, sizeof(indexOffset));
+    uint64_t offset;
+    memcpy(&offset, list->map + indexOffset + (uint64_t) index * sizeof(uint64_t), sizeof(offset));
+    if(offset == 0 || offset + LIST_RECORD_HEADER_SIZE > list->size)
+    {
+        return 0;
+    }
+    memcpy(lengths, list->map + offset, 2 * sizeof(uint32_t));
+    if(offset + LIST_RECORD_HEADER_SIZE + lengths[0] + lengths[1] > list->size)
+    {
+        return 0; // damaged file
+    }
+    return offset;
+}
+
+const char* listFileText(const listFile* list, uint32_t index, size_t* length)
+{
+    uint32_t lengths[2];
+    uint64_t offset = recordOffset(list, index, lengths);
+    if(offset == 0)
+    {
+        return NULL;
+    }
+    *length = lengths[0];
+    return list->map + offset + LIST_RECORD_HEADER_SIZE;
+}
+
+const void* listFileMeta(const listFile* list, uint32_t index, size_t* length)
+{
+    uint32_t lengths[2];
+    uint64_t offset = recordOffset(list, index, lengths);
+    if(offset == 0 || lengths[1] == 0)
+    {
+        return NULL;
+    }
+    *length = lengths[1];
+    return list->map + offset + LIST_RECORD_HEADER_SIZE + lengths[0];
+}
@@ -0,0 +1,57 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Indexed binary list file: a versioned header, an index giving the offset of each entry,
+then the entries as length-prefixed UTF-8 text with optional per-entry metadata.
+The file is memory-mapped when opened, so any entry can be read on demand without
+parsing the entries before it - opening a list costs nothing per entry.
+*/
+
+#ifndef TODOIST_LIST_H
+#define TODOIST_LIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LIST_FILE_VERSION 1
+
+// An entry to be written to a list file
+typedef struct listFileEntry
+{
+    const char* text;       // UTF-8 text of the entry, or NULL to leave this slot of the index empty
+    uint32_t length;        // length of the text in bytes
+    const void* meta;       // optional metadata stored with the entry, or NULL
+    uint32_t metaLength;
+} listFileEntry;
+
+// An open list file
+typedef struct listFile
+{
+    int fd;
+    const char* map;    // memory-mapped contents of the file
+    size_t size;        // size of the file
+    uint32_t count;     // number of slots in the index
+} listFile;
+
+// Write a list file with one index slot per entry. The file is written to a temporary file,
+// synced to disk and renamed over path, so path always holds either the old or the new list.
+// Returns 0 on success, -1 on error.
+int listFileWrite(const char* path, const listFileEntry* entries, uint32_t count);
+
+// Open and map a list file. Returns 0 on success, -1 on error (errno is set to ENOENT if
+// the file doesn't exist, or EINVAL if it isn't a list file of a version that can be read).
+int listFileOpen(listFile* list, const char* path);
+
+// Unmap and close a list file. Does nothing if the list file is not open.
+void listFileClose(listFile* list);
+
+// Get the text of an entry, or NULL if the slot is empty or out of range.
+// The text is not null-terminated, and is only valid until the list file is closed.
+const char* listFileText(const listFile* list, uint32_t index, size_t* length);
+
+// Get the metadata of an entry, or NULL if it has none
+const void* listFileMeta(const listFile* list, uint32_t index, size_t* length);
+
+#endif
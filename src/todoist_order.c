@@ -0,0 +1,152 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Ordering of list entries by sort key. See todoist_order.h.
+*/
+
+#include "todoist_order.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+size_t orderRenumber(int32_t* keys, const size_t* sequence, size_t count, size_t* changed)
+{
+    // Centre the keys on 0, so there is as much room before the first entry as after the last
+    int64_t first = -(int64_t) (count / 2) * ORDER_GAP;
+    for(size_t i = 0; i < count; i++)
+    {
+        keys[sequence[i]] = (int32_t) (first + (int64_t) i * ORDER_GAP);
+        changed[i] = sequence[i];
+    }
+    return count;
+}
+
+// Mark the entries of sequence whose keys are in the longest increasing subsequence of their keys
+static void markKept(const int32_t* keys, const size_t* sequence, size_t count, bool* kept)
+{
+    // tails[k] is the position in sequence of the smallest key that ends an increasing run of length k + 1
+    size_t* tails = malloc(count * sizeof(size_t));
+    size_t* previous = malloc(count * sizeof(size_t)); // position of the key before each one in its run
+    size_t length = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        int32_t key = keys[sequence[i]];
+        size_t low = 0, high = length;
+        while(low < high)
+        {
+            size_t middle = low + (high - low) / 2;
+            if(keys[sequence[tails[middle]]] < key)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        previous[i] = low > 0 ? tails[low - 1] : SIZE_MAX;
+        tails[low] = i;
+        if(low == length)
+        {
+            length++;
+        }
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        kept[i] = false;
+    }
+    for(size_t i = length > 0 ? tails[length - 1] : SIZE_MAX; i != SIZE_MAX; i = previous[i])
+    {
+        kept[i] = true;
+    }
+    free(tails);
+    free(previous);
+}
+
+// Lowest and highest key that a run of entries from start to end can take, exclusive
+static void runBounds(const int32_t* keys, const size_t* sequence, size_t count, size_t start, size_t end, int64_t* low, int64_t* high)
+{
+    *low = start > 0 ? keys[sequence[start - 1]] : -ORDER_LIMIT;
+    *high = end < count ? keys[sequence[end]] : ORDER_LIMIT;
+}
+
+size_t orderAssign(int32_t* keys, const size_t* sequence, size_t count, size_t* changed)
+{
+    if(count == 0)
+    {
+        return 0;
+    }
+    bool* kept = malloc(count * sizeof(bool));
+    markKept(keys, sequence, count, kept);
+
+    size_t numChanged = 0;
+    size_t start = 0;
+    while(start < count)
+    {
+        if(kept[start])
+        {
+            start++;
+            continue;
+        }
+        // Fit the run of entries from start to end between the kept entries either side of it
+        size_t end = start;
+        while(end < count && !kept[end])
+        {
+            end++;
+        }
+        int64_t run = end - start;
+        int64_t low, high;
+        runBounds(keys, sequence, count, start, end, &low, &high);
+        int64_t first, step;
+        if(start == 0 && high - run * ORDER_GAP > -ORDER_LIMIT)
+        {
+            first = high - run * ORDER_GAP; // before the first kept entry: space them as usual
+            step = ORDER_GAP;
+        }
+        else if(end == count && low + run * ORDER_GAP < ORDER_LIMIT)
+        {
+            first = low + ORDER_GAP; // after the last kept entry
+            step = ORDER_GAP;
+        }
+        else
+        {
+            step = (high - low) / (run + 1); // between two kept entries: spread them evenly
+            first = low + step;
+        }
+        if(step < 1)
+        {
+            // No room left between the neighbours. Give up keeping the entries around the run, doubling
+            // the stretch to be given new keys until it is sparse enough to leave room for later moves.
+            do
+            {
+                size_t grow = end - start;
+                start = start > grow ? start - grow : 0;
+                end = count - end > grow ? end + grow : count;
+                runBounds(keys, sequence, count, start, end, &low, &high);
+            } while((high - low) / (int64_t) (end - start + 1) < ORDER_GAP / 4 && (start > 0 || end < count));
+            if(start == 0 && end == count)
+            {
+                free(kept);
+                return orderRenumber(keys, sequence, count, changed);
+            }
+            for(size_t i = start; i < end; i++)
+            {
+                kept[i] = false;
+            }
+            // Entries before the stretch may already have been given keys, so go through the runs again.
+            // The keys they get only depend on the kept entries, so they get the same keys again.
+            numChanged = 0;
+            start = 0;
+            continue;
+        }
+        for(size_t i = start; i < end; i++)
+        {
+            keys[sequence[i]] = (int32_t) (first + (int64_t) (i - start) * step);
+            changed[numChanged++] = sequence[i];
+        }
+        start = end;
+    }
+    free(kept);
+    return numChanged;
+}
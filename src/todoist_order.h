@@ -0,0 +1,33 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Ordering of list entries by sort key, for reordering the entries on screen without rebuilding them.
+The entries are displayed in a flex container, and each one's CSS 'order' property is set to its key,
+so changing one key moves one entry. To put the entries in a new order, the keys that are already
+in that order are kept - the longest increasing subsequence of the current keys, taken in the new
+order - and only the other entries get new keys, chosen to fit between their neighbours.
+Keys are spread ORDER_GAP apart, so there is nearly always room to fit entries between two others.
+*/
+
+#ifndef TODOIST_ORDER_H
+#define TODOIST_ORDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ORDER_GAP 1024              // space left between the keys of neighbouring entries
+#define ORDER_LIMIT (1 << 30)       // keys are kept strictly between -ORDER_LIMIT and ORDER_LIMIT
+
+// Give new keys to the entries in sequence (which holds the entries' indexes in keys), so that
+// sorting them by key puts them in the order of sequence, changing as few keys as possible.
+// The indexes of the entries whose keys changed are written to changed, which must have room for count.
+// Returns the number of keys changed.
+size_t orderAssign(int32_t* keys, const size_t* sequence, size_t count, size_t* changed);
+
+// Give every entry in sequence a new key, ORDER_GAP apart, in the order of sequence.
+// The indexes of the entries are written to changed, as for orderAssign(). Returns count.
+size_t orderRenumber(int32_t* keys, const size_t* sequence, size_t count, size_t* changed);
+
+#endif
@@ -0,0 +1,244 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Trigram index for searching list entries. See todoist_search.h.
+*/
+
+#define _GNU_SOURCE // for strcasestr()
+#include "todoist_search.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define TRIGRAM_PRESENT (1u << 24)
+
+// Trigram starting at text[0], folded to lower case
+static uint32_t trigramAt(const char* text)
+{
+    return TRIGRAM_PRESENT | (uint32_t) (unsigned char) tolower((unsigned char) text[0]) << 16
+        | (uint32_t) (unsigned char) tolower((unsigned char) text[1]) << 8
+        | (uint32_t) (unsigned char) tolower((unsigned char) text[2]);
+}
+
+static size_t slotFor(const searchIndex* index, uint32_t trigram)
+{
+    uint32_t hash = trigram * 2654435761u; // Knuth's multiplicative hash
+    return hash & (index->tableSize - 1);
+}
+
+// Find the postings for a trigram, or NULL if no entry contains it
+static searchPosting* findPosting(const searchIndex* index, uint32_t trigram)
+{
+    if(index->tableSize == 0)
+    {
+        return NULL;
+    }
+    for(size_t slot = slotFor(index, trigram); ; slot = (slot + 1) & (index->tableSize - 1))
+    {
+        if(index->table[slot].trigram == trigram)
+        {
+            return &index->table[slot];
+        }
+        if(index->table[slot].trigram == 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+// Find the postings for a trigram, adding an empty list for it if there isn't one
+static searchPosting* addPosting(searchIndex* index, uint32_t trigram)
+{
+    if((index->used + 1) * 4 > index->tableSize * 3)
+    {
+        // Grow the table, keeping it at most three quarters full
+        searchPosting* old = index->table;
+        size_t oldSize = index->tableSize;
+        index->tableSize = oldSize ? oldSize * 2 : 1024;
+        index->table = calloc(index->tableSize, sizeof(searchPosting));
+        for(size_t i = 0; i < oldSize; i++)
+        {
+            if(old[i].trigram != 0)
+            {
+                size_t slot = slotFor(index, old[i].trigram);
+                while(index->table[slot].trigram != 0)
+                {
+                    slot = (slot + 1) & (index->tableSize - 1);
+                }
+                index->table[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t slot = slotFor(index, trigram);
+    while(index->table[slot].trigram != 0 && index->table[slot].trigram != trigram)
+    {
+        slot = (slot + 1) & (index->tableSize - 1);
+    }
+    if(index->table[slot].trigram == 0)
+    {
+        index->table[slot].trigram = trigram;
+        index->used++;
+    }
+    return &index->table[slot];
+}
+
+// Position of the first ID in a posting list that is not less than id
+static uint32_t lowerBound(const uint32_t* ids, uint32_t count, uint32_t id)
+{
+    uint32_t low = 0, high = count;
+    while(low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if(ids[middle] < id)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void searchInit(searchIndex* index)
+{
+    memset(index, 0, sizeof(*index));
+}
+
+void searchFree(searchIndex* index)
+{
+    for(size_t i = 0; i < index->tableSize; i++)
+    {
+        free(index->table[i].ids);
+    }
+    free(index->table);
+    memset(index, 0, sizeof(*index));
+}
+
+void searchAdd(searchIndex* index, uint32_t id, const char* text)
+{
+    size_t length = strlen(text);
+    for(size_t i = 0; i + 3 <= length; i++)
+    {
+        searchPosting* posting = addPosting(index, trigramAt(text + i));
+        // New entries have the highest IDs, so they are nearly always added at the end
+        uint32_t position = posting->count > 0 && posting->ids[posting->count - 1] < id
+            ? posting->count : lowerBound(posting->ids, posting->count, id);
+        if(position < posting->count && posting->ids[position] == id)
+        {
+            continue; // the trigram occurs more than once in the entry
+        }
+        if(posting->count == posting->capacity)
+        {
+            posting->capacity = posting->capacity ? posting->capacity * 2 : 4;
+            posting->ids = realloc(posting->ids, posting->capacity * sizeof(uint32_t));
+        }
+        memmove(posting->ids + position + 1, posting->ids + position, (posting->count - position) * sizeof(uint32_t));
+        posting->ids[position] = id;
+        posting->count++;
+    }
+    if(id >= index->numIds)
+    {
+        index->numIds = id + 1;
+    }
+}
+
+void searchRemove(searchIndex* index, uint32_t id, const char* text)
+{
+    size_t length = strlen(text);
+    for(size_t i = 0; i + 3 <= length; i++)
+    {
+        // Empty lists are left in place; the trigram is likely to turn up again
+        searchPosting* posting = findPosting(index, trigramAt(text + i));
+        if(posting == NULL)
+        {
+            continue;
+        }
+        uint32_t position = lowerBound(posting->ids, posting->count, id);
+        if(position < posting->count && posting->ids[position] == id)
+        {
+            posting->count--;
+            memmove(posting->ids + position, posting->ids + position + 1, (posting->count - position) * sizeof(uint32_t));
+        }
+    }
+}
+
+int searchMatches(const char* text, const char* query)
+{
+    return strcasestr(text, query) != NULL;
+}
+
+static int comparePostings(const void* a, const void* b)
+{
+    uint32_t countA = (*(searchPosting* const*) a)->count;
+    uint32_t countB = (*(searchPosting* const*) b)->count;
+    return countA < countB ? -1 : countA > countB;
+}
+
+size_t searchQuery(searchIndex* index, const char* query, searchTextFunction getText, void* userdata, uint32_t** results)
+{
+    size_t length = strlen(query);
+    size_t numMatches = 0;
+    if(length < 3)
+    {
+        // Too short to have a trigram: check every entry
+        *results = malloc((index->numIds + 1) * sizeof(uint32_t));
+        for(uint32_t id = 0; id < index->numIds; id++)
+        {
+            const char* text = getText(id, userdata);
+            if(text != NULL && searchMatches(text, query))
+            {
+                (*results)[numMatches++] = id;
+            }
+        }
+        return numMatches;
+    }
+
+    // Look up the postings of each trigram in the query, shortest first
+    size_t numTrigrams = length - 2;
+    searchPosting** postings = malloc(numTrigrams * sizeof(searchPosting*));
+    for(size_t i = 0; i < numTrigrams; i++)
+    {
+        postings[i] = findPosting(index, trigramAt(query + i));
+        if(postings[i] == NULL || postings[i]->count == 0)
+        {
+            free(postings);
+            *results = malloc(sizeof(uint32_t));
+            return 0; // some trigram of the query is in no entry
+        }
+    }
+    qsort(postings, numTrigrams, sizeof(searchPosting*), comparePostings);
+
+    // Candidates are the entries in the shortest list that are also in all the others. The other lists
+    // are searched with binary searches that only move forwards, so long lists cost little.
+    *results = malloc(postings[0]->count * sizeof(uint32_t));
+    uint32_t* start = calloc(numTrigrams, sizeof(uint32_t));
+    for(uint32_t i = 0; i < postings[0]->count; i++)
+    {
+        uint32_t id = postings[0]->ids[i];
+        int inAll = 1;
+        for(size_t t = 1; t < numTrigrams && inAll; t++)
+        {
+            searchPosting* posting = postings[t];
+            start[t] += lowerBound(posting->ids + start[t], posting->count - start[t], id);
+            inAll = start[t] < posting->count && posting->ids[start[t]] == id;
+        }
+        if(!inAll)
+        {
+            continue;
+        }
+        // The trigrams are all in the entry, but not necessarily next to each other
+        const char* text = getText(id, userdata);
+        if(text != NULL && searchMatches(text, query))
+        {
+            (*results)[numMatches++] = id;
+        }
+    }
+    free(start);
+    free(postings);
+    return numMatches;
+}
@@ -0,0 +1,57 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Full-text search over list entries, using a trigram index: for each sequence of three bytes
+(ignoring ASCII case) that occurs in any entry, a sorted list of the IDs of the entries it occurs in.
+A query is answered by intersecting the lists for the trigrams in it, starting from the shortest,
+then checking the few entries left, so its cost depends on how many entries match rather than
+on how many there are.
+*/
+
+#ifndef TODOIST_SEARCH_H
+#define TODOIST_SEARCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The postings for one trigram
+typedef struct searchPosting
+{
+    uint32_t trigram;   // the three bytes of the trigram, with bit 24 set so that 0 marks an empty slot
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* ids;      // IDs of the entries containing the trigram, in ascending order
+} searchPosting;
+
+typedef struct searchIndex
+{
+    searchPosting* table;   // open-addressed hash table of postings
+    size_t tableSize;       // always a power of two
+    size_t used;
+    uint32_t numIds;        // one more than the highest ID added
+} searchIndex;
+
+// Function to get the text of an entry, or NULL if the entry no longer exists
+typedef const char* (*searchTextFunction)(uint32_t id, void* userdata);
+
+void searchInit(searchIndex* index);
+
+void searchFree(searchIndex* index);
+
+// Add an entry to the index
+void searchAdd(searchIndex* index, uint32_t id, const char* text);
+
+// Remove an entry from the index. text must be the text it was added with.
+// To update an entry that has been edited, remove it with its old text and add it again with the new.
+void searchRemove(searchIndex* index, uint32_t id, const char* text);
+
+// Find the entries containing query (ignoring ASCII case). getText is used to check the candidates.
+// Returns the number of matches, and sets *results to a malloc'd array of their IDs in ascending order.
+size_t searchQuery(searchIndex* index, const char* query, searchTextFunction getText, void* userdata, uint32_t** results);
+
+// Check whether text contains query, ignoring ASCII case. An empty query is contained in every text.
+int searchMatches(const char* text, const char* query);
+
+#endif
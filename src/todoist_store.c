@@ -0,0 +1,385 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe. 
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Memory-mapped storage for list entries: a snapshot plus an append-only log. See todoist_store.h.
+
+Log file layout:
+    header:  8-byte magic value, then the 64-bit count of bytes in use (header included)
+    records: one after another, each a storeRecord followed by 'length' bytes of UTF-8 text,
+             then 'metaLength' bytes of the entry's metadata
+*/
+
+#define _GNU_SOURCE // for mremap()
+#include "todoist_store.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC "TDLOG002"
+#define STORE_HEADER_SIZE 16
+#define STORE_INITIAL_SIZE (64 * 1024)
+
+// Compact when the log is at least this big, and either dead records take up more than half of it
+// or it has grown bigger than the snapshot
+#define STORE_COMPACT_MIN_SIZE (64 * 1024)
+
+// Record types
+#define RECORD_ADD 1
+#define RECORD_EDIT 2
+#define RECORD_DELETE 3
+
+typedef struct storeRecord
+{
+    uint32_t type;
+    uint32_t id;
+    uint32_t length; // length of the text that follows
+    uint32_t metaLength; // length of the metadata after the text
+} storeRecord;
+
+// Read the record header at an offset in the log (the log gives no alignment guarantees)
+static storeRecord recordAt(todoistStore* store, size_t offset)
+{
+    storeRecord record;
+    memcpy(&record, store->map + offset, sizeof(record));
+    return record;
+}
+
+static size_t recordSize(todoistStore* store, size_t offset)
+{
+    storeRecord record = recordAt(store, offset);
+    return sizeof(storeRecord) + record.length + record.metaLength;
+}
+
+// Store the number of bytes in use in the log header
+static void writeUsed(todoistStore* store)
+{
+    uint64_t used = store->used;
+    memcpy(store->map + 8, &used, sizeof(used));
+}
+
+// Make sure the index can hold an entry with the given ID
+static int reserveId(todoistStore* store, uint32_t id)
+{
+    if(id < store->capacity) 
+    {
+        return 0;
+    }
+    uint32_t capacity = store->capacity ? store->capacity : 256;
+    while(capacity <= id) 
+    {
+        capacity *= 2;
+    }
+    size_t* offsets = realloc(store->offsets, capacity * sizeof(size_t));
+    if(offsets == NULL) 
+    {
+        return -1;
+    }
+    memset(offsets + store->capacity, 0, (capacity - store->capacity) * sizeof(size_t));
+    store->offsets = offsets;
+    store->capacity = capacity;
+    return 0;
+}
+
+// Update the index for the record at an offset, counting any record it supersedes as dead
+static int indexRecord(todoistStore* store, size_t offset)
+{
+    storeRecord record = recordAt(store, offset);
+    if(reserveId(store, record.id) != 0) 
+    {
+        return -1;
+    }
+    if(store->offsets[record.id] && store->offsets[record.id] != STORE_DELETED) 
+    {
+        store->deadBytes += recordSize(store, store->offsets[record.id]);
+    }
+    if(record.type == RECORD_DELETE) 
+    {
+        // Tombstones are only needed until the next compaction
+        store->deadBytes += recordSize(store, offset);
+        store->offsets[record.id] = STORE_DELETED;
+    }
+    else 
+    {
+        store->offsets[record.id] = offset;
+    }
+    if(record.id >= store->numIds) 
+    {
+        store->numIds = record.id + 1;
+    }
+    return 0;
+}
+
+// Map the log file open on store->fd, creating the header if the file is new, and replay its records
+static int mapLog(todoistStore* store)
+{
+    struct stat info;
+    if(fstat(store->fd, &info) != 0) 
+    {
+        return -1;
+    }
+    int created = info.st_size < STORE_HEADER_SIZE;
+    store->mapSize = created ? STORE_INITIAL_SIZE : (size_t) info.st_size;
+    if(created && ftruncate(store->fd, store->mapSize) != 0) 
+    {
+        return -1;
+    }
+    store->map = mmap(NULL, store->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if(store->map == MAP_FAILED) 
+    {
+        store->map = NULL;
+        return -1;
+    }
+    if(created) 
+    {
+        memcpy(store->map, STORE_MAGIC, 8);
+        store->used = STORE_HEADER_SIZE;
+        writeUsed(store);
+    }
+    else 
+    {
+        uint64_t used;
+        memcpy(&used, store->map + 8, sizeof(used));
+        if(memcmp(store->map, STORE_MAGIC, 8) != 0 || used < STORE_HEADER_SIZE || used > store->mapSize) 
+        {
+            fprintf(stderr, "Not a valid To-doist log file: %s\n", store->path);
+            return -1;
+        }
+        store->used = used;
+    }
+
+    // Replay the log to rebuild the index
+    store->deadBytes = 0;
+    store->numIds = store->snapshot.count;
+    if(store->offsets) 
+    {
+        memset(store->offsets, 0, store->capacity * sizeof(size_t));
+    }
+    size_t offset = STORE_HEADER_SIZE;
+    while(offset + sizeof(storeRecord) <= store->used) 
+    {
+        size_t size = recordSize(store, offset);
+        if(offset + size > store->used || indexRecord(store, offset) != 0) 
+        {
+            break; // truncated record at the end of the log; ignore it
+        }
+        offset += size;
+    }
+    store->used = offset;
+    return 0;
+}
+
+int storeOpen(todoistStore* store, const char* path, const char* snapshotPath)
+{
+    memset(store, 0, sizeof(*store));
+    store->path = strdup(path);
+    store->snapshotPath = strdup(snapshotPath);
+    if(listFileOpen(&store->snapshot, snapshotPath) != 0 && errno != ENOENT)
+    {
+        store->fd = -1;
+        storeClose(store);
+        return -1;
+    }
+    store->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(store->fd < 0 || mapLog(store) != 0) 
+    {
+        storeClose(store);
+        return -1;
+    }
+    return 0;
+}
+
+void storeClose(todoistStore* store)
+{
+    if(store->map) 
+    {
+        msync(store->map, store->used, MS_SYNC);
+        munmap(store->map, store->mapSize);
+    }
+    if(store->fd >= 0) 
+    {
+        close(store->fd);
+    }
+    listFileClose(&store->snapshot);
+    free(store->offsets);
+    free(store->path);
+    free(store->snapshotPath);
+    memset(store, 0, sizeof(*store));
+    store->fd = -1;
+}
+
+// Append a record to the log, growing the file if needed. Returns 0 on success, -1 on error.
+static int appendRecord(todoistStore* store, uint32_t type, uint32_t id, const char* text, size_t length,
+    const void* meta, size_t metaLength)
+{
+    size_t size = sizeof(storeRecord) + length + metaLength;
+    if(store->map == NULL) 
+    {
+        return -1; // the log could not be mapped again after compacting it
+    }
+    if(store->used + size > store->mapSize) 
+    {
+        size_t newSize = store->mapSize * 2;
+        while(newSize < store->used + size) 
+        {
+            newSize *= 2;
+        }
+        if(ftruncate(store->fd, newSize) != 0) 
+        {
+            return -1;
+        }
+        char* map = mremap(store->map, store->mapSize, newSize, MREMAP_MAYMOVE);
+        if(map == MAP_FAILED) 
+        {
+            return -1;
+        }
+        store->map = map;
+        store->mapSize = newSize;
+    }
+
+    storeRecord record = { type, id, (uint32_t) length, (uint32_t) metaLength };
+    memcpy(store->map + store->used, &record, sizeof(record));
+    memcpy(store->map + store->used + sizeof(record), text, length);
+    if(metaLength > 0)
+    {
+        memcpy(store->map + store->used + sizeof(record) + length, meta, metaLength);
+    }
+    size_t offset = store->used;
+    store->used += size;
+    writeUsed(store); // the record only becomes part of the log once the header counts it
+    return indexRecord(store, offset);
+}
+
+int storePut(todoistStore* store, uint32_t id, const char* text, size_t length, const void* meta, size_t metaLength)
+{
+    size_t oldLength;
+    if(id == STORE_NO_ID) 
+    {
+        return -1;
+    }
+    int type = storeText(store, id, &oldLength) ? RECORD_EDIT : RECORD_ADD;
+    return appendRecord(store, type, id, text, length, meta, metaLength);
+}
+
+int storeDelete(todoistStore* store, uint32_t id)
+{
+    size_t length;
+    if(storeText(store, id, &length) == NULL) 
+    {
+        return -1;
+    }
+    return appendRecord(store, RECORD_DELETE, id, NULL, 0, NULL, 0);
+}
+
+const char* storeText(todoistStore* store, uint32_t id, size_t* length)
+{
+    size_t offset = id < store->capacity ? store->offsets[id] : 0;
+    if(id >= store->numIds || offset == STORE_DELETED) 
+    {
+        return NULL;
+    }
+    if(offset == 0) 
+    {
+        // Unchanged since the snapshot (or never existed, in which case the snapshot has no such slot)
+        return listFileText(&store->snapshot, id, length);
+    }
+    *length = recordAt(store, offset).length;
+    return store->map + offset + sizeof(storeRecord);
+}
+
+const void* storeMeta(todoistStore* store, uint32_t id, size_t* length)
+{
+    size_t offset = id < store->capacity ? store->offsets[id] : 0;
+    if(id >= store->numIds || offset == STORE_DELETED) 
+    {
+        return NULL;
+    }
+    if(offset == 0) 
+    {
+        return listFileMeta(&store->snapshot, id, length);
+    }
+    storeRecord record = recordAt(store, offset);
+    if(record.metaLength == 0) 
+    {
+        return NULL;
+    }
+    *length = record.metaLength;
+    return store->map + offset + sizeof(storeRecord) + record.length;
+}
+
+int storeSync(todoistStore* store)
+{
+    if(store->map == NULL) 
+    {
+        return -1;
+    }
+    return msync(store->map, store->used, MS_SYNC);
+}
+
+int storeShouldCompact(todoistStore* store)
+{
+    return store->used >= STORE_COMPACT_MIN_SIZE
+        && (store->deadBytes * 2 > store->used || store->used > store->snapshot.size);
+}
+
+int storeCompact(todoistStore* store)
+{
+    // Write the latest text and metadata of every entry into a new snapshot, which replaces the old one atomically
+    listFileEntry* entries = calloc(store->numIds ? store->numIds : 1, sizeof(listFileEntry));
+    if(entries == NULL) 
+    {
+        return -1;
+    }
+    for(uint32_t id = 0; id < store->numIds; id++) 
+    {
+        size_t length;
+        entries[id].text = storeText(store, id, &length);
+        entries[id].length = entries[id].text ? (uint32_t) length : 0;
+        entries[id].meta = entries[id].text ? storeMeta(store, id, &length) : NULL;
+        entries[id].metaLength = entries[id].meta ? (uint32_t) length : 0;
+    }
+    int failed = listFileWrite(store->snapshotPath, entries, store->numIds);
+    free(entries);
+    if(failed) 
+    {
+        return -1;
+    }
+
+    // Switch over to the new snapshot. If this fails the app carries on with the log as it is;
+    // the next time the store is opened the log is replayed over the new snapshot, which gives the same result.
+    listFile snapshot;
+    if(listFileOpen(&snapshot, store->snapshotPath) != 0) 
+    {
+        return -1;
+    }
+    listFileClose(&store->snapshot);
+    store->snapshot = snapshot;
+
+    // Everything in the log is now in the snapshot, so empty it
+    store->used = STORE_HEADER_SIZE;
+    store->deadBytes = 0;
+    writeUsed(store);
+    memset(store->offsets, 0, store->capacity * sizeof(size_t));
+    if(store->mapSize > STORE_INITIAL_SIZE) 
+    {
+        // Give back the space the log had grown to
+        munmap(store->map, store->mapSize);
+        if(ftruncate(store->fd, STORE_INITIAL_SIZE) == 0) 
+        {
+            store->mapSize = STORE_INITIAL_SIZE;
+        }
+        store->map = mmap(NULL, store->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+        if(store->map == MAP_FAILED) 
+        {
+            store->map = NULL;
+            return -1;
+        }
+    }
+    return storeSync(store);
+}
@@ -0,0 +1,81 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe. 
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Storage backend for list entries: a snapshot of the list in the indexed list file format
+(see todoist_list.h), plus an append-only log of the changes made since the snapshot was taken,
+both memory-mapped from disk.
+Adding, editing or deleting an entry appends one small record to the end of the log,
+so saving costs time proportional to what changed rather than to the size of the list.
+Deleted and superseded records stay in the log as dead space until the log is compacted,
+which writes a new snapshot and empties the log.
+Entry IDs are the entries' slots in the snapshot, so an entry can be looked up in either
+without reading any of the others.
+*/
+
+#ifndef TODOIST_STORE_H
+#define TODOIST_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "todoist_list.h"
+
+// Value used for an entry that does not (yet) have an ID in the store
+#define STORE_NO_ID UINT32_MAX
+
+// Value in the index for an entry deleted since the snapshot
+#define STORE_DELETED SIZE_MAX
+
+typedef struct todoistStore
+{
+    listFile snapshot;  // the list as it was when the log was last compacted
+    char* snapshotPath; // path of the snapshot, needed to compact the log
+    int fd;             // file descriptor of the log file
+    char* path;         // path of the log file
+    char* map;          // memory-mapped contents of the log file
+    size_t mapSize;     // size of the mapping (the file is grown in large steps)
+    size_t used;        // number of bytes of the log that hold records
+    size_t deadBytes;   // bytes taken up by records that have been superseded or deleted
+
+    // Index from entry ID to the offset of the entry's latest record in the log, 0 if the entry
+    // hasn't changed since the snapshot, or STORE_DELETED if it has been deleted since
+    size_t* offsets;
+    uint32_t numIds;    // IDs handed out so far
+    uint32_t capacity;  // allocated length of offsets
+} todoistStore;
+
+// Open the snapshot at snapshotPath (if there is one), open or create the log at path,
+// and rebuild the index by replaying the log. Returns 0 on success, -1 on error.
+int storeOpen(todoistStore* store, const char* path, const char* snapshotPath);
+
+// Flush and close the log
+void storeClose(todoistStore* store);
+
+// Set the text and metadata (which may be NULL) of the entry with a given ID, adding the entry if there isn't one
+// with that ID. IDs are chosen by the caller, starting from numIds when the store is opened.
+// Returns 0 on success, -1 on error.
+int storePut(todoistStore* store, uint32_t id, const char* text, size_t length, const void* meta, size_t metaLength);
+
+// Delete an entry by appending a tombstone record. Returns 0 on success, -1 on error.
+int storeDelete(todoistStore* store, uint32_t id);
+
+// Get the text of an entry, or null if there is no such entry. The pointer is into the mapped log
+// or snapshot, and is only valid until the next call that modifies the store.
+const char* storeText(todoistStore* store, uint32_t id, size_t* length);
+
+// Get the metadata of an entry, or null if there is no such entry or it has no metadata.
+// Valid for as long as the pointer returned by storeText() is.
+const void* storeMeta(todoistStore* store, uint32_t id, size_t* length);
+
+// Write outstanding changes to disk. Returns 0 on success, -1 on error.
+int storeSync(todoistStore* store);
+
+// Write a new snapshot holding the latest text and metadata of each live entry, keeping entry IDs, then empty the log.
+// Returns 0 on success, -1 on error (in which case the old snapshot and log are left in place).
+int storeCompact(todoistStore* store);
+
+// True when enough of the log is dead space that compacting it is worthwhile
+int storeShouldCompact(todoistStore* store);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Style manager. See todoist_style.h.
+*/
+
+#include "todoist_style.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+// One declaration of a set, as it is being put into canonical form
+typedef struct styleDeclaration
+{
+    const char* property;
+    size_t propertyLength;
+    const char* value;
+    size_t valueLength;
+    size_t position;    // position in the set, so that of two declarations of a property, the last one wins
+} styleDeclaration;
+
+static int compareDeclarations(const void* a, const void* b)
+{
+    const styleDeclaration* first = a;
+    const styleDeclaration* second = b;
+    size_t length = first->propertyLength < second->propertyLength ? first->propertyLength : second->propertyLength;
+    int order = strncmp(first->property, second->property, length);
+    if(order == 0 && first->propertyLength != second->propertyLength)
+    {
+        order = first->propertyLength < second->propertyLength ? -1 : 1;
+    }
+    if(order == 0)
+    {
+        order = first->position < second->position ? -1 : 1;
+    }
+    return order;
+}
+
+// Skip whitespace either side of text[start..end), returning its new start and updating end
+static size_t trim(const char* text, size_t start, size_t* end)
+{
+    while(start < *end && isspace((unsigned char) text[start]))
+    {
+        start++;
+    }
+    while(*end > start && isspace((unsigned char) text[*end - 1]))
+    {
+        (*end)--;
+    }
+    return start;
+}
+
+// Put a set of declarations into canonical form, so that sets that only differ in spacing and
+// order have the same form: each declaration as "property:value;", sorted by property.
+// Returns the canonical form, to be freed by the caller.
+static char* canonicalDeclarations(const char* declarations)
+{
+    size_t length = strlen(declarations);
+    styleDeclaration* parsed = malloc((length / 2 + 1) * sizeof(styleDeclaration)); // each takes at least "a:" or ";"
+    size_t count = 0;
+    size_t start = 0;
+    while(start < length)
+    {
+        size_t end = start;
+        while(end < length && declarations[end] != ';')
+        {
+            end++;
+        }
+        const char* colon = memchr(declarations + start, ':', end - start);
+        if(colon != NULL)
+        {
+            size_t propertyEnd = colon - declarations;
+            size_t valueEnd = end;
+            size_t valueStart = trim(declarations, propertyEnd + 1, &valueEnd);
+            size_t propertyStart = trim(declarations, start, &propertyEnd);
+            styleDeclaration declaration;
+            declaration.property = declarations + propertyStart;
+            declaration.propertyLength = propertyEnd - propertyStart;
+            declaration.value = declarations + valueStart;
+            declaration.valueLength = valueEnd - valueStart;
+            declaration.position = count;
+            if(declaration.propertyLength > 0)
+            {
+                parsed[count++] = declaration;
+            }
+        }
+        start = end + 1;
+    }
+    qsort(parsed, count, sizeof(styleDeclaration), compareDeclarations);
+
+    char* canonical = malloc(length + count * 2 + 1);
+    size_t position = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(i + 1 < count && parsed[i + 1].propertyLength == parsed[i].propertyLength
+            && strncmp(parsed[i + 1].property, parsed[i].property, parsed[i].propertyLength) == 0)
+        {
+            continue; // declared again later in the set
+        }
+        memcpy(canonical + position, parsed[i].property, parsed[i].propertyLength);
+        position += parsed[i].propertyLength;
+        canonical[position++] = ':';
+        memcpy(canonical + position, parsed[i].value, parsed[i].valueLength);
+        position += parsed[i].valueLength;
+        canonical[position++] = ';';
+    }
+    canonical[position] = '\0';
+    free(parsed);
+    return canonical;
+}
+
+// FNV-1a hash of a string
+static uint64_t fingerprint(const char* text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for(; *text != '\0'; text++)
+    {
+        hash = (hash ^ (unsigned char) *text) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static size_t slotFor(const styleManager* styles, hipe_loc loc)
+{
+    uint64_t hash = (uint64_t) loc * 11400714819323198485ull; // Fibonacci hashing
+    return (size_t) (hash >> 32) & (styles->tableSize - 1);
+}
+
+// Find the slot for an element, or NULL if no properties have been set on it
+static styleElement* findElement(const styleManager* styles, hipe_loc loc)
+{
+    if(styles->tableSize == 0)
+    {
+        return NULL;
+    }
+    for(size_t slot = slotFor(styles, loc); ; slot = (slot + 1) & (styles->tableSize - 1))
+    {
+        if(styles->table[slot].loc == loc)
+        {
+            return &styles->table[slot];
+        }
+        if(styles->table[slot].loc == 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+// Find the slot for an element, adding it if there isn't one
+static styleElement* addElement(styleManager* styles, hipe_loc loc)
+{
+    if((styles->used + 1) * 4 > styles->tableSize * 3)
+    {
+        // Grow the table, keeping it at most three quarters full
+        styleElement* old = styles->table;
+        size_t oldSize = styles->tableSize;
+        styles->tableSize = oldSize ? oldSize * 2 : 256;
+        styles->table = calloc(styles->tableSize, sizeof(styleElement));
+        for(size_t i = 0; i < oldSize; i++)
+        {
+            if(old[i].loc != 0)
+            {
+                size_t slot = slotFor(styles, old[i].loc);
+                while(styles->table[slot].loc != 0)
+                {
+                    slot = (slot + 1) & (styles->tableSize - 1);
+                }
+                styles->table[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t slot = slotFor(styles, loc);
+    while(styles->table[slot].loc != 0 && styles->table[slot].loc != loc)
+    {
+        slot = (slot + 1) & (styles->tableSize - 1);
+    }
+    if(styles->table[slot].loc == 0)
+    {
+        styles->table[slot].loc = loc;
+        styles->used++;
+    }
+    return &styles->table[slot];
+}
+
+void styleInit(styleManager* styles, hipe_session session)
+{
+    memset(styles, 0, sizeof(*styles));
+    styles->session = session;
+}
+
+void styleApply(styleManager* styles, hipe_loc loc, const char* declarations)
+{
+    char* canonical = canonicalDeclarations(declarations);
+    uint64_t hash = fingerprint(canonical);
+    styleRule* set = NULL;
+    for(size_t i = 0; i < styles->numSets && set == NULL; i++)
+    {
+        if(styles->sets[i].fingerprint == hash && strcmp(styles->sets[i].declarations, canonical) == 0)
+        {
+            set = &styles->sets[i];
+        }
+    }
+    if(set == NULL)
+    {
+        // First time this set has been seen: make a class for it
+        if(styles->numSets == styles->setsCapacity)
+        {
+            styles->setsCapacity = styles->setsCapacity ? styles->setsCapacity * 2 : 8;
+            styles->sets = realloc(styles->sets, styles->setsCapacity * sizeof(styleRule));
+        }
+        set = &styles->sets[styles->numSets];
+        set->fingerprint = hash;
+        set->declarations = canonical;
+        canonical = NULL;
+        snprintf(set->className, sizeof(set->className), "todoistStyle%zu", styles->numSets);
+        styles->numSets++;
+
+        char selector[STYLE_CLASS_SIZE + 1];
+        snprintf(selector, sizeof(selector), ".%s", set->className);
+        hipe_send(styles->session, HIPE_OP_ADD_STYLE_RULE, 0, 0, 2, selector, set->declarations);
+    }
+    free(canonical);
+    hipe_send(styles->session, HIPE_OP_SET_ATTRIBUTE, 0, loc, 2, "class", set->className);
+}
+
+void styleSet(styleManager* styles, hipe_loc loc, const char* property, const char* value)
+{
+    if(loc == 0)
+    {
+        // The body can't be told apart from an empty slot, so its properties aren't remembered
+        hipe_send(styles->session, HIPE_OP_SET_STYLE, 0, loc, 2, property, value);
+        return;
+    }
+    styleElement* element = addElement(styles, loc);
+    styleValue* last = element->values;
+    while(last != NULL && strcmp(last->property, property) != 0)
+    {
+        last = last->next;
+    }
+    if(last != NULL && strcmp(last->value, value) == 0)
+    {
+        return; // already set to this value
+    }
+    if(last == NULL)
+    {
+        last = malloc(sizeof(styleValue));
+        last->property = strdup(property);
+        last->next = element->values;
+        element->values = last;
+    }
+    else
+    {
+        free(last->value);
+    }
+    last->value = strdup(value);
+    hipe_send(styles->session, HIPE_OP_SET_STYLE, 0, loc, 2, property, value);
+}
+
+static void freeValues(styleValue* values)
+{
+    while(values != NULL)
+    {
+        styleValue* next = values->next;
+        free(values->property);
+        free(values->value);
+        free(values);
+        values = next;
+    }
+}
+
+void styleForget(styleManager* styles, hipe_loc loc)
+{
+    styleElement* element = loc != 0 ? findElement(styles, loc) : NULL;
+    if(element == NULL)
+    {
+        return;
+    }
+    freeValues(element->values);
+    // Empty the slot, moving later elements in its run back so none of them are cut off from their own slot
+    size_t mask = styles->tableSize - 1;
+    size_t empty = element - styles->table;
+    for(size_t slot = (empty + 1) & mask; styles->table[slot].loc != 0; slot = (slot + 1) & mask)
+    {
+        size_t home = slotFor(styles, styles->table[slot].loc);
+        bool canMove = empty <= slot ? (home <= empty || home > slot) : (home <= empty && home > slot);
+        if(canMove)
+        {
+            styles->table[empty] = styles->table[slot];
+            empty = slot;
+        }
+    }
+    styles->table[empty].loc = 0;
+    styles->table[empty].values = NULL;
+    styles->used--;
+}
+
+void styleFree(styleManager* styles)
+{
+    for(size_t i = 0; i < styles->tableSize; i++)
+    {
+        freeValues(styles->table[i].values);
+    }
+    for(size_t i = 0; i < styles->numSets; i++)
+    {
+        free(styles->sets[i].declarations);
+    }
+    free(styles->table);
+    free(styles->sets);
+    memset(styles, 0, sizeof(*styles));
+}
@@ -0,0 +1,72 @@
+/*
+TO-DOIST - A To-do list program implemented using Hipe.
+An FIT3162 Project - Semester 2, 2021.
+Team 23
+
+Style manager: keeps the styles sent to the server down to the ones that change something.
+Elements that are all styled the same way (e.g. every entry's div, or every entry's buttons) are
+given a shared class instead of the same inline styles each. Each distinct set of declarations is
+fingerprinted, and the first time it is seen it is sent as one style rule for a class made for it;
+after that, styling an element with it is one SET_ATTRIBUTE giving the element that class.
+Single properties set on an element are remembered, so setting a property to the value it already
+has sends nothing.
+*/
+
+#ifndef TODOIST_STYLE_H
+#define TODOIST_STYLE_H
+
+#include <hipe.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STYLE_CLASS_SIZE 32 // longest class name made for a style set, including the terminator
+
+// A distinct set of declarations, and the class made for it
+typedef struct styleRule
+{
+    uint64_t fingerprint;   // hash of the declarations, in canonical form
+    char* declarations;     // the declarations in canonical form: "property:value;" sorted by property
+    char className[STYLE_CLASS_SIZE];
+} styleRule;
+
+// The value a property was last set to on an element
+typedef struct styleValue
+{
+    char* property;
+    char* value;
+    struct styleValue* next;
+} styleValue;
+
+// The properties set on one element
+typedef struct styleElement
+{
+    hipe_loc loc;           // 0 marks an empty slot
+    styleValue* values;
+} styleElement;
+
+typedef struct styleManager
+{
+    hipe_session session;
+    styleRule* sets;        // the distinct sets of declarations seen, each with its class
+    size_t numSets;
+    size_t setsCapacity;
+    styleElement* table;    // open-addressed hash table of the elements properties have been set on
+    size_t tableSize;       // always a power of two
+    size_t used;
+} styleManager;
+
+void styleInit(styleManager* styles, hipe_session session);
+
+// Style an element with a set of declarations, written as in a style attribute (e.g. "float: right; font-family: impact").
+// The element is given the class for the set, replacing any class it had.
+void styleApply(styleManager* styles, hipe_loc loc, const char* declarations);
+
+// Set a property of an element, unless it was last set to the same value
+void styleSet(styleManager* styles, hipe_loc loc, const char* property, const char* value);
+
+// Forget the properties set on an element, once it has been deleted (its location may be given to another)
+void styleForget(styleManager* styles, hipe_loc loc);
+
+void styleFree(styleManager* styles);
+
+#endif
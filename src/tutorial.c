@@ -9,8 +9,19 @@ Team 23
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include "todoist_store.h"
+#include "todoist_journal.h"
+#include "todoist_import.h"
+#include "todoist_search.h"
+#include "todoist_order.h"
+#include "todoist_layout.h"
+#include "todoist_style.h"
 
 // Importing an external variable for error handling
 extern int errno;
@@ -21,41 +32,199 @@ extern int errno;
 #define NEW_LIST_EDIT_EVENT 3
 #define EXPORT_TO_FILE_EVENT 4
 #define LOAD_FROM_FILE_EVENT 5
+#define SHOW_MORE_EVENT 6
+#define SEARCH_EVENT 7
+#define SORT_EVENT 8
+#define SELECT_MODE_EVENT 9
+#define SELECT_ALL_EVENT 10
+#define SELECT_COMPLETED_EVENT 11
+#define COMPLETE_SELECTED_EVENT 12
+#define MOVE_SELECTED_EVENT 13
+#define DELETE_SELECTED_EVENT 14
+#define NEW_LIST_SELECT_EVENT 15
 
-// define value for maximum number of entries to be saved to file
-#define MAX_NUM_ENTRIES_IN_FILE 1000
+// Requestor values for the buttons of each entry are made from the entry's index and the event type,
+// so the dispatcher can route a button press straight to the entry it belongs to, and the handler can
+// get the entry's index back from the requestor
+#define ENTRY_REQUESTOR(index, event) ((((uint64_t) (index) + 1) << 8) | (event))
+#define ENTRY_INDEX(requestor) ((size_t) ((requestor) >> 8) - 1)
+
+// Files that the list is saved to and loaded from
+#define SNAPSHOT_FILE "output_list.tdl"  // indexed list file holding the list as of the last compaction
+#define STORE_FILE "output_list.db"  // append-only log of the changes made since then
+#define JOURNAL_FILE "output_list.journal"  // journal of the changes made since the last export
+#define TEXT_FILE "output_list.txt"  // older, newline-separated format, imported if there is nothing in the store
+
+// Lists are loaded progressively, a little in between each turn of the event loop, so the app stays responsive
+#define RENDER_BATCH_SIZE 25 // entries displayed per turn
+#define LIST_WINDOW_SIZE 100 // entries displayed before waiting for the user to ask for more
+
+// Changes to the text and styles of elements are sent to the server once per frame of this many milliseconds
+// (see hipe_set_frame_interval()), so a burst of changes to the list is laid out once
+#define FRAME_INTERVAL 16
+
+// Environment variable naming a file to write a timeline of the session to, for finding where the time goes
+// (see hipe_trace_start())
+#define TRACE_FILE_VARIABLE "TODOIST_TRACE"
+
+// Once the journal has grown this big, the list is exported in the background, which lets the journal start again
+#define JOURNAL_CHECKPOINT_SIZE (1024 * 1024)
+
+// Style of the delete and edit buttons of every entry
+#define ENTRY_BUTTON_STYLE "font-family: impact; float: right"
+
+// Flags for each entry in the list
+#define ENTRY_DIRTY 1   // the entry has changed since it was last saved
+#define ENTRY_HIDDEN 2  // the entry is displayed, but hidden because it doesn't match the search
+#define ENTRY_SELECTED 4    // the entry is selected, for a bulk operation
+#define ENTRY_COMPLETED 8   // the entry has been marked as completed
+#define ENTRY_ORDERED 16    // the entry's sort key is saved with it (once the user has moved entries by hand)
+
+// Flags that are saved with an entry, rather than only lasting for the session
+#define ENTRY_SAVED_FLAGS (ENTRY_COMPLETED | ENTRY_ORDERED)
+
+// Metadata saved with each entry, as the meta of its record in the store and the journal (see todoist_list.h)
+typedef struct entryMeta
+{
+    uint32_t flags;     // the entry's ENTRY_SAVED_FLAGS
+    int32_t order;      // the entry's sort key, if it has ENTRY_ORDERED
+} entryMeta;
+
+// The entries in the list, in the order they were added, each identified by its index.
+// The model is the authoritative copy of the list: the DOM only displays it, so the app never
+// needs to ask the server for an entry's text or locations. It is kept as one array per field,
+// so going through one field of every entry (e.g. to filter the list) only touches that field.
+typedef struct listModel
+{
+    size_t count;       // number of entries, including deleted ones
+    size_t capacity;    // allocated length of each array
+    char** texts;       // text of each entry, or NULL once the entry has been deleted
+    hipe_loc* divLocs;  // location of the div holding each entry, or 0 if it isn't displayed yet
+    hipe_loc* textLocs; // location of the p tag holding each entry's text
+    uint32_t* storeIds; // ID of each entry in the store (given to it when it is created, before it is saved)
+    int32_t* orders;    // sort key of each displayed entry, which its div's CSS 'order' property is set to
+    uint8_t* flags;     // ENTRY_DIRTY and ENTRY_HIDDEN flags of each entry
+} listModel;
+
+// Orders that the list can be sorted in
+typedef enum sortMode
+{
+    SORT_ADDED, // the order the entries were added in
+    SORT_TEXT,  // alphabetical order of the entries' text, ignoring case
+    SORT_MANUAL // the order the user has moved the entries into
+} sortMode;
+
+// State of a list that is being loaded
+typedef struct listLoader
+{
+    bool active;            // true while there is loading to do in between events
+    todoistImport* import;  // pipeline reading and parsing text files, or NULL
+    bool fromStore;         // true if entries are being read from the store
+    uint32_t nextStoreId;   // ID of the next entry to read from the store
+    char* inList;           // flags for the store IDs of entries already in the list, so they aren't loaded twice
+    uint32_t inListSize;
+    size_t nextToRender;    // index of the first entry in the model that may not be displayed yet
+    int windowLeft;         // entries still to be displayed before waiting for the user to ask for more
+    hipe_loc showMoreButton; // location of the button that displays more entries, or 0 if it isn't shown
+    int numLoaded;          // number of entries loaded so far
+    bool reported;          // true once the user has been told the list has loaded
+} listLoader;
+
+// A change to be saved, as captured when an export starts
+typedef struct exportChange
+{
+    size_t index;       // index of the entry in the model
+    uint32_t storeId;   // ID of the entry in the store (filled in by the export for new entries)
+    const char* text;   // text of the entry when the export started, or NULL if it had been deleted
+    entryMeta meta;     // metadata of the entry when the export started
+    bool saved;         // set by the export once the change is in the store
+} exportChange;
+
+// State of the export running in the background, if any
+// While it runs, the worker thread has the store to itself, and the event loop carries on as normal.
+typedef struct exportJob
+{
+    bool running;
+    bool again;             // true if the user asked to export again while this export was running
+    pthread_t thread;
+    bool threaded;          // false if the export had to run on the main thread
+    int pipe[2];            // the worker writes a byte to pipe[1] when it has finished
+    exportChange* changes;  // snapshot of the changes being saved
+    size_t numChanges;
+    char** retired;         // entry texts replaced or deleted while the export was running
+    size_t numRetired;
+    size_t retiredCapacity;
+    bool failed;
+    int errnum;             // errno value for the failure, if the export failed
+    bool rotated;           // true if the journal was rotated when the export started
+    bool quiet;             // true if the export was started automatically, so the user isn't told about it
+} exportJob;
 
 // Defining global variables to be used in program
 int counter; // Used to append to div ID, giving each 'note' div a unique ID 
 hipe_session session; // The primary hipe session that the program runs on
-char* listEntries[MAX_NUM_ENTRIES_IN_FILE]; // array that stores all entries, used to write/load from file
+hipe_dispatcher dispatcher; // Routes incoming events to their event-handlers
+listModel entries; // all entries in the list
+size_t* dirtyEntries; // indexes of entries changed since the last save, so saving only touches those
+size_t numDirtyEntries;
+size_t dirtyEntriesCapacity;
+todoistStore store; // storage backend that the list is saved to
+bool store_opened; // boolean to check if the store has been opened
+uint32_t nextStoreId; // store ID to give the next new entry
+todoistJournal journal; // journal that each change is written to as it is made
+bool journal_opened; // boolean to check if the journal has been opened
 bool loaded_already; // boolean to check if user has loaded from a file already during current session
+const char** importPaths; // text files to load the list from when there is nothing in the store
+int numImportPaths;
+listLoader loader; // progress of the list currently being loaded, if any
+exportJob exporting; // the export running in the background, if any
+searchIndex search; // index of the text of the entries in the model, by index
+char* searchText; // text typed in the search box, or NULL if it is empty
+hipe_loc searchBox; // location of the search box
+hipe_loc listDiv; // location of the div that the entries are displayed in
+sortMode sorting; // order that the list is displayed in
+int32_t lastOrder; // sort key of the entry displayed last, in the order the entries were added
+bool orderSaved; // true once the entries' sort keys are saved with them, because the user has moved entries by hand
+hipe_loc sortButton; // location of the button that changes the order
+bool selecting; // true while the list is in multi-select mode, where clicking an entry selects it
+size_t numSelected; // number of entries selected
+hipe_loc selectButton; // location of the button that turns multi-select mode on and off
+hipe_loc bulkDiv; // location of the div holding the buttons for bulk operations, shown in multi-select mode
+styleManager styles; // shares classes between elements styled the same way, and drops styles that change nothing
 
 // Function to initialise all global variables to default values
 void init()
 {
     counter = 1;
     loaded_already = false;
-    clearEntriesList(); // Calling auxiliary function to initialise the array
+    store_opened = false;
+    journal_opened = false;
+    nextStoreId = 0;
+    memset(&entries, 0, sizeof(entries));
+    dirtyEntries = NULL;
+    numDirtyEntries = 0;
+    dirtyEntriesCapacity = 0;
+    memset(&loader, 0, sizeof(loader));
+    memset(&exporting, 0, sizeof(exporting));
+    exporting.pipe[0] = exporting.pipe[1] = -1;
+    searchInit(&search);
+    searchText = NULL;
+    sorting = SORT_ADDED;
+    lastOrder = 0;
+    orderSaved = false;
+    selecting = false;
+    numSelected = 0;
 }
 
+// Size of the buffers that element IDs are formatted into: room for the longest prefix plus any int
+#define ELEMENT_ID_SIZE 32
 
-// Function to initialise the array storing all the list entries
-void clearEntriesList() 
-{
-    for(int i = 0; i < MAX_NUM_ENTRIES_IN_FILE; i++) 
-    {
-        listEntries[i] = "\0";
-    }
-}
-
-// Utility function to concatenate two strings and return the result
-char* concat(const char *s1, const char *s2)
+// Utility function to make the ID of an element from a prefix and a number (e.g. "entryDivID12"),
+// formatted into a buffer given by the caller - normally on the stack, so no memory is allocated for it
+char* elementId(char* buffer, const char* prefix, int number)
 {
-    char *result = malloc(strlen(s1) + strlen(s2) + 1); // +1 for the null-terminator
-    strcpy(result, s1);
-    strcat(result, s2);
-    return result;
+    snprintf(buffer, ELEMENT_ID_SIZE, "%s%d", prefix, number);
+    return buffer;
 }
 
 // Function to get the hipe_location of an element by its ID
@@ -75,6 +244,310 @@ void displaySimpleDialog(char* title, char* dialogText)
     hipe_send(session, HIPE_OP_DIALOG, 0, 0, 2, title, dialogText);
 }
 
+// Function to record that an entry has changed since the list was last saved
+void markDirty(size_t index)
+{
+    if(entries.flags[index] & ENTRY_DIRTY)
+    {
+        return; // already recorded
+    }
+    if(numDirtyEntries == dirtyEntriesCapacity)
+    {
+        dirtyEntriesCapacity = dirtyEntriesCapacity ? dirtyEntriesCapacity * 2 : 64;
+        dirtyEntries = realloc(dirtyEntries, dirtyEntriesCapacity * sizeof(size_t));
+    }
+    dirtyEntries[numDirtyEntries++] = index;
+    entries.flags[index] |= ENTRY_DIRTY;
+}
+
+// Function to free the text of an entry that has been replaced or deleted
+// The text may be part of the snapshot being saved by an export, so it isn't freed until the export finishes.
+// (The model never changes a text in place; an edit replaces it with a new copy. So a snapshot
+// only needs to hold on to the texts, rather than copy them.)
+void releaseText(char* text)
+{
+    if(!exporting.running)
+    {
+        free(text);
+        return;
+    }
+    if(exporting.numRetired == exporting.retiredCapacity)
+    {
+        exporting.retiredCapacity = exporting.retiredCapacity ? exporting.retiredCapacity * 2 : 16;
+        exporting.retired = realloc(exporting.retired, exporting.retiredCapacity * sizeof(char*));
+    }
+    exporting.retired[exporting.numRetired++] = text;
+}
+
+// Function to get the metadata to save with an entry
+entryMeta entryMetaOf(size_t index)
+{
+    entryMeta meta = { entries.flags[index] & ENTRY_SAVED_FLAGS, 0 };
+    if(entries.flags[index] & ENTRY_ORDERED)
+    {
+        meta.order = entries.orders[index];
+    }
+    return meta;
+}
+
+// Function to record a change to an entry (added, edited, deleted, completed or moved): the change is written
+// to the journal straight away, and the entry is saved in the store by the next export
+void recordChange(size_t index)
+{
+    if(journal_opened)
+    {
+        if(entries.texts[index] == NULL)
+        {
+            journalDelete(&journal, entries.storeIds[index]);
+        }
+        else
+        {
+            entryMeta meta = entryMetaOf(index);
+            journalPut(&journal, entries.storeIds[index], entries.texts[index], strlen(entries.texts[index]),
+                &meta, sizeof(meta));
+        }
+    }
+    markDirty(index);
+}
+
+// Function to commit the journal records of a batch of changes together, with a single write
+void commitChanges()
+{
+    if(journal_opened && journalCommit(&journal) != 0)
+    {
+        perror("Error writing " JOURNAL_FILE);
+    }
+}
+
+// Function to add an entry to the list model, taking ownership of its text (which must be allocated
+// with malloc). Returns the index of the new entry.
+// storeId is the entry's ID in the store if it was loaded from there, otherwise STORE_NO_ID
+// for a new entry, which is then given an ID and recorded as a change.
+size_t adoptEntry(char* text, uint32_t storeId)
+{
+    if(entries.count == entries.capacity)
+    {
+        entries.capacity = entries.capacity ? entries.capacity * 2 : 64;
+        entries.texts = realloc(entries.texts, entries.capacity * sizeof(char*));
+        entries.divLocs = realloc(entries.divLocs, entries.capacity * sizeof(hipe_loc));
+        entries.textLocs = realloc(entries.textLocs, entries.capacity * sizeof(hipe_loc));
+        entries.storeIds = realloc(entries.storeIds, entries.capacity * sizeof(uint32_t));
+        entries.orders = realloc(entries.orders, entries.capacity * sizeof(int32_t));
+        entries.flags = realloc(entries.flags, entries.capacity * sizeof(uint8_t));
+    }
+    size_t index = entries.count++;
+    entries.texts[index] = text;
+    entries.divLocs[index] = 0;
+    entries.textLocs[index] = 0;
+    entries.storeIds[index] = storeId;
+    entries.orders[index] = 0;
+    entries.flags[index] = 0;
+    searchAdd(&search, index, text);
+    if(storeId == STORE_NO_ID)
+    {
+        entries.storeIds[index] = nextStoreId++;
+        recordChange(index); // a new entry needs to be saved
+    }
+    return index;
+}
+
+// Function to add an entry to the list model, with a copy of its text. Returns the index of the new entry.
+size_t addEntryToModel(const char* text, size_t length, uint32_t storeId)
+{
+    return adoptEntry(strndup(text, length), storeId);
+}
+
+// Forward declarations of the event-handlers for the buttons of each entry
+void deleteListEntry(hipe_session session, hipe_instruction* event, void* userdata);
+void editListEntry(hipe_session session, hipe_instruction* event, void* userdata);
+void selectListEntry(hipe_session session, hipe_instruction* event, void* userdata);
+
+// Comparison function for qsort(), putting entry indexes in the current sort order
+// Entries that compare equal are kept in the order they were added
+int compareEntries(const void* a, const void* b)
+{
+    size_t indexA = *(const size_t*) a;
+    size_t indexB = *(const size_t*) b;
+    if(sorting == SORT_TEXT)
+    {
+        int result = strcasecmp(entries.texts[indexA], entries.texts[indexB]);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    else if(sorting == SORT_MANUAL && entries.orders[indexA] != entries.orders[indexB])
+    {
+        return entries.orders[indexA] < entries.orders[indexB] ? -1 : 1;
+    }
+    return indexA < indexB ? -1 : indexA > indexB;
+}
+
+// Function to list the indexes of the entries that are displayed, in the order they were added
+// Returns a malloc'd array, and sets *count to its length
+size_t* displayedEntries(size_t* count)
+{
+    size_t* displayed = malloc((entries.count + 1) * sizeof(size_t));
+    *count = 0;
+    for(size_t i = 0; i < entries.count; i++)
+    {
+        if(entries.texts[i] != NULL && entries.divLocs[i] != 0)
+        {
+            displayed[(*count)++] = i;
+        }
+    }
+    return displayed;
+}
+
+// Function to send an entry's sort key to the server, as the CSS 'order' of its div
+void sendOrder(size_t index)
+{
+    char order[16];
+    snprintf(order, sizeof(order), "%d", entries.orders[index]);
+    styleSet(&styles, entries.divLocs[index], "order", order);
+}
+
+// Function to put the displayed entries (all of them) in the order given by sequence
+// Entries are moved by changing their sort keys rather than by rebuilding them, and only the entries
+// that are out of place are moved (see todoist_order.h), so one SET_STYLE is sent per entry moved.
+// If renumber is true, every entry is given a new key instead, to make room for more after the last.
+void reorderEntries(size_t* sequence, size_t count, bool renumber)
+{
+    size_t* changed = malloc((count + 1) * sizeof(size_t));
+    size_t numChanged = renumber ? orderRenumber(entries.orders, sequence, count, changed)
+        : orderAssign(entries.orders, sequence, count, changed);
+    for(size_t i = 0; i < numChanged; i++)
+    {
+        sendOrder(changed[i]);
+        if(entries.flags[changed[i]] & ENTRY_ORDERED)
+        {
+            recordChange(changed[i]); // save the entry's new key
+        }
+    }
+    // Entries displayed from now on are given keys after the highest one
+    lastOrder = renumber ? -ORDER_LIMIT : lastOrder;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(entries.orders[sequence[i]] > lastOrder)
+        {
+            lastOrder = entries.orders[sequence[i]];
+        }
+    }
+    free(changed);
+}
+
+// Function to put the displayed entries in the current sort order
+void applyOrder(bool renumber)
+{
+    size_t count;
+    size_t* sequence = displayedEntries(&count);
+    if(sorting != SORT_ADDED)
+    {
+        qsort(sequence, count, sizeof(size_t), compareEntries);
+    }
+    reorderEntries(sequence, count, renumber);
+    free(sequence);
+}
+
+// Function to create the DOM elements that display an entry, and request events for its buttons
+void renderEntry(size_t index)
+{
+    if(entries.flags[index] & ENTRY_ORDERED)
+    {
+        // The entry was loaded with the sort key it was saved with, which puts it where the user moved it
+        if(entries.orders[index] > lastOrder)
+        {
+            lastOrder = entries.orders[index];
+        }
+    }
+    else
+    {
+        // Give the entry a sort key after all the others, so it is displayed last
+        if(lastOrder >= ORDER_LIMIT - ORDER_GAP)
+        {
+            applyOrder(true); // the keys have run out: renumber them, leaving room at the end
+        }
+        lastOrder += ORDER_GAP;
+        entries.orders[index] = lastOrder;
+        if(orderSaved)
+        {
+            // The other entries' keys are saved, so this one's must be too, to keep its place among them
+            entries.flags[index] |= ENTRY_ORDERED;
+            recordChange(index);
+        }
+    }
+
+    // Creating a unique ID for each list entry's div. This uses the global counter value that we have. 
+    char uniqueEntryDivID[ELEMENT_ID_SIZE];
+    elementId(uniqueEntryDivID, "entryDivID", counter); // Now, the unique entry ID is something like entryDivID12, for example, if counter = 12.
+
+    // We use hipe_send to append a new tag to the list's div, which is just a div, giving it the ID we entered.
+    hipe_send(session, HIPE_OP_APPEND_TAG, 0, listDiv, 2, "div", uniqueEntryDivID);
+    entries.divLocs[index] = getLoc(uniqueEntryDivID);    // Getting the location of this div so we can populate it
+    sendOrder(index);
+    
+    // Adding an 'arrow' symbol to the div, as a stylistic representation of a list entry
+    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, entries.divLocs[index], 1, 	"➼ ");
+    
+    // Create a paragraph tag, giving it a unique ID, and appending it to the div
+    char uniqueTextID[ELEMENT_ID_SIZE];
+    elementId(uniqueTextID, "textID", counter);
+    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entries.divLocs[index], 2, "p", uniqueTextID);
+    entries.textLocs[index] = getLoc(uniqueTextID);  // Get its location 
+
+    // Center the paragraph tag using CSS, accessed via its hipe_location
+    styleApply(&styles, entries.textLocs[index], "display: inline");
+    if(entries.flags[index] & ENTRY_COMPLETED)
+    {
+        styleSet(&styles, entries.textLocs[index], "text-decoration", "line-through");
+    }
+    // Populate the p tag with the text of the entry
+    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, entries.textLocs[index], 1, entries.texts[index]);
+    
+    // Applying some CSS style rules to the div, giving it margins in all four directions to space it correctly.
+    // Every entry is styled the same way, so this gives the div a shared class rather than four inline styles.
+    styleApply(&styles, entries.divLocs[index], "margin-top: 1em; margin-left: 0.5em; margin-right: 0.5em; margin-bottom: 1em");
+
+    // Create a unique ID for each delete button
+    char uniqueDeleteButtonID[ELEMENT_ID_SIZE];
+    elementId(uniqueDeleteButtonID, "deleteButtonID", counter);
+    // Adding the delete button to the DIV
+    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entries.divLocs[index], 3, "button", uniqueDeleteButtonID, uniqueEntryDivID);
+    hipe_loc deleteButton = getLoc(uniqueDeleteButtonID);
+    // Add text and styling to the delete button
+    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, deleteButton, 1, "Delete entry"); 
+    styleApply(&styles, deleteButton, ENTRY_BUTTON_STYLE);
+
+    // Create a unique ID for each edit button
+    char uniqueEditButtonID[ELEMENT_ID_SIZE];
+    elementId(uniqueEditButtonID, "editButtonID", counter);
+    // Adding the edit button to the DIV
+    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entries.divLocs[index], 3, "button", uniqueEditButtonID, uniqueEntryDivID);
+    hipe_loc editButton = getLoc(uniqueEditButtonID);
+    // Add text and styling to the edit button
+    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, editButton, 1, "Edit entry"); 
+    styleApply(&styles, editButton, ENTRY_BUTTON_STYLE);
+
+    // Add a horizontal line - acts as a separator between the entries
+    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entries.divLocs[index], 1, "hr");
+
+    //requests events for these buttons (delete, edit), and register the handlers for this entry
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, ENTRY_REQUESTOR(index, NEW_LIST_DELETE_EVENT), deleteButton, 2, "click", uniqueEntryDivID);
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, ENTRY_REQUESTOR(index, NEW_LIST_EDIT_EVENT), editButton, 2, "click", uniqueEntryDivID);
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, ENTRY_REQUESTOR(index, NEW_LIST_SELECT_EVENT), entries.textLocs[index], 1, "click");
+
+    // Hide the entry straight away if it doesn't match what is being searched for
+    if(searchText != NULL && !searchMatches(entries.texts[index], searchText))
+    {
+        styleSet(&styles, entries.divLocs[index], "display", "none");
+        entries.flags[index] |= ENTRY_HIDDEN;
+    }
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_DELETE_EVENT), deleteListEntry, NULL);
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_EDIT_EVENT), editListEntry, NULL);
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_SELECT_EVENT), selectListEntry, NULL);
+    counter++; // increment the global counter since we have added an entry
+}
+
 // Create a new entry in the list by calling HIPE_OP_DIALOG_INPUT
 void newListEntryDialog() 
 {
@@ -96,136 +569,506 @@ void newListEntryInput(hipe_session session)
         if(listenForInput.arg[0] != '\0') {
             // If the content of the user entry is not empty, then we add it to the list
             // In case the content is empty, then the user has entered nothing into the text box, so we ignore
-            // Creating a unique 'entryNumber' string for each list entry. This uses the global counter value that we have. 
-            char entryNumber[50];
-            sprintf(entryNumber, "%d", counter);
-            char* uniqueEntryDivID = concat("entryDivID", entryNumber); // Now, the unique entry ID is something like entryDivID12, for example, if counter = 12.
-
-            // We use hipe_send to append a new tag to the body, which is just a div, giving it the ID we entered.
-            hipe_send(session, HIPE_OP_APPEND_TAG, 0, 0, 2, "div", uniqueEntryDivID);
-            hipe_loc entryDivLoc = getLoc(uniqueEntryDivID);    // Getting the location of this div so we can populate it
-            
-            // Adding an 'arrow' symbol to the div, as a stylistic representation of a list entry
-            hipe_send(session, HIPE_OP_APPEND_TEXT, 0, entryDivLoc, 1, 	"➼ ");
-            
-            // Create a paragraph tag, giving it a unique ID, and appending it to the div
-            char* uniqueTextID = concat("textID", entryNumber);
-            hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 2, "p", uniqueTextID);
-            hipe_loc p_loc = getLoc(uniqueTextID);  // Get its location 
-
-            // Center the paragraph tag using CSS, accessed via its hipe_location
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, p_loc, 2, "display", "inline");
-            // Populate the p tag with the text received from the user input
-            hipe_send(session, HIPE_OP_APPEND_TEXT, 0, p_loc, 1, listenForInput.arg[0]);
-            listEntries[entryDivLoc] = listenForInput.arg[0];
-            
-            // Applying some CSS style rules to the div, giving it margins in all four directions to space it correctly.
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-top", "1em");
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-left", "0.5em");
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-right", "0.5em");
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-bottom", "1em");
-
-            // Create a unique ID for each delete button
-            char* uniqueDeleteButtonID = concat("deleteButtonID", entryNumber);
-            // Adding the delete button to the DIV
-            hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 3, "button", uniqueDeleteButtonID, uniqueEntryDivID);
-            hipe_loc deleteButton = getLoc(uniqueDeleteButtonID);
-            // Add text and styling to the delete button
-            hipe_send(session, HIPE_OP_APPEND_TEXT, 0, deleteButton, 1, "Delete entry"); 
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, deleteButton, 2, "font-family", "impact");
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, deleteButton, 2, "float", "right");
-
-            // Create a unique ID for each edit button
-            char* uniqueEditButtonID = concat("editButtonID", entryNumber);
-            // Adding the edit button to the DIV
-            hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 3, "button", uniqueEditButtonID, uniqueEntryDivID);
-            hipe_loc editButton = getLoc(uniqueEditButtonID);
-            // Add text and styling to the edit button
-            hipe_send(session, HIPE_OP_APPEND_TEXT, 0, editButton, 1, "Edit entry"); 
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, editButton, 2, "font-family", "impact");
-            hipe_send(session, HIPE_OP_SET_STYLE, 0, editButton, 2, "float", "right");
-
-            // Add a horizontal line - acts as a separator between the entries
-            hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 1, "hr");
-
-            //requests events for these buttons (delete, edit)
-            hipe_send(session, HIPE_OP_EVENT_REQUEST, NEW_LIST_DELETE_EVENT, deleteButton, 2, "click", uniqueEntryDivID);
-            hipe_send(session, HIPE_OP_EVENT_REQUEST, NEW_LIST_EDIT_EVENT, editButton, 2, "click", uniqueEntryDivID);
-            counter++; // increment the global counter since we have added an entry
-        }
-    }
-}
-
-// Function to delete a list entry - called when delete button is pressed
-void deleteListEntry(hipe_session session) 
-{
-    hipe_instruction listenForDeleteEvent;
-    hipe_instruction_init(&listenForDeleteEvent);
-    if(hipe_await_instruction(session, &listenForDeleteEvent, HIPE_OP_EVENT) == 1) 
-    {
-        // Delete based on location, we know div location is 2 less than the button location
-        hipe_loc deleteLocDiv = listenForDeleteEvent.location - 2;
-        listEntries[deleteLocDiv] = "\0";
-        hipe_send(session, HIPE_OP_DELETE, 0, deleteLocDiv, 2, "button", "deleteNoteDiv");
-        listEntries[deleteLocDiv] = "\0";
+            size_t index = addEntryToModel(listenForInput.arg[0], listenForInput.arg_length[0], STORE_NO_ID);
+            renderEntry(index);
+            if(sorting == SORT_TEXT)
+            {
+                applyOrder(false); // move the new entry from the end of the list to its place
+            }
+        }
     }
+    hipe_instruction_clear(&listenForInput);
+}
+
+// Event-handler for the new entry button: opens the dialog, then handles the input
+void newListEntry(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    newListEntryDialog();
+    newListEntryInput(session);
+}
+
+// Function to select or deselect an entry, highlighting it while it is selected
+void setSelected(size_t index, bool selected)
+{
+    if(selected == ((entries.flags[index] & ENTRY_SELECTED) != 0))
+    {
+        return;
+    }
+    entries.flags[index] ^= ENTRY_SELECTED;
+    if(selected)
+    {
+        numSelected++;
+    }
+    else
+    {
+        numSelected--;
+    }
+    styleSet(&styles, entries.divLocs[index], "background-color", selected ? "#c8e6f5" : "");
+}
+
+// Function to remove an entry from the list, the display and the search index, and record the deletion
+void removeEntry(size_t index)
+{
+    setSelected(index, false);
+    hipe_send(session, HIPE_OP_DELETE, 0, entries.divLocs[index], 2, "button", "deleteNoteDiv");
+    styleForget(&styles, entries.divLocs[index]);
+    styleForget(&styles, entries.textLocs[index]);
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_DELETE_EVENT), NULL, NULL);
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_EDIT_EVENT), NULL, NULL);
+    hipe_dispatch_requestor(dispatcher, ENTRY_REQUESTOR(index, NEW_LIST_SELECT_EVENT), NULL, NULL);
+    searchRemove(&search, index, entries.texts[index]);
+    releaseText(entries.texts[index]);
+    entries.texts[index] = NULL;
+    recordChange(index);
+}
+
+// Function to delete a list entry - called by the dispatcher when a delete button is pressed
+// The entry is found from the button's requestor, so only the deletion itself is sent to the server
+void deleteListEntry(hipe_session session, hipe_instruction* event, void* userdata) 
+{
+    size_t index = ENTRY_INDEX(event->requestor);
+    if(index >= entries.count || entries.texts[index] == NULL)
+    {
+        return; // already deleted
+    }
+    removeEntry(index);
+}
+
+// Function to select or deselect an entry - called by the dispatcher when an entry's text is clicked
+// Clicks are ignored unless the list is in multi-select mode
+void selectListEntry(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    size_t index = ENTRY_INDEX(event->requestor);
+    if(!selecting || index >= entries.count || entries.texts[index] == NULL)
+    {
+        return;
+    }
+    setSelected(index, !(entries.flags[index] & ENTRY_SELECTED));
 }
 
 // This function is called when edit button is pressed - opens a dialog box, 
 // sending it the current text which is in the entry
-void editListEntryDialog(hipe_session session, char* text) 
+void editListEntryDialog(hipe_session session, const char* text) 
 {
     hipe_send(session, HIPE_OP_DIALOG_INPUT, 0,0, 4, "Edit note", "Start writing below: ", text);
 }
 
 // Function to deal with the input from the edit button dialog box
-void editListEntry(hipe_session session) 
-{
-    hipe_instruction listenForEditEvent;
-    hipe_instruction_init(&listenForEditEvent);
-    // Wait for button press, and store it in the hipe_instruction we created above
-    if(hipe_await_instruction(session, &listenForEditEvent, HIPE_OP_EVENT) == 1) 
-    {
-        // Find the location of the div
-        hipe_loc editLocDiv = listenForEditEvent.location - 2;
-        // Get content of the div (the text that is currently in the list entry)
-        hipe_send(session, HIPE_OP_GET_CONTENT, 0, editLocDiv, 0);
-        // Await the reply from the server with the required content from the entry
-        if(hipe_await_instruction(session, &listenForEditEvent, HIPE_OP_CONTENT_RETURN) == 1) 
-        {
-            // Call the auxiliary function to open a dialog box, passing to it the current list entry contents
-            editListEntryDialog(session, listenForEditEvent.arg[0]);
-        }
-        hipe_instruction listenForInput;
-        hipe_instruction_init(&listenForInput);
-        // Await reply from dialog box
-        if(hipe_await_instruction(session, &listenForInput, HIPE_OP_DIALOG_RETURN) == 1) 
-        {
-            if(listenForInput.arg[0] != '\0') {
-                // If there is some text, we update the list entry
-                hipe_send(session, HIPE_OP_SET_TEXT, 0, editLocDiv, 1, listenForInput.arg[0]);
-                listEntries[editLocDiv - 1] = listenForInput.arg[0];
+// Called by the dispatcher with the click event from the edit button. The entry's current text is
+// taken from the model rather than asked for from the server, since the app wrote it there itself.
+void editListEntry(hipe_session session, hipe_instruction* event, void* userdata) 
+{
+    size_t index = ENTRY_INDEX(event->requestor);
+    if(index >= entries.count || entries.texts[index] == NULL)
+    {
+        return; // deleted
+    }
+    // Call the auxiliary function to open a dialog box, passing to it the current list entry contents
+    editListEntryDialog(session, entries.texts[index]);
+    hipe_instruction listenForInput;
+    hipe_instruction_init(&listenForInput);
+    // Await reply from dialog box
+    if(hipe_await_instruction(session, &listenForInput, HIPE_OP_DIALOG_RETURN) == 1) 
+    {
+        if(listenForInput.arg[0] != '\0' && entries.texts[index] != NULL) {
+            // If there is some text, we update the list entry
+            hipe_send(session, HIPE_OP_SET_TEXT, 0, entries.textLocs[index], 1, listenForInput.arg[0]);
+            searchRemove(&search, index, entries.texts[index]);
+            releaseText(entries.texts[index]);
+            entries.texts[index] = strndup(listenForInput.arg[0], listenForInput.arg_length[0]);
+            searchAdd(&search, index, entries.texts[index]);
+            bool hide = searchText != NULL && !searchMatches(entries.texts[index], searchText);
+            if(hide != ((entries.flags[index] & ENTRY_HIDDEN) != 0))
+            {
+                styleSet(&styles, entries.divLocs[index], "display", hide ? "none" : "block");
+                entries.flags[index] ^= ENTRY_HIDDEN;
+                setSelected(index, false); // bulk operations only apply to entries that can be seen
+            }
+            recordChange(index);
+            if(sorting == SORT_TEXT)
+            {
+                applyOrder(false);
             }
         }
     }
+    hipe_instruction_clear(&listenForInput);
+}
+
+// Function to open the store and the journal when the app starts
+// Any changes left in the journal by the last run of the app (if it didn't get to export them)
+// are replayed into the store first, so they aren't lost. Returns true if the store is open.
+bool openStore()
+{
+    if(storeOpen(&store, STORE_FILE, SNAPSHOT_FILE) != 0)
+    {
+        perror("Error opening " STORE_FILE);
+        return false;
+    }
+    store_opened = true;
+    long recovered = journalReplay(JOURNAL_FILE, &store);
+    nextStoreId = store.numIds;
+    if(recovered < 0)
+    {
+        // Keep the journal, so the changes can be recovered another time. New changes can't be journaled
+        // until then (they would be mixed up with the old ones), but they can still be exported.
+        perror("Error recovering changes from " JOURNAL_FILE);
+        return true;
+    }
+    if(recovered > 0)
+    {
+        fprintf(stderr, "Recovered %ld unsaved changes from " JOURNAL_FILE "\n", recovered);
+    }
+    journalRemove(JOURNAL_FILE);
+    if(journalOpen(&journal, JOURNAL_FILE) == 0)
+    {
+        journal_opened = true;
+    }
+    else
+    {
+        perror("Error opening " JOURNAL_FILE);
+    }
+    return true;
 }
 
-// Function to export list entries to file
-void exportToFile() 
+void exportToFile(bool quiet);
+
+// Function run by the worker thread of an export: writes the snapshot of changes to the store,
+// compacts the store if worthwhile, and syncs it to disk
+void* exportWorker(void* arg)
 {
-    FILE* fileID;
-    fileID = fopen("output_list.txt", "w");
-    for(int i = 0; i < MAX_NUM_ENTRIES_IN_FILE; i++) 
+    for(size_t i = 0; i < exporting.numChanges && !exporting.failed; i++) 
     {
-        if (listEntries[i] != "\0") {
-            fprintf(fileID, "%s\n", listEntries[i]); 
+        exportChange* change = &exporting.changes[i];
+        if(change->text == NULL) 
+        {
+            // The entry may have been deleted before it was ever saved
+            size_t length;
+            change->saved = storeText(&store, change->storeId, &length) == NULL
+                || storeDelete(&store, change->storeId) == 0;
+        }
+        else 
+        {
+            change->saved = storePut(&store, change->storeId, change->text, strlen(change->text),
+                &change->meta, sizeof(change->meta)) == 0;
         }
+        if(!change->saved)
+        {
+            exporting.failed = true;
+            exporting.errnum = errno;
+        }
+    }
+
+    // Reclaim the space taken up by deleted and edited entries once there is enough of it.
+    // The new snapshot is written to a temporary file and renamed into place.
+    if(!exporting.failed && storeShouldCompact(&store))
+    {
+        storeCompact(&store);
+    }
+    if(!exporting.failed && storeSync(&store) != 0)
+    {
+        exporting.failed = true;
+        exporting.errnum = errno;
+    }
+    char done = 1;
+    write(exporting.pipe[1], &done, 1);
+    return NULL;
+}
+
+// Function to finish the export running in the background, waiting for it if it is still running
+// Puts anything that couldn't be saved back in the list of changes
+void finishExport(bool report)
+{
+    char done;
+    while(read(exporting.pipe[0], &done, 1) < 0 && errno == EINTR);
+    if(exporting.threaded)
+    {
+        pthread_join(exporting.thread, NULL);
+    }
+    exporting.running = false;
+
+    for(size_t i = 0; i < exporting.numChanges; i++) 
+    {
+        if(!exporting.changes[i].saved)
+        {
+            markDirty(exporting.changes[i].index);
+        }
+    }
+    if(!exporting.failed && exporting.rotated)
+    {
+        journalRetire(&journal); // the changes journaled before the export started are in the store now
+    }
+    free(exporting.changes);
+    exporting.changes = NULL;
+    for(size_t i = 0; i < exporting.numRetired; i++) 
+    {
+        free(exporting.retired[i]);
+    }
+    exporting.numRetired = 0;
+
+    if(report && !exporting.quiet)
+    {
+        if(exporting.failed)
+        {
+            fprintf(stderr, "Error writing " STORE_FILE ": %s\n", strerror(exporting.errnum));
+            displaySimpleDialog("Failure message", "Failed to export to file, check terminal log for details.");
+        }
+        else
+        {
+            displaySimpleDialog("Success message", "Exported to file successfully.");
+        }
+    }
+    if(exporting.again)
+    {
+        exporting.again = false;
+        exportToFile(false);
     }
-     fclose(fileID);
-     displaySimpleDialog("Success message", "Exported to file successfully.");
 }
 
-// Function to load a saved list from a file
+// Function to finish the export running in the background if it has finished
+void checkExport()
+{
+    struct pollfd fd = { exporting.pipe[0], POLLIN, 0 };
+    if(poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN))
+    {
+        finishExport(true);
+    }
+}
+
+// Function to wait until there is something to do: an instruction from the server, the end of an export,
+// a batch from the import pipeline, or a journal commit falling due
+void waitForWork()
+{
+    struct pollfd fds[3] = {
+        { hipe_session_fd(session), POLLIN, 0 },
+        { -1, POLLIN, 0 },
+        { -1, POLLIN, 0 }
+    };
+    int numFds = 1;
+    if(exporting.running)
+    {
+        fds[numFds++].fd = exporting.pipe[0];
+    }
+    if(loader.import != NULL)
+    {
+        fds[numFds++].fd = importFd(loader.import);
+    }
+    int timeout = journal_opened ? journalTimeout(&journal) : -1;
+    hipe_flush_frame(session); // send the changes made so far, rather than holding them while we wait
+    poll(fds, numFds, timeout);
+}
+
+// Function to save the list to the store
+// Only entries that have changed since the last save are written, each as one small record appended to the log.
+// The changes are captured in a snapshot, and written by a worker thread so the app stays responsive;
+// the user is told when the export has finished, unless it is quiet (started automatically).
+void exportToFile(bool quiet) 
+{
+    if(exporting.running)
+    {
+        // Export the changes made since this export started once it finishes
+        exporting.again = exporting.again || !quiet;
+        return;
+    }
+    if(!store_opened || (exporting.pipe[0] < 0 && pipe(exporting.pipe) != 0))
+    {
+        perror("Error opening " STORE_FILE);
+        displaySimpleDialog("Failure message", "Failed to export to file, check terminal log for details.");
+        return;
+    }
+
+    // Take a snapshot of the changes. The snapshot shares the entries' texts (see releaseText()).
+    exporting.changes = malloc((numDirtyEntries + 1) * sizeof(exportChange));
+    exporting.numChanges = 0;
+    for(size_t i = 0; i < numDirtyEntries; i++) 
+    {
+        size_t index = dirtyEntries[i];
+        entries.flags[index] &= ~ENTRY_DIRTY;
+        exportChange change = { index, entries.storeIds[index], entries.texts[index], entryMetaOf(index), false };
+        exporting.changes[exporting.numChanges++] = change;
+    }
+    numDirtyEntries = 0;
+
+    // Start a new generation of the journal. The old one holds the changes in the snapshot,
+    // and is deleted once they have been saved.
+    exporting.rotated = journal_opened && journalRotate(&journal) == 0;
+    exporting.quiet = quiet;
+
+    exporting.failed = false;
+    exporting.running = true;
+    exporting.threaded = pthread_create(&exporting.thread, NULL, exportWorker, NULL) == 0;
+    if(!exporting.threaded)
+    {
+        // Couldn't start a thread: save the snapshot on this thread instead.
+        // The event loop still picks up the result as it would from the worker.
+        exportWorker(NULL);
+    }
+}
+
+// Function to add the next entry saved in the store to the list
+// Entries are read from the (memory-mapped) store only as they are about to be displayed
+// Returns false once there are no more entries in the store
+bool loadNextFromStore()
+{
+    while(loader.nextStoreId < store.numIds)
+    {
+        uint32_t id = loader.nextStoreId++;
+        size_t length;
+        const char* text = storeText(&store, id, &length);
+        if(text != NULL && !(id < loader.inListSize && loader.inList[id]))
+        {
+            size_t index = addEntryToModel(text, length, id);
+            const void* meta = storeMeta(&store, id, &length);
+            if(meta != NULL && length == sizeof(entryMeta))
+            {
+                entryMeta saved;
+                memcpy(&saved, meta, sizeof(saved)); // the store gives no alignment guarantees
+                entries.flags[index] |= saved.flags & ENTRY_SAVED_FLAGS;
+                entries.orders[index] = saved.order;
+                if((saved.flags & ENTRY_ORDERED) && !orderSaved)
+                {
+                    orderSaved = true; // the list is in the order the user moved the entries into
+                    sorting = SORT_MANUAL;
+                }
+            }
+            loader.numLoaded++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to check whether the loader has work to do in between events
+// Entries can't be read from the store while an export has it, so loading from the store waits for that to finish.
+// While text files are being imported, the loader waits for the pipeline to parse the next batch.
+bool loaderBusy()
+{
+    if(!loader.active)
+    {
+        return false;
+    }
+    if(loader.fromStore)
+    {
+        return !exporting.running;
+    }
+    return (loader.import != NULL && (importReady(loader.import) || importDone(loader.import)))
+        || (loader.windowLeft > 0 && loader.nextToRender < entries.count);
+}
+
+// Function to do the next part of loading a list: take the next batch of entries from the import
+// pipeline (if text files are being imported), then display the next batch of loaded entries,
+// up to the end of the current window.
+// Called between turns of the event loop.
+void loadStep()
+{
+    if(loader.import != NULL)
+    {
+        // Take the next batch of entries parsed by the import pipeline. Batches come in the order
+        // they were read, so the entries keep the order they have in the files.
+        importBatch* batch = importNext(loader.import);
+        if(batch != NULL)
+        {
+            for(size_t i = 0; i < batch->count; i++)
+            {
+                // The entry has not been saved in the store yet, so it is recorded as a change
+                adoptEntry(batch->texts[i], STORE_NO_ID);
+                batch->texts[i] = NULL;
+                loader.numLoaded++;
+            }
+            importFreeBatch(batch);
+        }
+        if(importDone(loader.import))
+        {
+            const char* path;
+            int errnum = importError(loader.import, &path);
+            if(errnum != 0)
+            {
+                fprintf(stderr, "Error reading %s: %s\n", path, strerror(errnum));
+            }
+            importFinish(loader.import);
+            loader.import = NULL;
+        }
+    }
+
+    uint64_t renderBegin = hipe_trace_begin(); // shown on the timeline, when tracing
+    int rendered = 0;
+    while(rendered < RENDER_BATCH_SIZE && loader.windowLeft > 0)
+    {
+        if(loader.nextToRender == entries.count && !(loader.fromStore && loadNextFromStore()))
+        {
+            break; // nothing more has been loaded yet
+        }
+        size_t index = loader.nextToRender;
+        if(entries.texts[index] != NULL && entries.divLocs[index] == 0) // not deleted, and not displayed yet
+        {
+            renderEntry(loader.nextToRender);
+            rendered++;
+            loader.windowLeft--;
+        }
+        loader.nextToRender++;
+    }
+    if(rendered > 0 && sorting == SORT_TEXT)
+    {
+        applyOrder(false); // move the entries just displayed from the end of the list to their places
+    }
+    hipe_trace_end("render entries", renderBegin);
+
+    bool moreInStore = loader.fromStore && loader.nextStoreId < store.numIds;
+    bool moreToDisplay = loader.nextToRender < entries.count || moreInStore;
+    if(loader.windowLeft == 0 && moreToDisplay && loader.showMoreButton == 0)
+    {
+        // A window's worth of entries is displayed. The rest are only displayed if the user asks for them.
+        hipe_send(session, HIPE_OP_APPEND_TAG, 0, 0, 2, "button", "showMoreButton");
+        loader.showMoreButton = getLoc("showMoreButton");
+        hipe_send(session, HIPE_OP_APPEND_TEXT, 0, loader.showMoreButton, 1, "Show more entries");
+        hipe_send(session, HIPE_OP_EVENT_REQUEST, SHOW_MORE_EVENT, loader.showMoreButton, 1, "click");
+    }
+    if(loader.import == NULL && (loader.windowLeft == 0 || !moreToDisplay))
+    {
+        // Nothing more to do until the user asks for more entries (if there are any)
+        loader.active = false;
+        if(!moreToDisplay)
+        {
+            free(loader.inList);
+            loader.inList = NULL;
+            loader.fromStore = false;
+        }
+        if(!loader.reported)
+        {
+            // Display a message to inform the user that the entries have been loaded from file
+            loader.reported = true;
+            if (loader.numLoaded > 0)
+            {
+                displaySimpleDialog("Success message", "Loaded from file successfully.");
+            }
+            else
+            {
+                displaySimpleDialog("Empty file message", "File is empty, no entries loaded.");
+            }
+        }
+    }
+}
+
+// Event-handler for the button that displays the next window of entries
+void showMore(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    if(loader.showMoreButton == 0)
+    {
+        return;
+    }
+    // Remove the button; it is added again after the new entries if there are still more
+    hipe_send(session, HIPE_OP_DELETE, 0, loader.showMoreButton, 0);
+    loader.showMoreButton = 0;
+    loader.windowLeft = LIST_WINDOW_SIZE;
+    loader.active = true;
+    if(loaderBusy())
+    {
+        loadStep();
+    }
+}
+
+// Function to start loading a saved list from the store, or from text files if there is nothing in the store
+// The list is loaded and displayed progressively by loadStep(), called from the event loop.
+// Only the first window of entries is displayed until the user asks for more.
 void loadFromFile(hipe_session session) 
 {
     // If user has loaded from file already, display error message, and return
@@ -234,137 +1077,346 @@ void loadFromFile(hipe_session session)
         displaySimpleDialog("Failure message", "Loaded from file already, please restart to load again.");
         return;
     }
-    // Create a new file object
-    FILE* fileID;
-    fileID = fopen("output_list.txt","r");
-    int errnum;
-
-    // Error handling, check if file exists
-    // If not, display appropriate message, and print the error logs
-    if (fileID == NULL) 
+    loader.numLoaded = 0;
+    loader.nextToRender = entries.count;
+    loader.windowLeft = LIST_WINDOW_SIZE;
+    if(exporting.running)
     {
-        errnum = errno;
-        fprintf(stderr, "Value of errno: %d\n", errno);
-        perror("Error printed by perror");
-        fprintf(stderr, "Error opening file: %s\n", strerror( errnum ));
-        displaySimpleDialog("Failure message", "Failed load file, check terminal log for details.");
-        return;
+        finishExport(true); // the store is needed here, so wait for the export to finish with it
     }
-    // If file exists, we start to read from it 
-    // Read from the file line by line
-    else 
-    {
-        char* buffer = NULL;
-        size_t len;
-        ssize_t bytes_read = getdelim( &buffer, &len, '\0', fileID);
-        int num_items_loaded = 0;
-        if ( bytes_read != -1) {
-            clearEntriesList();
-            char* delim = "\n";
-            char* ptr = strtok(buffer, delim);
-            int counter = 8;
-            while(ptr != NULL)
+    if(store_opened && store.numIds > 0)
+    {
+        // Entries that are already in the list (added earlier in this session) are not loaded a second time
+        loader.inListSize = nextStoreId;
+        loader.inList = calloc(nextStoreId + 1, 1);
+        for(size_t i = 0; i < entries.count; i++) 
+        {
+            loader.inList[entries.storeIds[i]] = 1;
+        }
+        loader.fromStore = true;
+        loader.nextStoreId = 0;
+    }
+    else
+    {
+        // Nothing in the store yet: import the text files instead
+        // Error handling, check if files exist
+        // If not, display appropriate message, and print the error logs
+        for(int i = 0; i < numImportPaths; i++)
+        {
+            if(access(importPaths[i], R_OK) != 0)
             {
-                // While we haven't exceeded the maximum number of entries
-                if (counter < MAX_NUM_ENTRIES_IN_FILE) 
-                {
-                    // Save the entry to the array
-                    listEntries[counter] = ptr;
-                    ptr = strtok(NULL, delim);
-                    counter += 4;
-                }
+                int errnum = errno;
+                fprintf(stderr, "Value of errno: %d\n", errno);
+                perror("Error printed by perror");
+                fprintf(stderr, "Error opening file %s: %s\n", importPaths[i], strerror( errnum ));
+                displaySimpleDialog("Failure message", "Failed load file, check terminal log for details.");
+                return;
             }
-            // Now, for each entry loaded, we will create the DIVs and display the entry
-            // Same as we do for when the user creates a new entry manually
-            for(int i = 0; i < MAX_NUM_ENTRIES_IN_FILE; i++) 
+        }
+        loader.import = importStart(importPaths, numImportPaths);
+        if(loader.import == NULL)
+        {
+            perror("Error starting import");
+            displaySimpleDialog("Failure message", "Failed load file, check terminal log for details.");
+            return;
+        }
+    }
+    loaded_already = true;
+    loader.active = true;
+    loadStep(); // display the first batch straight away (no export can be running at this point)
+}
+
+// Function for the search index to get the text of an entry
+const char* entryText(uint32_t index, void* userdata)
+{
+    return entries.texts[index];
+}
+
+// Function to filter the displayed entries, leaving only those containing text (or all of them, if text is NULL)
+// Only entries whose visibility changes are sent a SET_STYLE, so the DOM is never rebuilt.
+void filterEntries(const char* text)
+{
+    free(searchText);
+    searchText = text != NULL && text[0] != '\0' ? strdup(text) : NULL;
+
+    // Flag the entries that match, using the index
+    char* matches = NULL;
+    if(searchText != NULL)
+    {
+        uint32_t* results;
+        size_t numResults = searchQuery(&search, searchText, entryText, NULL, &results);
+        matches = calloc(entries.count + 1, 1);
+        for(size_t i = 0; i < numResults; i++)
+        {
+            matches[results[i]] = 1;
+        }
+        free(results);
+    }
+
+    for(size_t i = 0; i < entries.count; i++)
+    {
+        if(entries.texts[i] == NULL || entries.divLocs[i] == 0)
+        {
+            continue; // deleted, or not displayed yet (renderEntry() applies the filter then)
+        }
+        bool hide = matches != NULL && !matches[i];
+        if(hide != ((entries.flags[i] & ENTRY_HIDDEN) != 0))
+        {
+            styleSet(&styles, entries.divLocs[i], "display", hide ? "none" : "block");
+            entries.flags[i] ^= ENTRY_HIDDEN;
+            setSelected(i, false); // bulk operations only apply to entries that can be seen
+        }
+    }
+    free(matches);
+}
+
+// Event-handler for typing in the search box
+// Bursts of typing are coalesced into one event, so the list is filtered once for the latest text.
+void searchEntries(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    hipe_instruction content;
+    hipe_instruction_init(&content);
+    hipe_send(session, HIPE_OP_GET_CONTENT, 0, searchBox, 0);
+    if(hipe_await_instruction(session, &content, HIPE_OP_CONTENT_RETURN) == 1)
+    {
+        char* text = strndup(content.arg[0] ? content.arg[0] : "", content.arg_length[0]);
+        filterEntries(text);
+        free(text);
+    }
+    hipe_instruction_clear(&content);
+}
+
+// Event-handler for the sort button: switches between alphabetical order and the order the entries were added in
+// (after entries have been moved by hand, it sorts them alphabetically)
+void sortEntries(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    sorting = sorting == SORT_TEXT ? SORT_ADDED : SORT_TEXT;
+    applyOrder(false);
+    hipe_send(session, HIPE_OP_SET_TEXT, 0, sortButton, 1, sorting == SORT_ADDED ? "Sort A-Z" : "Sort by date added");
+}
+
+// Function to deselect every entry
+void clearSelection()
+{
+    for(size_t i = 0; i < entries.count && numSelected > 0; i++)
+    {
+        if(entries.flags[i] & ENTRY_SELECTED)
+        {
+            setSelected(i, false);
+        }
+    }
+}
+
+// The bulk operations below each run as one batch: the model is updated in one pass, and the instructions
+// for the display are corked and sent together.
+
+// Event-handler for the select button: turns multi-select mode on or off
+// Leaving multi-select mode deselects everything.
+void toggleSelectMode(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    hipe_cork(session);
+    selecting = !selecting;
+    if(!selecting)
+    {
+        clearSelection();
+    }
+    hipe_send(session, HIPE_OP_SET_TEXT, 0, selectButton, 1, selecting ? "Done selecting" : "Select");
+    styleSet(&styles, bulkDiv, "display", selecting ? "inline" : "none");
+    hipe_uncork(session);
+}
+
+// Event-handlers for the select all and select completed buttons
+// Only the entries that are displayed, and not hidden by the search, are selected.
+void selectEntries(bool completedOnly)
+{
+    hipe_cork(session);
+    for(size_t i = 0; i < entries.count; i++)
+    {
+        if(entries.texts[i] != NULL && entries.divLocs[i] != 0 && !(entries.flags[i] & ENTRY_HIDDEN)
+            && (!completedOnly || (entries.flags[i] & ENTRY_COMPLETED)))
+        {
+            setSelected(i, true);
+        }
+    }
+    hipe_uncork(session);
+}
+
+void selectAll(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    selectEntries(false);
+}
+
+void selectCompleted(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    selectEntries(true);
+}
+
+// Event-handler for the complete button: marks the selected entries as completed, and deselects them
+// The entries are saved as completed, with their journal records committed together.
+void completeSelected(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    hipe_cork(session);
+    for(size_t i = 0; i < entries.count && numSelected > 0; i++)
+    {
+        if(entries.flags[i] & ENTRY_SELECTED)
+        {
+            setSelected(i, false);
+            if(!(entries.flags[i] & ENTRY_COMPLETED))
             {
-                if(listEntries[i] != "\0" && loaded_already == false) 
-                {
-                    num_items_loaded++;
-                    char entryNumber[50];
-                    sprintf(entryNumber, "%d", counter);
-                    char* uniqueEntryDivID = concat("entryDivID", entryNumber); 
-                    hipe_send(session, HIPE_OP_APPEND_TAG, 0, 0, 2, "div", uniqueEntryDivID);
-                    hipe_loc entryDivLoc = getLoc(uniqueEntryDivID);
-                    
-                    // Adding an 'arrow' symbol to the div, as a stylistic representation of a list entry
-                    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, entryDivLoc, 1, 	"➼ ");
-                    
-                    // Create a paragraph tag, giving it a unique ID, and appending it to the div
-                    char* uniqueTextID = concat("textID", entryNumber);
-                    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 2, "p", uniqueTextID);
-                    hipe_loc p_loc = getLoc(uniqueTextID);  // Get its location 
-
-                    // Center the paragraph tag using CSS, accessed via its hipe_location
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, p_loc, 2, "display", "inline");
-                    // Populate the p tag with the text received from the user input
-                    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, p_loc, 1, listEntries[i]);
-                    
-                    // Applying some CSS style rules to the div, giving it margins in all 
-                    // four directions to space it correctly.
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-top", "1em");
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-left", "0.5em");
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-right", "0.5em");
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, entryDivLoc, 2, "margin-bottom", "1em");
-
-                    // Create a unique ID for each delete button
-                    char* uniqueDeleteButtonID = concat("deleteButtonID", entryNumber);
-                    // Adding the delete button to the DIV
-                    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 3, "button", uniqueDeleteButtonID, uniqueEntryDivID);
-                    hipe_loc deleteButton = getLoc(uniqueDeleteButtonID);
-                    // Add text and styling to the delete button
-                    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, deleteButton, 1, "Delete entry"); 
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, deleteButton, 2, "font-family", "impact");
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, deleteButton, 2, "float", "right");
-
-                    // Create a unique ID for each edit button
-                    char* uniqueEditButtonID = concat("editButtonID", entryNumber);
-                    // Adding the edit button to the DIV
-                    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 3, "button", uniqueEditButtonID, uniqueEntryDivID);
-                    hipe_loc editButton = getLoc(uniqueEditButtonID);
-                    // Add text and styling to the edit button
-                    hipe_send(session, HIPE_OP_APPEND_TEXT, 0, editButton, 1, "Edit entry"); 
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, editButton, 2, "font-family", "impact");
-                    hipe_send(session, HIPE_OP_SET_STYLE, 0, editButton, 2, "float", "right");
-
-                    // Add a horizontal line - acts as a separator between the entries
-                    hipe_send(session, HIPE_OP_APPEND_TAG, 0, entryDivLoc, 1, "hr");
-
-                    //requests events for these buttons (delete, edit)
-                    hipe_send(session, HIPE_OP_EVENT_REQUEST, NEW_LIST_DELETE_EVENT, deleteButton, 2, "click", uniqueEntryDivID);
-                    hipe_send(session, HIPE_OP_EVENT_REQUEST, NEW_LIST_EDIT_EVENT, editButton, 2, "click", uniqueEntryDivID);
-                    counter++; // increment the global counter since we have added an entry
-                }
+                entries.flags[i] |= ENTRY_COMPLETED;
+                styleSet(&styles, entries.textLocs[i], "text-decoration", "line-through");
+                recordChange(i);
             }
-            loaded_already = true;
         }
-        // Display a message to inform the user that the entries have been loaded from file
-        
-        if (num_items_loaded > 0)
+    }
+    hipe_uncork(session);
+    commitChanges();
+}
+
+// Event-handler for the move button: moves the selected entries to the top of the list, keeping their order
+// The list is then in manual order, until it is sorted again. From then on, the entries' sort keys are saved
+// with them (as they change), so the order they were moved into lasts from one run of the app to the next.
+void moveSelected(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    if(numSelected == 0)
+    {
+        return;
+    }
+    hipe_cork(session);
+    size_t count;
+    size_t* displayed = displayedEntries(&count);
+    sorting = SORT_MANUAL;
+    qsort(displayed, count, sizeof(size_t), compareEntries); // the order they are on screen
+    // The new order is the selected entries followed by the others
+    size_t* sequence = malloc((count + 1) * sizeof(size_t));
+    size_t position = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(entries.flags[displayed[i]] & ENTRY_SELECTED)
+        {
+            sequence[position++] = displayed[i];
+        }
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!(entries.flags[displayed[i]] & ENTRY_SELECTED))
         {
-            displaySimpleDialog("Success message", "Loaded from file successfully.");
+            sequence[position++] = displayed[i];
         }
-        else
+    }
+    reorderEntries(sequence, count, false);
+    orderSaved = true;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!(entries.flags[sequence[i]] & ENTRY_ORDERED))
+        {
+            // (entries that already had their keys saved were recorded by reorderEntries(), if they moved)
+            entries.flags[sequence[i]] |= ENTRY_ORDERED;
+            recordChange(sequence[i]);
+        }
+    }
+    free(sequence);
+    free(displayed);
+    clearSelection();
+    hipe_send(session, HIPE_OP_SET_TEXT, 0, sortButton, 1, "Sort A-Z");
+    hipe_uncork(session);
+    commitChanges();
+}
+
+// Event-handler for the delete button: deletes the selected entries
+// Each deletion is recorded in the store by the next export, as usual, so the store sees them as one batch.
+void deleteSelected(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    hipe_cork(session);
+    for(size_t i = 0; i < entries.count && numSelected > 0; i++)
+    {
+        if(entries.flags[i] & ENTRY_SELECTED)
         {
-            displaySimpleDialog("Empty file message", "File is empty, no entries loaded.");
+            removeEntry(i);
         }
     }
+    hipe_uncork(session);
+    commitChanges(); // the journal records for all the deletions are written together
+}
+
+// Event-handlers for the export and load buttons
+void exportToFileEvent(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    exportToFile(false);
+}
+
+void loadFromFileEvent(hipe_session session, hipe_instruction* event, void* userdata)
+{
+    loadFromFile(session);
 }
 
+// Layout of the app's window (see todoist_layout.h). Entries are added to listDiv as the list is loaded.
+// listDiv is a flex container, so the entries are displayed in the order of their CSS 'order' properties,
+// and can be moved without being rebuilt. The buttons for bulk operations are only shown in multi-select mode.
+static const char* appLayout =
+    "<style>"
+        "body { background-color: #32a885; }"
+        ".toolbarButton { margin-left: 1em; }"
+    "</style>"
+    "<h1 id='main-page-title'>TO-DOIST</h1>"
+    "<div id='searchBoxDiv' style='margin: 0.5em'>"
+        "Search: "
+        "<span id='searchBox' contenteditable='true' style='display: inline-block; min-width: 20em; background-color: white'></span>"
+        "<button id='sortButton' class='toolbarButton'>Sort A-Z</button>"
+        "<button id='selectButton' class='toolbarButton'>Select</button>"
+        "<span id='bulkDiv' style='display: none'>"
+            "<button id='selectAllButton' class='toolbarButton'>Select all</button>"
+            "<button id='selectCompletedButton' class='toolbarButton'>Select completed</button>"
+            "<button id='completeSelectedButton' class='toolbarButton'>Mark completed</button>"
+            "<button id='moveSelectedButton' class='toolbarButton'>Move to top</button>"
+            "<button id='deleteSelectedButton' class='toolbarButton'>Delete</button>"
+        "</span>"
+    "</div>"
+    "<div id='listDiv' style='display: flex; flex-direction: column'></div>";
+
 int main(int argc, char** argv)
 {
     init();
     //Request a new top-level application frame from the Hipe server
+    // Record a timeline of the session, if asked to
+    const char* traceFile = getenv(TRACE_FILE_VARIABLE);
+    if(traceFile != NULL && hipe_trace_start(traceFile, 0) != 0)
+    {
+        fprintf(stderr, "Could not start tracing to %s\n", traceFile);
+        traceFile = NULL;
+    }
     session = hipe_open_session(argc>1 ? argv[1] : 0, 0, 0, "To-do list");
     if(!session) exit(1);
+    hipe_set_reconnect(session, 1); // rebuild the window by ourselves if the display server restarts
+    styleInit(&styles, session);
+    hipe_set_frame_interval(session, FRAME_INTERVAL);
     
     /* INTIAL SETUP - TITLE, BACKGROUND COLOUR, APPENDING BUTTONS, ETC. */
-    // Change the background colour 
-    hipe_send(session, HIPE_OP_ADD_STYLE_RULE, 0,0, 2, "body", "background-color: #32a885;");
-    // Add title to the app, showing the app name 
-    hipe_send(session, HIPE_OP_APPEND_TAG, 0,0, 2, "h1", "main-page-title");
-    hipe_loc main_page_title_loc = getLoc("main-page-title");
-    hipe_send(session, HIPE_OP_SET_TEXT, 0, main_page_title_loc, 1, "TO-DOIST");
+    // Build the window from its layout (see appLayout above), then find the elements we need
+    todoistLayout layout;
+    if(layoutCompile(&layout, appLayout) != 0 || layoutBuild(&layout, session) != 0)
+    {
+        exit(1);
+    }
+    searchBox = layoutLoc(&layout, "searchBox");
+    sortButton = layoutLoc(&layout, "sortButton");
+    selectButton = layoutLoc(&layout, "selectButton");
+    bulkDiv = layoutLoc(&layout, "bulkDiv");
+    listDiv = layoutLoc(&layout, "listDiv");
+
+    // Request events for the search box and the buttons
+    hipe_set_coalescing(session, SEARCH_EVENT, HIPE_COALESCE_LATEST);
+    hipe_cork(session);
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, SEARCH_EVENT, searchBox, 1, "input");
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, SORT_EVENT, sortButton, 1, "click");
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, SELECT_MODE_EVENT, selectButton, 1, "click");
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, SELECT_ALL_EVENT, layoutLoc(&layout, "selectAllButton"), 1, "click");
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, SELECT_COMPLETED_EVENT, layoutLoc(&layout, "selectCompletedButton"), 1, "click");
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, COMPLETE_SELECTED_EVENT, layoutLoc(&layout, "completeSelectedButton"), 1, "click");
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, MOVE_SELECTED_EVENT, layoutLoc(&layout, "moveSelectedButton"), 1, "click");
+    hipe_send(session, HIPE_OP_EVENT_REQUEST, DELETE_SELECTED_EVENT, layoutLoc(&layout, "deleteSelectedButton"), 1, "click");
+    hipe_uncork(session);
+    layoutFree(&layout);
     // // Apply some styling to the title
     // hipe_send(session, HIPE_OP_SET_STYLE, 0, main_page_title_loc, 2, "text-align", "center"); 
     // hipe_end(session, HIPE_OP_SET_STYLE, 0, main_page_title_loc, 2, "font-family", "impact, sans-serif");
@@ -410,46 +1462,96 @@ int main(int argc, char** argv)
     // hipe_send(session, HIPE_OP_EVENT_REQUEST, EXPORT_TO_FILE_EVENT, export_to_file_button, 1, "click");
     // hipe_send(session, HIPE_OP_EVENT_REQUEST, LOAD_FROM_FILE_EVENT, load_from_file_button, 1, "click");
     
+    // Text files named on the command line (after the host key) are imported by the load button.
+    // Without any, the list saved in the older text format is imported.
+    static const char* defaultImportPaths[] = { TEXT_FILE };
+    importPaths = argc > 2 ? (const char**) argv + 2 : defaultImportPaths;
+    numImportPaths = argc > 2 ? argc - 2 : 1;
+
+    // Open the store that the list is saved to, recovering any changes that weren't exported last time
+    if(!openStore())
+    {
+        displaySimpleDialog("Failure message", "Failed to open " STORE_FILE ", changes will not be saved. Check terminal log for details.");
+    }
+
+    // Register an event-handler for each of the event requestor values that we defined
+    dispatcher = hipe_dispatcher_create();
+    hipe_dispatch_requestor(dispatcher, NEW_LIST_ENTRY_EVENT, newListEntry, 0);
+    hipe_dispatch_requestor(dispatcher, EXPORT_TO_FILE_EVENT, exportToFileEvent, 0);
+    hipe_dispatch_requestor(dispatcher, LOAD_FROM_FILE_EVENT, loadFromFileEvent, 0);
+    hipe_dispatch_requestor(dispatcher, SHOW_MORE_EVENT, showMore, 0);
+    hipe_dispatch_requestor(dispatcher, SEARCH_EVENT, searchEntries, 0);
+    hipe_dispatch_requestor(dispatcher, SORT_EVENT, sortEntries, 0);
+    hipe_dispatch_requestor(dispatcher, SELECT_MODE_EVENT, toggleSelectMode, 0);
+    hipe_dispatch_requestor(dispatcher, SELECT_ALL_EVENT, selectAll, 0);
+    hipe_dispatch_requestor(dispatcher, SELECT_COMPLETED_EVENT, selectCompleted, 0);
+    hipe_dispatch_requestor(dispatcher, COMPLETE_SELECTED_EVENT, completeSelected, 0);
+    hipe_dispatch_requestor(dispatcher, MOVE_SELECTED_EVENT, moveSelected, 0);
+    hipe_dispatch_requestor(dispatcher, DELETE_SELECTED_EVENT, deleteSelected, 0);
+
     hipe_instruction event;
     hipe_instruction_init(&event);
     
     /* Main loop of the app. We wait for any events that are triggered by user actions, 
-    and call the event-handler functions accordingly */
+    and pass each one to the event-handler registered for it. In between, we carry on loading
+    the list, pick up the result of an export, and commit the journal when it is due. */
     do {
-        // Get the next instruction
-        hipe_next_instruction(session, &event, 1);
-        
-        switch(event.requestor) 
+        // Get the next instruction, without waiting for one
+        int result = hipe_next_instruction(session, &event, 0);
+        if(result < 0) break;
+        if(result == 1)
         {
-            // Based on the event requestor values that we defined, call the appropriate event-handler
-            case NEW_LIST_ENTRY_EVENT:
-            {
-                newListEntryDialog(); 
-                newListEntryInput(session);
-                break;
-            }   
-            case NEW_LIST_DELETE_EVENT:
+            hipe_dispatch(dispatcher, session, &event);
+        }
+        else if(!loaderBusy())
+        {
+            // Nothing else to do: wait for the server, the export, or the journal commit timer
+            waitForWork();
+        }
+        if(exporting.running)
+        {
+            checkExport();
+        }
+        if(journal_opened && journalTimeout(&journal) == 0)
+        {
+            if(journalCommit(&journal) != 0)
             {
-                deleteListEntry(session);
-                break;
+                perror("Error writing " JOURNAL_FILE);
             }
-            case NEW_LIST_EDIT_EVENT:
+            else if(journal.size > JOURNAL_CHECKPOINT_SIZE && !exporting.running)
             {
-                editListEntry(session);
-                break;
+                exportToFile(true); // save the journaled changes to the store, so the journal can start again
             }
-             case EXPORT_TO_FILE_EVENT:
-             {
-                exportToFile();
-                break;
-             }
-             case LOAD_FROM_FILE_EVENT:
-             {
-                loadFromFile(session);
-                break;
-             }
+        }
+        if(loaderBusy())
+        {
+            loadStep();
         }
     } while(event.opcode != HIPE_OP_FRAME_CLOSE); //repeat until window closed.
     
+    hipe_dispatcher_destroy(dispatcher);
+    if(loader.import != NULL)
+    {
+        importFinish(loader.import);
+    }
+    if(journal_opened)
+    {
+        journalClose(&journal); // commits anything still buffered
+    }
+    if(exporting.running)
+    {
+        exporting.again = false;
+        finishExport(false);
+    }
+    searchFree(&search);
+    styleFree(&styles);
+    if(traceFile != NULL)
+    {
+        hipe_trace_stop();
+    }
+    if(store_opened)
+    {
+        storeClose(&store);
+    }
     return 0;
 }